@@ -1,201 +1,213 @@
-
 #pragma once
 
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include <deque>
+#include <list>
 #include <thread>
 #include <mutex>
-#include <chrono>
+#include <condition_variable>
+#include <atomic>
 #include <fstream>
 
 #include "unsuck/unsuck.hpp"
 #include "converter_utils.h"
+#include "MemoryGovernor.h"
 
 using std::shared_ptr;
+using std::make_shared;
 using std::string;
 using std::unordered_map;
 using std::vector;
+using std::deque;
+using std::list;
 using std::thread;
 using std::mutex;
 using std::lock_guard;
+using std::unique_lock;
+using std::condition_variable;
 using std::fstream;
 using std::ios;
 using std::atomic_int64_t;
 
+// Appends buffers to files in background threads.
+// The position of a buffer in its file is reserved when it's queued, so buffers of the same file
+// end up in the order in which they were queued, but can be written by multiple threads at the same time.
+// Files stay open between writes, up to maxOpenFiles of the most recently used ones.
+// Queued buffers are claimed from the memory governor until they're written.
 struct ConcurrentWriter {
 
-	unordered_map<string, vector<shared_ptr<Buffer>>> todo;
-	unordered_map<string, int> locks;
+	struct Job {
+		string path;
+		int64_t offset = 0;
+		shared_ptr<Buffer> data;
+	};
+
+	static constexpr int64_t maxOpenFiles = 512;
+
+	// queued jobs, and the size of each file after all queued jobs are written
+	deque<Job> jobs;
+	unordered_map<string, int64_t> fileSizes;
+	mutex mtx_jobs;
+	condition_variable cv_jobs;
+
+	// open files, most recently used at the front
+	list<string> recentlyUsed;
+	unordered_map<string, std::pair<shared_ptr<OffsetFile>, list<string>::iterator>> openFiles;
+	mutex mtx_files;
+
 	atomic_int64_t todoBytes = 0;
 	atomic_int64_t writtenBytes = 0;
 
 	vector<thread> threads;
-
-	mutex mtx_todo;
-	size_t numThreads = 1;
-
 	bool joinRequested = false;
-	mutex mtx_join;
-
-	double tStart = 0;
 
 	ConcurrentWriter(size_t numThreads, State& state) {
-		this->numThreads = numThreads;
 
-		this->tStart = now();
+		state.name = "DISTRIBUTING";
 
-		for (int64_t i = 0; i < numThreads; i++) {
+		for (int64_t i = 0; i < int64_t(numThreads); i++) {
 			threads.emplace_back([&]() {
 				flushThread();
 			});
 		}
 
-		using namespace std::chrono_literals;
-
-		threads.emplace_back([&]() {
-			while (true) {
-
-				{
-					lock_guard<mutex> lockT(mtx_todo);
-					lock_guard<mutex> lockJ(mtx_join);
+	}
 
-					bool nothingTodo = todo.size() == 0;
+	~ConcurrentWriter() {
+		this->join();
+	}
 
-					if (nothingTodo && joinRequested) {
-						return;
-					}
+	// file handles may be closed by other threads once they're evicted,
+	// but the returned pointer keeps them open until the caller is done with it.
+	shared_ptr<OffsetFile> getFile(string path) {
 
-					int64_t mbTodo = todoBytes / (1024 * 1024);
-					int64_t mbDone = writtenBytes / (1024 * 1024);
+		lock_guard<mutex> lock(mtx_files);
 
-					double duration = now() - tStart;
-					double throughput = mbDone / duration;
+		auto it = openFiles.find(path);
 
-					state.name = "DISTRIBUTING";
-				}
+		if (it != openFiles.end()) {
+			auto& [file, position] = it->second;
+			recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, position);
 
-				
+			return file;
+		}
 
-				std::this_thread::sleep_for(100ms);
-			}
-		});
+		auto file = make_shared<OffsetFile>(path);
+		recentlyUsed.push_front(path);
+		openFiles[path] = { file, recentlyUsed.begin() };
 
-	}
+		if (openFiles.size() > maxOpenFiles) {
+			openFiles.erase(recentlyUsed.back());
+			recentlyUsed.pop_back();
+		}
 
-	~ConcurrentWriter() {
-		this->join();
+		return file;
 	}
 
-	void waitUntilMemoryBelow(int64_t maxMegabytesOutstanding) {
-
-		using namespace std::chrono_literals;
-
-		while (todoBytes / (1024 * 1024) > maxMegabytesOutstanding) {
-			std::this_thread::sleep_for(10ms);
-		}
+	// reserve disk space for files whose final size is known in advance
+	void preallocate(string path, int64_t size) {
+		auto file = getFile(path);
 
+		file->preallocate(size);
 	}
 
 	void flushThread() {
 
-		using namespace std::chrono_literals;
-
 		while (true) {
 
-			string path = "";
-			vector<shared_ptr<Buffer>> work;
+			Job job;
 
 			{
-				//auto tStart = now();
-				lock_guard<mutex> lockT(mtx_todo);
-				lock_guard<mutex> lockJ(mtx_join);
-				//auto duration = now() - tStart;
-				//if (duration > 0.01) {
-				//	cout << "long lock duration: " + to_string(duration) << endl;
-				//}
+				unique_lock<mutex> lock(mtx_jobs);
 
-				bool nothingTodo = todo.size() == 0;
+				cv_jobs.wait(lock, [&]() {
+					return jobs.size() > 0 || joinRequested;
+				});
 
-				if (nothingTodo && joinRequested) {
+				if (jobs.size() == 0) {
 					return;
-				} else {
+				}
 
-					auto it = todo.begin();
+				job = jobs.front();
+				jobs.pop_front();
+			}
 
-					while (it != todo.end()) {
+			auto file = getFile(job.path);
+			file->write(job.offset, job.data->data, job.data->size);
 
-						string path = it->first;
+			{
+				lock_guard<mutex> lock(mtx_jobs);
 
-						if (locks.find(path) == locks.end()) {
-							break;
-						}
+				todoBytes -= job.data->size;
+				writtenBytes += job.data->size;
+			}
 
-						it++;
-					}
+			memoryGovernor.unclaim(job.data->size);
+		}
 
+	}
 
+	// appends data to the file and returns the offset at which it will be written
+	int64_t write(string path, shared_ptr<Buffer> data) {
 
+		int64_t offset = 0;
 
-					if (it != todo.end()) {
-						path = it->first;
-						work = it->second;
+		memoryGovernor.claim(data->size);
 
-						todo.erase(it);
-						locks[path] = 1;
-					}
+		{
+			lock_guard<mutex> lock(mtx_jobs);
 
-					
-				}
-			}
+			int64_t& fileSize = fileSizes[path];
 
-			// if no work available, sleep and try again later
-			if (work.size() == 0) {
-				std::this_thread::sleep_for(10ms);
-				continue;
-			} 
+			Job job;
+			job.path = path;
+			job.offset = fileSize;
+			job.data = data;
 
-			fstream fout;
-			fout.open(path, ios::out | ios::app | ios::binary);
+			offset = fileSize;
+			fileSize += data->size;
+			todoBytes += data->size;
 
-			for (auto batch : work) {
-				fout.write(batch->data_char, batch->size);
+			jobs.push_back(job);
+		}
 
-				todoBytes -= batch->size;
-				writtenBytes += batch->size;
-			}
+		cv_jobs.notify_one();
 
-			fout.close();
+		return offset;
+	}
 
-			{
-				lock_guard<mutex> lockT(mtx_todo);
-				lock_guard<mutex> lockJ(mtx_join);
+	// writes data at the given offset. The caller makes sure that writes don't overlap.
+	void write(string path, int64_t offset, shared_ptr<Buffer> data) {
 
-				auto itLocks = locks.find(path);
-				locks.erase(itLocks);
-			}
+		memoryGovernor.claim(data->size);
 
-		}
+		{
+			lock_guard<mutex> lock(mtx_jobs);
 
-	}
+			Job job;
+			job.path = path;
+			job.offset = offset;
+			job.data = data;
 
-	void write(string path, shared_ptr<Buffer> data) {
-		lock_guard<mutex> lock(mtx_todo);
+			todoBytes += data->size;
 
-		todoBytes += data->size;
+			jobs.push_back(job);
+		}
 
-		todo[path].push_back(data);
+		cv_jobs.notify_one();
 	}
 
 	void join() {
 		{
-			lock_guard<mutex> lock(mtx_join);
+			lock_guard<mutex> lock(mtx_jobs);
 
-			//cout << "joinRequested" << endl;
 			joinRequested = true;
 		}
-		
+
+		cv_jobs.notify_all();
 
 		for (auto& t : threads) {
 			t.join();
@@ -203,8 +215,9 @@ struct ConcurrentWriter {
 
 		threads.clear();
 
-		//cout << "writer joined \n";
-
+		lock_guard<mutex> lock(mtx_files);
+		openFiles.clear();
+		recentlyUsed.clear();
 	}
 
 };
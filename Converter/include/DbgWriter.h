@@ -503,7 +503,7 @@ namespace dbgwriter{
 
 	void writeNode(Node* node, Attributes attributes){
 		
-		string dir = "D:/temp/compression/" + node->name;
+		string dir = "D:/temp/compression/" + node->name();
 
 		fs::create_directories(dir);
 
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+#include "unsuck/unsuck.hpp"
+
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::condition_variable;
+using std::string;
+
+// One memory budget for all phases of the conversion.
+//
+// reserve() blocks until the requested memory fits into the budget, and is used before work is started,
+// e.g. before a batch is decoded or a chunk is loaded. If no other reservation is active, it is admitted
+// even if it exceeds the budget, so that work that is larger than the budget still makes progress.
+//
+// claim() accounts for memory that can't wait, e.g. buffers that are allocated while holding a lock,
+// or memory that is held across phases, like chunks that are kept in memory.
+// Claims never block, but reservations wait until claimed memory is released.
+struct MemoryGovernor {
+
+	int64_t budget = 0;
+	int64_t reserved = 0;
+	int64_t peak = 0;
+	int64_t numActive = 0;
+
+	mutex mtx;
+	condition_variable cv;
+
+	void setBudget(int64_t bytes) {
+		lock_guard<mutex> lock(mtx);
+
+		budget = bytes;
+
+		cv.notify_all();
+	}
+
+	void reserve(int64_t bytes) {
+		unique_lock<mutex> lock(mtx);
+
+		cv.wait(lock, [&]() {
+			return reserved + bytes <= budget || numActive == 0;
+		});
+
+		reserved += bytes;
+		peak = std::max(peak, reserved);
+		numActive++;
+	}
+
+	void release(int64_t bytes) {
+		{
+			lock_guard<mutex> lock(mtx);
+
+			reserved -= bytes;
+			numActive--;
+		}
+
+		cv.notify_all();
+	}
+
+	void claim(int64_t bytes) {
+		lock_guard<mutex> lock(mtx);
+
+		reserved += bytes;
+		peak = std::max(peak, reserved);
+	}
+
+	// claims the memory only if it fits into the budget
+	bool tryClaim(int64_t bytes, int64_t limit) {
+		lock_guard<mutex> lock(mtx);
+
+		if (reserved + bytes > std::min(budget, limit)) {
+			return false;
+		}
+
+		reserved += bytes;
+		peak = std::max(peak, reserved);
+
+		return true;
+	}
+
+	void unclaim(int64_t bytes) {
+		{
+			lock_guard<mutex> lock(mtx);
+
+			reserved -= bytes;
+		}
+
+		cv.notify_all();
+	}
+
+	// 3/4 of the physical memory, or of the cgroup limit if the process runs in a container with less memory
+	static int64_t getDefaultBudget() {
+		int64_t available = getMemoryData().physical_total;
+
+	#if defined(__linux__)
+		for (string path : { "/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes" }) {
+			std::ifstream file(path);
+			string value;
+
+			if (file >> value && value != "max") {
+				try {
+					available = std::min(available, int64_t(std::stoll(value)));
+				} catch (...) {}
+			}
+		}
+	#endif
+
+		return (available / 4) * 3;
+	}
+
+};
+
+inline MemoryGovernor memoryGovernor;
@@ -154,6 +154,7 @@ inline vector<Attribute> computeOutputAttributes(LasHeader& header) {
 	Attribute XYZt("XYZ(t)", 12, 3, 4, AttributeType::FLOAT);
 	Attribute classificationFlags("classification flags", 1, 1, 1, AttributeType::UINT8);
 	Attribute scanAngle("scan angle", 2, 1, 2, AttributeType::INT16);
+	Attribute nir("nir", 2, 1, 2, AttributeType::UINT16);
 
 	vector<Attribute> list;
 
@@ -179,6 +180,18 @@ inline vector<Attribute> computeOutputAttributes(LasHeader& header) {
 		list = { xyz, intensity, returnNumber, numberOfReturns, classificationFlags, classification, userData, scanAngle, pointSourceId, gpsTime };
 	} else if (format == 7) {
 		list = { xyz, intensity, returnNumber, numberOfReturns, classificationFlags, classification, userData, scanAngle, pointSourceId, gpsTime, rgb };
+	} else if (format == 8) {
+		list = { xyz, intensity, returnNumber, numberOfReturns, classificationFlags, classification, userData, scanAngle, pointSourceId, gpsTime, rgb, nir };
+	} else if (format == 9) {
+		list = { xyz, intensity, returnNumber, numberOfReturns, classificationFlags, classification, userData, scanAngle, pointSourceId, gpsTime,
+			wavePacketDescriptorIndex, byteOffsetToWaveformData, waveformPacketSize, returnPointWaveformLocation,
+			XYZt
+		};
+	} else if (format == 10) {
+		list = { xyz, intensity, returnNumber, numberOfReturns, classificationFlags, classification, userData, scanAngle, pointSourceId, gpsTime, rgb, nir,
+			wavePacketDescriptorIndex, byteOffsetToWaveformData, waveformPacketSize, returnPointWaveformLocation,
+			XYZt
+		};
 	} else {
 		cout << "ERROR: currently unsupported LAS format: " << int(format) << endl;
 
@@ -193,7 +206,6 @@ inline vector<Attribute> computeOutputAttributes(LasHeader& header) {
 }
 
 inline Attributes computeOutputAttributes(vector<Source>& sources, vector<string> requestedAttributes) {
-	// TODO: a bit wasteful to iterate over source files and load headers twice
 
 	Vector3 scaleMin = { Infinity, Infinity, Infinity };
 	//Vector3 offset = { Infinity, Infinity, Infinity};
@@ -210,9 +222,13 @@ inline Attributes computeOutputAttributes(vector<Source>& sources, vector<string
 		auto parallel = std::execution::par;
 		for_each(parallel, sources.begin(), sources.end(), [&mtx, &sources, &scaleMin, &min, &max, requestedAttributes, &fullAttributeList, &acceptedAttributeNames](Source source) {
 
-			auto header = loadLasHeader(source.path);
+			// headers are usually already parsed by the SourceCatalog
+			shared_ptr<LasHeader> header = source.header;
+			if (header == nullptr) {
+				header = make_shared<LasHeader>(loadLasHeader(source.path));
+			}
 
-			vector<Attribute> attributes = computeOutputAttributes(header);
+			vector<Attribute> attributes = computeOutputAttributes(*header);
 
 			mtx.lock();
 
@@ -225,17 +241,17 @@ inline Attributes computeOutputAttributes(vector<Source>& sources, vector<string
 				}
 			}
 
-			scaleMin.x = std::min(scaleMin.x, header.scale.x);
-			scaleMin.y = std::min(scaleMin.y, header.scale.y);
-			scaleMin.z = std::min(scaleMin.z, header.scale.z);
+			scaleMin.x = std::min(scaleMin.x, header->scale.x);
+			scaleMin.y = std::min(scaleMin.y, header->scale.y);
+			scaleMin.z = std::min(scaleMin.z, header->scale.z);
 
-			min.x = std::min(min.x, header.min.x);
-			min.y = std::min(min.y, header.min.y);
-			min.z = std::min(min.z, header.min.z);
+			min.x = std::min(min.x, header->min.x);
+			min.y = std::min(min.y, header->min.y);
+			min.z = std::min(min.z, header->min.z);
 
-			max.x = std::max(max.x, header.max.x);
-			max.y = std::max(max.y, header.max.y);
-			max.z = std::max(max.z, header.max.z);
+			max.x = std::max(max.x, header->max.x);
+			max.y = std::max(max.y, header->max.y);
+			max.z = std::max(max.z, header->max.z);
 
 			mtx.unlock();
 			});
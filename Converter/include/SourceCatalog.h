@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "converter_utils.h"
+#include "LasLoader/LasLoader.h"
+
+using std::string;
+using std::vector;
+using std::unordered_map;
+
+// headers, VLRs and laz chunk tables of all input files, parsed once and shared by all phases.
+// Can be stored as a sidecar file so that repeated conversions of the same files
+// only need to parse files that were added or modified since.
+struct SourceCatalog {
+
+	struct Entry {
+		string path;
+		int64_t filesize = 0;
+		int64_t lastModified = 0;
+
+		shared_ptr<LasHeader> header;
+		vector<int64_t> chunkSizes;
+	};
+
+	unordered_map<string, Entry> entries;
+
+	// number of entries that were parsed in the last update(), rather than taken from the catalog file
+	int64_t numParsed = 0;
+
+	// returns an empty catalog if the file doesn't exist or can't be parsed
+	static SourceCatalog load(string path);
+
+	void save(string path);
+
+	// parses all files that are new or whose size or modification time changed
+	void update(vector<string> paths);
+
+	Source createSource(string path);
+
+};
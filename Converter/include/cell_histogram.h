@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <execution>
+
+using std::vector;
+
+namespace chunker_countsort_laszip {
+
+	// point count of a morton-ordered grid cell. 
+	// Counting grids are stored as lists of occupied cells, sorted by cell, so that memory scales with the occupied cells rather than the volume.
+	struct CellCount {
+		int64_t cell;
+		int64_t count;
+	};
+
+	// Sparse per-thread point counts of grid cells.
+	// Counting threads accumulate into their own histogram instead of incrementing shared counters, 
+	// and the histograms of all threads are merged when counting ends.
+	// Consecutive points in the same cell, which are common in las files, are merged before they reach the hash table.
+	struct CellHistogram {
+
+		// open addressing with linear probing, grows at 50% load
+		int64_t capacityBits = 16;
+		int64_t capacity = int64_t(1) << capacityBits;
+
+		vector<int64_t> cells;
+		vector<int64_t> counts;
+		int64_t numCells = 0;
+
+		int64_t runCell = -1;
+		int64_t runCount = 0;
+
+		CellHistogram() {
+			cells.resize(capacity, -1);
+			counts.resize(capacity, 0);
+		}
+
+		void add(int64_t cell) {
+			if (cell == runCell) {
+				runCount++;
+			} else {
+				addRun();
+
+				runCell = cell;
+				runCount = 1;
+			}
+		}
+
+		void addRun() {
+			if (runCount == 0) {
+				return;
+			}
+
+			insert(runCell, runCount);
+
+			runCell = -1;
+			runCount = 0;
+		}
+
+		void insert(int64_t cell, int64_t count) {
+			uint64_t slot = (uint64_t(cell) * 0x9E3779B97F4A7C15ull) >> (64 - capacityBits);
+
+			while (cells[slot] != -1 && cells[slot] != cell) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+
+			if (cells[slot] == -1) {
+				cells[slot] = cell;
+				numCells++;
+			}
+			counts[slot] += count;
+
+			if (2 * numCells >= capacity) {
+				grow();
+			}
+		}
+
+		void grow() {
+			vector<int64_t> oldCells = std::move(cells);
+			vector<int64_t> oldCounts = std::move(counts);
+
+			capacityBits++;
+			capacity = int64_t(1) << capacityBits;
+			cells.assign(capacity, -1);
+			counts.assign(capacity, 0);
+			numCells = 0;
+
+			for (int64_t slot = 0; slot < int64_t(oldCells.size()); slot++) {
+				if (oldCells[slot] != -1) {
+					insert(oldCells[slot], oldCounts[slot]);
+				}
+			}
+		}
+
+		// unsorted list of all cells with points
+		vector<CellCount> toList() {
+			addRun();
+
+			vector<CellCount> list;
+			list.reserve(numCells);
+
+			for (int64_t slot = 0; slot < capacity; slot++) {
+				if (cells[slot] != -1) {
+					list.push_back({cells[slot], counts[slot]});
+				}
+			}
+
+			return list;
+		}
+
+	};
+
+	// sorted list of the cells of all histograms, with the counts of cells that are in multiple histograms summed up
+	inline vector<CellCount> mergeHistograms(vector<CellHistogram*>& histograms) {
+
+		vector<vector<CellCount>> lists(histograms.size());
+		std::transform(std::execution::par, histograms.begin(), histograms.end(), lists.begin(), [](CellHistogram* histogram) {
+			return histogram->toList();
+		});
+
+		vector<CellCount> grid;
+		for (auto& list : lists) {
+			grid.insert(grid.end(), list.begin(), list.end());
+			list = vector<CellCount>();
+		}
+
+		std::sort(std::execution::par, grid.begin(), grid.end(), [](const CellCount& a, const CellCount& b) {
+			return a.cell < b.cell;
+		});
+
+		// sum up counts of cells that were visited by multiple threads
+		int64_t numCells = 0;
+		for (int64_t i = 0; i < int64_t(grid.size()); i++) {
+			if (numCells > 0 && grid[numCells - 1].cell == grid[i].cell) {
+				grid[numCells - 1].count += grid[i].count;
+			} else {
+				grid[numCells] = grid[i];
+				numCells++;
+			}
+		}
+		grid.resize(numCells);
+
+		return grid;
+	}
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <memory>
+
+#include "unsuck/unsuck.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+// block codec for temporary chunk data. 
+// Positions are stored as zigzag encoded deltas to the previous point, 
+// then all records are transposed into one stream per byte of the point layout and compressed with a fast brotli setting.
+// Expects the first 12 bytes of each record to be the int32 xyz position, as in the chunker's output layout.
+namespace chunk_codec {
+
+	// name of the encoding, as stored in the chunk manifest
+	inline const string name = "DELTA_BROTLI";
+
+	shared_ptr<Buffer> encode(uint8_t* points, int64_t numPoints, int64_t bytesPerPoint);
+
+	// decodes <numPoints> records from an encoded block into <target>
+	void decode(uint8_t* encoded, int64_t encodedSize, int64_t numPoints, int64_t bytesPerPoint, uint8_t* target);
+
+}
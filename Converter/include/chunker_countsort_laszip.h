@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 
 #include "Vector3.h"
 #include "Attributes.h"
@@ -10,12 +11,16 @@
 
 using std::string;
 using std::vector;
+using std::shared_ptr;
 
 class Source;
 class State;
+struct Options;
+struct ResidentChunks;
 
 namespace chunker_countsort_laszip {
 
-	void doChunking(vector<Source> sources, string targetDir, Vector3 min, Vector3 max, State& state, Attributes outputAttributes, Monitor* monitor);
+	// returns the chunks that were kept in memory, if any
+	shared_ptr<ResidentChunks> doChunking(vector<Source> sources, string targetDir, Vector3 min, Vector3 max, State& state, Attributes outputAttributes, Options& options, Monitor* monitor);
 
 }
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include <mutex>
 #include <atomic>
 #include <map>
+#include <unordered_map>
 
 //#include "LasLoader/LasLoader.h"
 #include "unsuck/unsuck.hpp"
@@ -39,6 +40,8 @@ struct LASPointF2 {
 };
 
 
+struct LasHeader;
+
 struct Source {
 	string path;
 	uint64_t filesize;
@@ -47,6 +50,12 @@ struct Source {
 	int bytesPerPoint = 0;
 	Vector3 min;
 	Vector3 max;
+
+	// parsed once, see SourceCatalog
+	shared_ptr<LasHeader> header;
+
+	// point counts of the laz chunks, empty for las or unchunked laz files
+	vector<int64_t> chunkSizes;
 };
 
 struct State {
@@ -68,6 +77,13 @@ struct State {
 };
 
 
+// chunks that the chunker kept in memory, handed directly to the indexer.
+// manifest has the same format as chunks/metadata.json. Chunks that aren't in points were spilled to the chunk file.
+struct ResidentChunks {
+	string manifest;
+	std::unordered_map<string, shared_ptr<Buffer>> points;
+};
+
 struct BoundingBox {
 	Vector3 min;
 	Vector3 max;
@@ -163,6 +179,8 @@ struct Options {
 	string name = "";
 	string method = "";
 	string chunkMethod = "";
+	string chunkCompression = "AUTO"; // "ON", "OFF"
+	double maxMemory = 0.0; // MB, 0 for a budget derived from the physical memory
 	//vector<string> flags;
 	vector<string> attributes;
 	bool generatePage = false;
@@ -173,5 +191,8 @@ struct Options {
 	bool keepChunks = false;
 	bool noChunking = false;
 	bool noIndexing = false;
+	bool removeDuplicates = false;
+
+	string catalog = "";
 
 };
\ No newline at end of file
@@ -0,0 +1,58 @@
+
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+
+#include "Vector3.h"
+
+using std::string;
+using std::vector;
+
+// batch kernels that quantize coordinates and map them to grid cells.
+// AVX2 and AVX-512 versions are selected at runtime if the CPU supports them.
+// All versions produce the same results as the scalar one, bit by bit.
+// grid_kernels.cpp is compiled with -ffp-contract=off, so that no version is compiled with FMAs.
+namespace grid_kernels {
+
+	// a cubic grid with <gridSize>³ cells over the box [min, min + size].
+	// int32 coordinates are transformed to world space with X * scale + offset.
+	struct CellGrid {
+		Vector3 scale;
+		Vector3 offset;
+		Vector3 min;
+		Vector3 size;
+		int64_t gridSize = 0;
+	};
+
+	// converts the int32 coordinates at the start of each <stride> sized record to another scale/offset:
+	// X' = int32((X * scale + offset - targetOffset) / targetScale)
+	// <target> receives 3 int32 values per point.
+	void quantize(uint8_t* source, int64_t stride, int64_t numPoints, Vector3 scale, Vector3 offset, Vector3 targetScale, Vector3 targetOffset, int32_t* target);
+
+	// morton-ordered cell indices of the chunker grid, with the same bit order as computeMortonIndices().
+	// u = (X * scale + offset - min) / size, ix = int64(min(gridSize * u, gridSize - 1))
+	// points with u outside of [0, 1] get index -1.
+	void computeCellIndices(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices);
+
+	// morton-ordered cell indices, as used by the indexer's buildHierarchy().
+	// ix = clamp(int64(gridSize * (X * scale + offset - min) / size), 0, gridSize - 1)
+	void computeMortonIndices(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices);
+
+	// "AVX-512", "AVX2" or "scalar"
+	string getKernelName();
+
+	// one version of the kernels
+	struct Kernels {
+		string name = "scalar";
+		void (*quantize)(uint8_t* source, int64_t stride, int64_t numPoints, Vector3 scale, Vector3 offset, Vector3 targetScale, Vector3 targetOffset, int32_t* target) = nullptr;
+		void (*computeCellIndices)(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) = nullptr;
+		void (*computeMortonIndices)(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) = nullptr;
+	};
+
+	// all versions that the CPU supports, starting with the scalar one. The last one is used.
+	vector<Kernels> getSupportedKernels();
+
+}
@@ -46,6 +46,14 @@ namespace indexer{
 	//constexpr int numFlushThreads = 36;
 	constexpr int maxPointsPerChunk = 10'000;
 
+	// chunks with at least this many points are split into their octants 
+	// if there are not enough queued chunks left to keep all threads busy
+	constexpr int64_t minPointsToSplitChunk = 1'000'000;
+
+	// chunks are not split beyond this level. Each split adds a level above the chunk's own octree,
+	// which may need many levels if points are clustered, and node keys only fit <maxNodeLevel> levels.
+	constexpr int64_t maxSplitChunkLevel = maxNodeLevel - 12;
+
 	inline int numSampleThreads() {
 		return getCpuData().numProcessors;
 	}
@@ -62,6 +70,31 @@ namespace indexer{
 
 		string file;
 		string id;
+
+		// byte range of the chunk's points in file
+		int64_t offset = 0;
+		int64_t size = 0;
+
+		// compressed chunks are stored in blocks, see chunk_codec. size is the decoded size of all blocks.
+		struct Block {
+			int64_t offset = 0;
+			int64_t size = 0;
+			int64_t numPoints = 0;
+		};
+
+		vector<Block> blocks;
+
+		// points of a chunk that the chunker kept in memory
+		shared_ptr<Buffer> points;
+
+		// from the manifest. storedBytes is the size of the chunk in the chunk file, 0 if it's kept in memory
+		int64_t numPoints = 0;
+		int64_t storedBytes = 0;
+
+		// estimated cost of indexing the chunk, in bytes to read and bytes to sort and sample
+		int64_t cost() {
+			return storedBytes + size;
+		}
 	};
 
 	struct Chunks {
@@ -70,6 +103,9 @@ namespace indexer{
 		Vector3 max;
 		Attributes attributes;
 
+		// file that contains all chunks. empty if each chunk is stored in its own file.
+		string file;
+
 		Chunks(vector<shared_ptr<Chunk>> list, Vector3 min, Vector3 max) {
 			this->list = list;
 			this->min = min;
@@ -78,7 +114,8 @@ namespace indexer{
 
 	};
 
-	shared_ptr<Chunks> getChunks(string pathIn);
+	// chunks listed in <pathIn>/chunks/metadata.json, or in the manifest of residentChunks if the chunker kept chunks in memory
+	shared_ptr<Chunks> getChunks(string pathIn, shared_ptr<ResidentChunks> residentChunks = nullptr);
 
 	
 
@@ -97,6 +134,9 @@ namespace indexer{
 
 		bool closeRequested = false;
 		bool closed = false;
+
+		// wakes the writer thread when a buffer is added to the backlog, or when closing is requested
+		std::condition_variable cvBacklog;
 		std::condition_variable cvClose;
 
 		fstream fsOctree;
@@ -147,7 +187,7 @@ namespace indexer{
 			lock_guard<mutex> lock(mtx);
 
 			HNode hnode = {
-				.name       = node->name,
+				.name       = node->name(),
 				.byteOffset = node->byteOffset,
 				.byteSize   = node->byteSize,
 				.numPoints  = node->numPoints,
@@ -250,13 +290,13 @@ namespace indexer{
 	};
 
 	struct FlushedChunkRoot {
-		shared_ptr<Node> node;
+		Node* node = nullptr;
 		int64_t offset = 0;
 		int64_t size = 0;
 	};
 
 	struct CRNode{
-		string name = "";
+		uint64_t key = 1;
 		Node* node;
 		vector<shared_ptr<CRNode>> children;
 		vector<FlushedChunkRoot> fcrs;
@@ -307,15 +347,21 @@ namespace indexer{
 		Options options;
 
 		Attributes attributes;
-		shared_ptr<Node> root;
+		Node* root = nullptr;
 
 		shared_ptr<Writer> writer;
 		shared_ptr<HierarchyFlusher> hierarchyFlusher;
 
-		vector<shared_ptr<Node>> detachedParts;
+		// the root, the chunk roots and the nodes between them. 
+		// The local octrees of the chunks are built in arenas of their own.
+		NodeArena arena;
+		mutex mtx_arena;
 
 		atomic_int64_t byteOffset = 0;
 
+		// points that were dropped because another point has the same position
+		atomic_int64_t numDuplicatesDropped = 0;
+
 		double scale = 0.001;
 		double spacing = 1.0;
 
@@ -348,10 +394,6 @@ namespace indexer{
 			fChunkRoots.close();
 		}
 
-		void waitUntilWriterBacklogBelow(int maxMegabytes);
-
-		void waitUntilMemoryBelow(int maxMegabytes);
-
 		string createMetadata(Options options, State& state, Hierarchy hierarchy);
 
 		string createDebugHierarchy();
@@ -362,7 +404,13 @@ namespace indexer{
 
 		Hierarchy createHierarchy(string path);
 
-		void flushChunkRoot(shared_ptr<Node> chunkRoot);
+		Node* createNode(uint64_t key, Vector3 min, Vector3 max) {
+			lock_guard<mutex> lock(mtx_arena);
+
+			return arena.create(key, min, max);
+		}
+
+		void flushChunkRoot(Node* chunkRoot);
 
 		void reloadChunkRoots();
 
@@ -376,7 +424,7 @@ namespace indexer{
 		string do_grouping() const { return "\3"; }
 	};
 
-	void doIndexing(string targetDir, State& state, Options& options, Sampler& sampler);
+	void doIndexing(string targetDir, State& state, Options& options, Sampler& sampler, shared_ptr<ResidentChunks> residentChunks = nullptr);
 
 
 }
\ No newline at end of file
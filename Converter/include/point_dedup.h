@@ -0,0 +1,20 @@
+
+#pragma once
+
+#include <cstdint>
+
+// finds points with the same int32 xyz position as an earlier point.
+// Expects the first 12 bytes of each record to be the position, as in the chunks and the nodes of the indexer.
+// Positions are looked up in an open-addressing hash table of point indices, 
+// with twice as many slots as points and linear probing.
+namespace point_dedup {
+
+	// number of points whose position already occurs earlier in <points>
+	int64_t countDuplicates(uint8_t* points, int64_t numPoints, int64_t bytesPerPoint);
+
+	// removes points whose position already occurs earlier in <points>, so that the first of each position remains.
+	// The remaining points are moved to the start of <points>, in their previous order.
+	// returns the number of remaining points.
+	int64_t removeDuplicates(uint8_t* points, int64_t numPoints, int64_t bytesPerPoint);
+
+}
@@ -10,6 +10,11 @@
 
 struct SamplerPoisson : public Sampler {
 
+	// a Point, an accepted flag, two slots of the cell table and a link to the previous point in the cell
+	int64_t scratchBytesPerPoint() {
+		return 64;
+	}
+
 	// subsample a local octree from bottom up
 	void sample(Node* node, Attributes attributes, double baseSpacing, 
 		function<void(Node*)> onNodeCompleted, 
@@ -25,10 +30,11 @@ struct SamplerPoisson : public Sampler {
 		};
 
 		function<void(Node*, function<void(Node*)>)> traversePost = [&traversePost](Node* node, function<void(Node*)> callback) {
-			for (auto child : node->children) {
+			for (int64_t i = 0; i < node->numChildren(); i++) {
+				Node* child = node->children[i];
 
-				if (child != nullptr && !child->sampled) {
-					traversePost(child.get(), callback);
+				if (!child->sampled) {
+					traversePost(child, callback);
 				}
 			}
 
@@ -64,10 +70,8 @@ struct SamplerPoisson : public Sampler {
 			// save result in an array with one element for each point
 
 			int64_t numPointsInChildren = 0;
-			for (auto child : node->children) {
-				if (child == nullptr) {
-					continue;
-				}
+			for (int64_t i = 0; i < node->numChildren(); i++) {
+				Node* child = node->children[i];
 
 				numPointsInChildren += child->numPoints;
 			}
@@ -80,7 +84,7 @@ struct SamplerPoisson : public Sampler {
 			int64_t numAccepted = 0;
 
 			for (int64_t childIndex = 0; childIndex < 8; childIndex++) {
-				auto child = node->children[childIndex];
+				Node* child = node->child(childIndex);
 
 				if (child == nullptr) {
 					acceptedChildPointFlags.push_back({});
@@ -107,10 +111,6 @@ struct SamplerPoisson : public Sampler {
 
 			}
 
-			unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-
-			thread_local vector<Point> dbgAccepted(1'000'000);
-			int64_t dbgNumAccepted = 0;
 			double spacing = baseSpacing / pow(2.0, node->level());
 			double squaredSpacing = spacing * spacing;
 
@@ -126,59 +126,6 @@ struct SamplerPoisson : public Sampler {
 
 			auto center = (node->min + node->max) * 0.5;
 
-			//int dbgChecks = -1;
-			//int dbgSumChecks = 0;
-			//int dbgMaxChecks = 0;
-
-			auto checkAccept = [/*&dbgChecks, &dbgSumChecks,*/ &dbgNumAccepted, spacing, squaredSpacing, &squaredDistance, center /*, &numDistanceChecks*/](Point candidate) {
-
-				auto cx = candidate.x - center.x;
-				auto cy = candidate.y - center.y;
-				auto cz = candidate.z - center.z;
-				auto cdd = cx * cx + cy * cy + cz * cz;
-				auto cd = sqrt(cdd);
-				auto limit = (cd - spacing);
-				auto limitSquared = limit * limit;
-
-				int64_t j = 0;
-				for (int64_t i = dbgNumAccepted - 1; i >= 0; i--) {
-
-					auto& point = dbgAccepted[i];
-
-					//dbgChecks++;
-					//dbgSumChecks++;
-
-					// check distance to center
-					auto px = point.x - center.x;
-					auto py = point.y - center.y;
-					auto pz = point.z - center.z;
-					auto pdd = px * px + py * py + pz * pz;
-					//auto pd = sqrt(pdd);
-
-					// stop when differences to center between candidate and accepted exceeds the spacing
-					// any other previously accepted point will be even closer to the center.
-					if (pdd < limitSquared) {
-						return true;
-					}
-
-					double dd = squaredDistance(point, candidate);
-
-					if (dd < squaredSpacing) {
-						return false;
-					}
-
-					j++;
-
-					// also put a limit at x distance checks
-					if (j > 10'000) {
-						return true;
-					}
-				}
-
-				return true;
-
-			};
-
 			auto parallel = std::execution::par_unseq;
 			std::sort(parallel, points.begin(), points.end(), [center](Point a, Point b) -> bool {
 
@@ -202,81 +149,95 @@ struct SamplerPoisson : public Sampler {
 				//return a.z < b.z;
 			});
 
-			for (Point point : points) {
+			// accepted points are registered in a grid with cells of at least <spacing>, so a candidate
+			// only needs to be checked against the accepted points of its own and the 26 neighbouring cells.
+			// Occupied cells are stored in a hash table with linear probing. Each maps to the last point
+			// that was accepted in the cell, and the accepted points of a cell are linked through <previousInCell>.
+			int64_t gridSize = std::clamp(int64_t(std::min({ size.x, size.y, size.z }) / spacing), int64_t(1), int64_t(1024));
 
-				//dbgChecks = 0;
+			struct CellSlot {
+				uint32_t cell = 0; // cell index + 1, 0 if the slot is empty
+				int32_t last = -1;
+			};
 
-				bool isAccepted = checkAccept(point);
+			uint64_t numSlots = std::bit_ceil(uint64_t(2 * points.size() + 2));
+			uint64_t slotMask = numSlots - 1;
+			vector<CellSlot> slots(numSlots);
+			vector<int32_t> previousInCell(points.size(), -1);
 
-				//dbgMaxChecks = std::max(dbgChecks, dbgMaxChecks);
+			// the slot of <cell>, or the empty slot where it would be inserted
+			auto findSlot = [&slots, slotMask](uint32_t cell) -> CellSlot& {
+				uint64_t slot = ((uint64_t(cell) * 0x9E37'79B9'7F4A'7C15ull) >> 32) & slotMask;
 
-				if (isAccepted) {
-					dbgAccepted[dbgNumAccepted] = point;
-					dbgNumAccepted++;
-					numAccepted++;
-				} else {
-					numRejectedPerChild[point.childIndex]++;
+				while (slots[slot].cell != 0 && slots[slot].cell != cell) {
+					slot = (slot + 1) & slotMask;
 				}
 
-				//{ // debug: store sample time in GPS time attribute
-				//		auto child = node->children[point.childIndex];
-				//		auto data = child->points->data_u8;
+				return slots[slot];
+			};
+
+			auto toCell = [gridSize](double value, double min, double size) -> int64_t {
+				int64_t cell = double(gridSize) * (value - min) / size;
 
-				//		//static double value = 0.0;
+				return std::clamp(cell, int64_t(0), gridSize - 1);
+			};
 
+			for (int64_t i = 0; i < int64_t(points.size()); i++) {
+				Point& candidate = points[i];
 
-				//		//value += 0.1;
+				int64_t cx = toCell(candidate.x, min.x, size.x);
+				int64_t cy = toCell(candidate.y, min.y, size.y);
+				int64_t cz = toCell(candidate.z, min.z, size.z);
 
-				//		//if(node->level() <= 2){
-				//			std::lock_guard<mutex> lock(mtx_debug);
+				bool isAccepted = true;
 
-				//			debug += 0.01;
-				//			memcpy(data + point.pointIndex * attributes.bytes + 20, &debug, 8);
-				//		//}
-				//		//double value = now();
+				for (int64_t z = std::max(cz - 1, int64_t(0)); z <= std::min(cz + 1, gridSize - 1) && isAccepted; z++)
+				for (int64_t y = std::max(cy - 1, int64_t(0)); y <= std::min(cy + 1, gridSize - 1) && isAccepted; y++)
+				for (int64_t x = std::max(cx - 1, int64_t(0)); x <= std::min(cx + 1, gridSize - 1) && isAccepted; x++) {
+					uint32_t cell = uint32_t(x + y * gridSize + z * gridSize * gridSize) + 1;
 
-				//		//point.pointIndex
-				//}
+					for (int32_t j = findSlot(cell).last; j != -1; j = previousInCell[j]) {
+						if (squaredDistance(points[j], candidate) < squaredSpacing) {
+							isAccepted = false;
+							break;
+						}
+					}
+				}
 
-				acceptedChildPointFlags[point.childIndex][point.pointIndex] = isAccepted ? 1 : 0;
+				if (isAccepted) {
+					uint32_t cell = uint32_t(cx + cy * gridSize + cz * gridSize * gridSize) + 1;
+					CellSlot& slot = findSlot(cell);
 
-				//abc++;
+					slot.cell = cell;
+					previousInCell[i] = slot.last;
+					slot.last = int32_t(i);
 
+					numAccepted++;
+				} else {
+					numRejectedPerChild[candidate.childIndex]++;
+				}
+
+				acceptedChildPointFlags[candidate.childIndex][candidate.pointIndex] = isAccepted ? 1 : 0;
 			}
 
 			auto accepted = make_shared<Buffer>(numAccepted * attributes.bytes);
 			for (int64_t childIndex = 0; childIndex < 8; childIndex++) {
-				auto child = node->children[childIndex];
+				Node* child = node->child(childIndex);
 
 				if (child == nullptr) {
 					continue;
 				}
 
-				auto numRejected = numRejectedPerChild[childIndex];
+				// rejected points remain in the child's range, without being copied
 				auto& acceptedFlags = acceptedChildPointFlags[childIndex];
-				auto rejected = make_shared<Buffer>(numRejected * attributes.bytes);
+				auto numRejected = extractAcceptedPoints(child, acceptedFlags.data(), accepted.get(), attributes.bytes);
 
-				for (int64_t i = 0; i < child->numPoints; i++) {
-					auto isAccepted = acceptedFlags[i];
-					int64_t pointOffset = i * attributes.bytes;
+				if (numRejected == 0 && child->isLeaf() && !child->isChunkRoot) {
+					onNodeDiscarded(child);
 
-					if (isAccepted) {
-						accepted->write(child->points->data_u8 + pointOffset, attributes.bytes);
-						// rejected->write(child->points->data_u8 + pointOffset, attributes.bytes);
-					} else {
-						rejected->write(child->points->data_u8 + pointOffset, attributes.bytes);
-					}
-				}
-
-				if (numRejected == 0 && child->isLeaf()) {
-					onNodeDiscarded(child.get());
-
-					node->children[childIndex] = nullptr;
+					node->removeChild(childIndex);
 				} if (numRejected > 0) {
-					child->points = rejected;
-					child->numPoints = numRejected;
-
-					onNodeCompleted(child.get());
+					onNodeCompleted(child);
 				} else if(numRejected == 0) {
 					// the parent has taken all points from this child, 
 					// so make this child an empty inner node.
@@ -286,7 +247,7 @@ struct SamplerPoisson : public Sampler {
 					// https://github.com/potree/potree/issues/1125
 					child->points = nullptr;
 					child->numPoints = 0;
-					onNodeCompleted(child.get());
+					onNodeCompleted(child);
 				}
 			}
 
@@ -10,6 +10,11 @@
 
 struct SamplerPoissonAverage : public Sampler {
 
+	// a Point, an accepted flag, a link to the previous point in the cell, about one cell per point and an AcceptedPoint
+	int64_t scratchBytesPerPoint() {
+		return 104;
+	}
+
 	// subsample a local octree from bottom up
 	void sample(Node* node, Attributes attributes, double baseSpacing, 
 		function<void(Node*)> onNodeCompleted,
@@ -22,21 +27,31 @@ struct SamplerPoissonAverage : public Sampler {
 			double z;
 			int32_t pointIndex;
 			int32_t childIndex;
+			uint16_t r;
+			uint16_t g;
+			uint16_t b;
+		};
 
-			int64_t r = 0;
-			int64_t g = 0;
-			int64_t b = 0;
-			int64_t w = 0;
-
-			int64_t mainIndex = 0;
-			bool accepted = false;
+		// accepted points, stored contiguously by grid cell,
+		// together with the colour sums of the candidates within <spacing>
+		struct AcceptedPoint {
+			double x;
+			double y;
+			double z;
+			int32_t pointIndex;
+			int32_t childIndex;
+			uint32_t r;
+			uint32_t g;
+			uint32_t b;
+			uint32_t w;
 		};
 
 		function<void(Node*, function<void(Node*)>)> traversePost = [&traversePost](Node* node, function<void(Node*)> callback) {
-			for (auto child : node->children) {
+			for (int64_t i = 0; i < node->numChildren(); i++) {
+				Node* child = node->children[i];
 
-				if (child != nullptr && !child->sampled) {
-					traversePost(child.get(), callback);
+				if (!child->sampled) {
+					traversePost(child, callback);
 				}
 			}
 
@@ -47,7 +62,7 @@ struct SamplerPoissonAverage : public Sampler {
 		Vector3 scale = attributes.posScale;
 		Vector3 offset = attributes.posOffset;
 
-		traversePost(node, [bytesPerPoint, baseSpacing, scale, offset, &onNodeCompleted, &attributes](Node* node) {
+		traversePost(node, [bytesPerPoint, baseSpacing, scale, offset, &onNodeCompleted, &onNodeDiscarded, &attributes](Node* node) {
 			node->sampled = true;
 
 			int64_t numPoints = node->numPoints;
@@ -72,11 +87,9 @@ struct SamplerPoissonAverage : public Sampler {
 			// first, check for each point whether it's accepted or rejected
 			// save result in an array with one element for each point
 
-			int numPointsInChildren = 0;
-			for (auto child : node->children) {
-				if (child == nullptr) {
-					continue;
-				}
+			int64_t numPointsInChildren = 0;
+			for (int64_t i = 0; i < node->numChildren(); i++) {
+				Node* child = node->children[i];
 
 				numPointsInChildren += child->numPoints;
 			}
@@ -88,8 +101,10 @@ struct SamplerPoissonAverage : public Sampler {
 			vector<int64_t> numRejectedPerChild(8, 0);
 			int64_t numAccepted = 0;
 
-			for (int childIndex = 0; childIndex < 8; childIndex++) {
-				auto child = node->children[childIndex];
+			int offsetRGB = attributes.getOffset("rgb");
+
+			for (int64_t childIndex = 0; childIndex < 8; childIndex++) {
+				Node* child = node->child(childIndex);
 
 				if (child == nullptr) {
 					acceptedChildPointFlags.push_back({});
@@ -98,34 +113,10 @@ struct SamplerPoissonAverage : public Sampler {
 					continue;
 				}
 
-				bool childIsLeaf = child->isLeaf();
-
-				int offsetRGB = attributes.getOffset("rgb");
-				//if (child->isLeaf()) {
-
-				//	vector<CumulativeColor> colors;
-				//	colors.reserve(node->numPoints);
-
-				//	for (int i = 0; i < node->numPoints; i++) {
-				//		CumulativeColor color;
-
-				//		size_t offsetPoint = i * attributes.bytes;
-				//		color.r = reinterpret_cast<uint16_t*>(node->points->data_u8 + offsetPoint + offsetRGB)[0];
-				//		color.g = reinterpret_cast<uint16_t*>(node->points->data_u8 + offsetPoint + offsetRGB)[1];
-				//		color.b = reinterpret_cast<uint16_t*>(node->points->data_u8 + offsetPoint + offsetRGB)[2];
-				//		color.w = 1;
-
-				//		colors.push_back(color);
-				//	}
-
-				//	node->colors = colors;
-				//}
-
-
 				vector<int8_t> acceptedFlags(child->numPoints, 0);
 				acceptedChildPointFlags.push_back(acceptedFlags);
 
-				for (int i = 0; i < child->numPoints; i++) {
+				for (int64_t i = 0; i < child->numPoints; i++) {
 					int64_t pointOffset = i * attributes.bytes;
 					int32_t* xyz = reinterpret_cast<int32_t*>(child->points->data_u8 + pointOffset);
 
@@ -133,36 +124,24 @@ struct SamplerPoissonAverage : public Sampler {
 					double y = (xyz[1] * scale.y) + offset.y;
 					double z = (xyz[2] * scale.z) + offset.z;
 
-					Point point = { x, y, z, i, childIndex };
+					Point point = { x, y, z, int32_t(i), int32_t(childIndex), 0, 0, 0 };
 
-					/*point.r = child->colors[i].r;
-					point.g = child->colors[i].g;
-					point.b = child->colors[i].b;
-					point.w = child->colors[i].w;*/
-
-					size_t offsetPoint = i * attributes.bytes;
-					point.r = reinterpret_cast<uint16_t*>(child->points->data_u8 + offsetPoint + offsetRGB)[0];
-					point.g = reinterpret_cast<uint16_t*>(child->points->data_u8 + offsetPoint + offsetRGB)[1];
-					point.b = reinterpret_cast<uint16_t*>(child->points->data_u8 + offsetPoint + offsetRGB)[2];
-					point.w = 1;
-
-					point.mainIndex = points.size();
+					if (offsetRGB >= 0) {
+						uint16_t* rgb = reinterpret_cast<uint16_t*>(child->points->data_u8 + pointOffset + offsetRGB);
+						point.r = rgb[0];
+						point.g = rgb[1];
+						point.b = rgb[2];
+					}
 
 					points.push_back(point);
 				}
 
-				child->colors = {};
-
 			}
 
-			unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-
-			//thread_local vector<Point> dbgAccepted(1'000'000);
-			//int dbgNumAccepted = 0;
 			double spacing = baseSpacing / pow(2.0, node->level());
 			double squaredSpacing = spacing * spacing;
 
-			auto squaredDistance = [](Point& a, Point& b) {
+			auto squaredDistance = [](auto& a, auto& b) {
 				double dx = a.x - b.x;
 				double dy = a.y - b.y;
 				double dz = a.z - b.z;
@@ -174,114 +153,8 @@ struct SamplerPoissonAverage : public Sampler {
 
 			auto center = (node->min + node->max) * 0.5;
 
-			//int dbgChecks = -1;
-			//int dbgSumChecks = 0;
-			//int dbgMaxChecks = 0;
-
-			double acceptGridSize = 16;
-			vector<vector<Point>> gridAccepted(acceptGridSize * acceptGridSize * acceptGridSize);
-
-			auto checkAccept = [/*&dbgChecks, &dbgSumChecks, &dbgNumAccepted,*/ spacing, squaredSpacing, &squaredDistance, center, min, max, size, &gridAccepted, acceptGridSize](Point candidate) {
-
-				double dx = acceptGridSize * (candidate.x - min.x) / size.x;
-				double dy = acceptGridSize * (candidate.y - min.y) / size.y;
-				double dz = acceptGridSize * (candidate.z - min.z) / size.z;
-
-				double dx_min = acceptGridSize * (candidate.x - spacing - min.x) / size.x;
-				double dy_min = acceptGridSize * (candidate.y - spacing - min.y) / size.y;
-				double dz_min = acceptGridSize * (candidate.z - spacing - min.z) / size.z;
-
-				double dx_max = acceptGridSize * (candidate.x + spacing - min.x) / size.x;
-				double dy_max = acceptGridSize * (candidate.y + spacing - min.y) / size.y;
-				double dz_max = acceptGridSize * (candidate.z + spacing - min.z) / size.z;
-
-				int ix = std::max(std::min(dx, acceptGridSize - 1.0), 0.0);
-				int iy = std::max(std::min(dy, acceptGridSize - 1.0), 0.0);
-				int iz = std::max(std::min(dz, acceptGridSize - 1.0), 0.0);
-
-				int x_min = std::max(std::min(dx_min, acceptGridSize - 1.0), 0.0);
-				int y_min = std::max(std::min(dy_min, acceptGridSize - 1.0), 0.0);
-				int z_min = std::max(std::min(dz_min, acceptGridSize - 1.0), 0.0);
-
-				int x_max = std::max(std::min(dx_max, acceptGridSize - 1.0), 0.0);
-				int y_max = std::max(std::min(dy_max, acceptGridSize - 1.0), 0.0);
-				int z_max = std::max(std::min(dz_max, acceptGridSize - 1.0), 0.0);
-
-				for (int x = x_min; x <= x_max; x++) {
-				for (int y = y_min; y <= y_max; y++) {
-				for (int z = z_min; z <= z_max; z++) {
-					int index = x + y * acceptGridSize + z * acceptGridSize * acceptGridSize;
-
-					auto& list = gridAccepted[index];
-
-					for (auto point : list) {
-						double dd = squaredDistance(point, candidate);
-
-						if (dd < squaredSpacing) {
-							return false;
-						}
-					}
-
-				}
-				}
-				}
-
-				int indexCurr = ix + iy * acceptGridSize + iz * acceptGridSize * acceptGridSize;
-				gridAccepted[indexCurr].push_back(candidate);
-
-				//=====================================================
-				// outside-in distance checking as described in paper
-				// superseded by distance checking in a grid-neighbourhood
-				//=====================================================
-				//auto cx = candidate.x - center.x;
-				//auto cy = candidate.y - center.y;
-				//auto cz = candidate.z - center.z;
-				//auto cdd = cx * cx + cy * cy + cz * cz;
-				//auto cd = sqrt(cdd);
-				//auto limit = (cd - spacing);
-				//auto limitSquared = limit * limit;
-
-				//int j = 0;
-				//for (int i = dbgNumAccepted - 1; i >= 0; i--) {
-
-				//	auto& point = dbgAccepted[i];
-
-				//	//dbgChecks++;
-				//	//dbgSumChecks++;
-
-				//	// check distance to center
-				//	auto px = point.x - center.x;
-				//	auto py = point.y - center.y;
-				//	auto pz = point.z - center.z;
-				//	auto pdd = px * px + py * py + pz * pz;
-				//	//auto pd = sqrt(pdd);
-
-				//	// stop when differences to center between candidate and accepted exceeds the spacing
-				//	// any other previously accepted point will be even closer to the center.
-				//	if (pdd < limitSquared) {
-				//		return true;
-				//	}
-
-				//	double dd = squaredDistance(point, candidate);
-
-				//	if (dd < squaredSpacing) {
-				//		return false;
-				//	}
-
-				//	j++;
-
-				//	// also put a limit at x distance checks
-				//	if (j > 10'000) {
-				//		return true;
-				//	}
-				//}
-
-				return true;
-
-			};
-
 			auto parallel = std::execution::par_unseq;
-			std::sort(parallel, points.begin(), points.end(), [center](Point a, Point b) -> bool {
+			std::sort(parallel, points.begin(), points.end(), [center](const Point& a, const Point& b) -> bool {
 
 				auto ax = a.x - center.x;
 				auto ay = a.y - center.y;
@@ -295,134 +168,140 @@ struct SamplerPoissonAverage : public Sampler {
 
 				// sort by distance to center
 				return add < bdd;
-
-				// sort by manhattan distance to center
-				//return (ax + ay + az) < (bx + by + bz);
-
-				// sort by z axis
-				//return a.z < b.z;
 			});
-			vector<int32_t> mainToSortMapping(points.size());
-			for (int i = 0; i < points.size(); i++) {
-				mainToSortMapping[points[i].mainIndex] = i;
-			}
-
 
-			//int abc = 0;
-			for (Point& point : points) {
+			// accepted points are registered in a dense grid with cells of at least <spacing>, and with 
+			// about as many cells as there are points. Candidates are only checked against the accepted points 
+			// of cells within <spacing>. During sampling, <lastInCell> and <previousInCell> link the accepted points
+			// of each cell. Afterwards, they are counting-sorted into <acceptedPoints>, where cell c spans 
+			// cellBegin[c] to cellBegin[c + 1] and the cells of a row along x are contiguous.
+			int64_t gridSize = int64_t(std::min({ size.x, size.y, size.z }) / spacing);
+			gridSize = std::clamp(gridSize, int64_t(1), int64_t(std::cbrt(double(points.size()))) + 1);
+			int64_t numCells = gridSize * gridSize * gridSize;
 
-				//dbgChecks = 0;
+			vector<int32_t> lastInCell(numCells, -1);
+			vector<int32_t> previousInCell(points.size(), -1);
+			vector<uint32_t> cellBegin(numCells + 1, 0);
 
-				//point.mainIndex = abc;
-				//abc++;
-
-				bool isAccepted = checkAccept(point);
-
-				//dbgMaxChecks = std::max(dbgChecks, dbgMaxChecks);
-
-				if (isAccepted) {
-					//dbgAccepted[numAccepted] = point;
-					//dbgNumAccepted++;
-					numAccepted++;
-				} else {
-					numRejectedPerChild[point.childIndex]++;
-				}
+			auto toCell = [gridSize](double value, double min, double size) -> int64_t {
+				int64_t cell = double(gridSize) * (value - min) / size;
 
-				//{ // debug: store sample time in GPS time attribute
-				//		auto child = node->children[point.childIndex];
-				//		auto data = child->points->data_u8;
+				return std::clamp(cell, int64_t(0), gridSize - 1);
+			};
 
-				//		//static double value = 0.0;
+			for (int64_t i = 0; i < int64_t(points.size()); i++) {
+				Point& candidate = points[i];
 
+				int64_t x_min = toCell(candidate.x - spacing, min.x, size.x);
+				int64_t y_min = toCell(candidate.y - spacing, min.y, size.y);
+				int64_t z_min = toCell(candidate.z - spacing, min.z, size.z);
+				int64_t x_max = toCell(candidate.x + spacing, min.x, size.x);
+				int64_t y_max = toCell(candidate.y + spacing, min.y, size.y);
+				int64_t z_max = toCell(candidate.z + spacing, min.z, size.z);
 
-				//		//value += 0.1;
+				bool isAccepted = true;
 
-				//		//if(node->level() <= 2){
-				//			std::lock_guard<mutex> lock(mtx_debug);
+				for (int64_t z = z_min; z <= z_max && isAccepted; z++)
+				for (int64_t y = y_min; y <= y_max && isAccepted; y++)
+				for (int64_t x = x_min; x <= x_max && isAccepted; x++) {
+					int64_t cell = x + y * gridSize + z * gridSize * gridSize;
 
-				//			debug += 0.01;
-				//			memcpy(data + point.pointIndex * attributes.bytes + 20, &debug, 8);
-				//		//}
-				//		//double value = now();
+					for (int32_t j = lastInCell[cell]; j != -1; j = previousInCell[j]) {
+						if (squaredDistance(points[j], candidate) < squaredSpacing) {
+							isAccepted = false;
+							break;
+						}
+					}
+				}
 
-				//		//point.pointIndex
-				//}
+				if (isAccepted) {
+					int64_t cx = toCell(candidate.x, min.x, size.x);
+					int64_t cy = toCell(candidate.y, min.y, size.y);
+					int64_t cz = toCell(candidate.z, min.z, size.z);
+					int64_t cell = cx + cy * gridSize + cz * gridSize * gridSize;
 
-				acceptedChildPointFlags[point.childIndex][point.pointIndex] = isAccepted ? 1 : 0;
+					previousInCell[i] = lastInCell[cell];
+					lastInCell[cell] = int32_t(i);
+					cellBegin[cell + 1]++;
 
-				//abc++;
+					numAccepted++;
+				} else {
+					numRejectedPerChild[candidate.childIndex]++;
+				}
 
+				acceptedChildPointFlags[candidate.childIndex][candidate.pointIndex] = isAccepted ? 1 : 0;
 			}
 
-			{// compute average color
-				int offsetRGB = attributes.getOffset("rgb");
-
-				auto addCandidateToAverage = [node](Point& candidate, Point& average) {
-					average.r = average.r + candidate.r;
-					average.g = average.g + candidate.g;
-					average.b = average.b + candidate.b;
-					average.w = average.w + candidate.w;
+			// counting sort of the accepted points by cell
+			vector<AcceptedPoint> acceptedPoints(numAccepted);
+			for (int64_t cell = 0; cell < numCells; cell++) {
+				cellBegin[cell + 1] += cellBegin[cell];
 
-				};
+				uint32_t j = cellBegin[cell + 1];
+				for (int32_t i = lastInCell[cell]; i != -1; i = previousInCell[i]) {
+					Point& point = points[i];
 
+					j--;
+					acceptedPoints[j] = { point.x, point.y, point.z, point.pointIndex, point.childIndex, 0, 0, 0, 0 };
+				}
+			}
 
+			// compute average color:
+			// each candidate contributes to all accepted points within <spacing>, including itself if it was accepted
+			if (offsetRGB >= 0) {
 				for (Point& candidate : points) {
-					double dx = acceptGridSize * (candidate.x - min.x) / size.x;
-					double dy = acceptGridSize * (candidate.y - min.y) / size.y;
-					double dz = acceptGridSize * (candidate.z - min.z) / size.z;
-
-					double dx_min = acceptGridSize * (candidate.x - spacing - min.x) / size.x;
-					double dy_min = acceptGridSize * (candidate.y - spacing - min.y) / size.y;
-					double dz_min = acceptGridSize * (candidate.z - spacing - min.z) / size.z;
-
-					double dx_max = acceptGridSize * (candidate.x + spacing - min.x) / size.x;
-					double dy_max = acceptGridSize * (candidate.y + spacing - min.y) / size.y;
-					double dz_max = acceptGridSize * (candidate.z + spacing - min.z) / size.z;
-
-					int ix = std::max(std::min(dx, acceptGridSize - 1.0), 0.0);
-					int iy = std::max(std::min(dy, acceptGridSize - 1.0), 0.0);
-					int iz = std::max(std::min(dz, acceptGridSize - 1.0), 0.0);
-
-					int x_min = std::max(std::min(dx_min, acceptGridSize - 1.0), 0.0);
-					int y_min = std::max(std::min(dy_min, acceptGridSize - 1.0), 0.0);
-					int z_min = std::max(std::min(dz_min, acceptGridSize - 1.0), 0.0);
-
-					int x_max = std::max(std::min(dx_max, acceptGridSize - 1.0), 0.0);
-					int y_max = std::max(std::min(dy_max, acceptGridSize - 1.0), 0.0);
-					int z_max = std::max(std::min(dz_max, acceptGridSize - 1.0), 0.0);
-
-					for (int x = x_min; x <= x_max; x++) {
-						for (int y = y_min; y <= y_max; y++) {
-							for (int z = z_min; z <= z_max; z++) {
-								int index = x + y * acceptGridSize + z * acceptGridSize * acceptGridSize;
-
-								auto& list = gridAccepted[index];
-
-								for (auto& point : list) {
-									double dd = squaredDistance(point, candidate);
-
-									if (dd < squaredSpacing) {
-
-										
-										addCandidateToAverage(candidate, points[mainToSortMapping[point.mainIndex]]);
-
-									}
+					int64_t x_min = toCell(candidate.x - spacing, min.x, size.x);
+					int64_t y_min = toCell(candidate.y - spacing, min.y, size.y);
+					int64_t z_min = toCell(candidate.z - spacing, min.z, size.z);
+					int64_t x_max = toCell(candidate.x + spacing, min.x, size.x);
+					int64_t y_max = toCell(candidate.y + spacing, min.y, size.y);
+					int64_t z_max = toCell(candidate.z + spacing, min.z, size.z);
+
+					for (int64_t z = z_min; z <= z_max; z++)
+					for (int64_t y = y_min; y <= y_max; y++) {
+						int64_t row = y * gridSize + z * gridSize * gridSize;
+
+						for (uint32_t j = cellBegin[row + x_min]; j < cellBegin[row + x_max + 1]; j++) {
+							AcceptedPoint& point = acceptedPoints[j];
+
+							if (squaredDistance(point, candidate) < squaredSpacing) {
+								point.r += candidate.r;
+								point.g += candidate.g;
+								point.b += candidate.b;
+								point.w++;
+
+								// halve the sums before the next 16 bit colour could overflow them
+								if (point.w == 0x1'0000) {
+									point.r >>= 1;
+									point.g >>= 1;
+									point.b >>= 1;
+									point.w >>= 1;
 								}
-
 							}
 						}
 					}
 				}
+
+				// the averaged colors replace the accepted points' colors in the children and, through the copy below, in the parent
+				for (int64_t i = 0; i < node->numChildren(); i++) {
+					Buffer::writable(node->children[i]->points);
+				}
+
+				for (AcceptedPoint& point : acceptedPoints) {
+					Node* child = node->child(point.childIndex);
+					uint16_t* rgb = reinterpret_cast<uint16_t*>(child->points->data_u8 + point.pointIndex * attributes.bytes + offsetRGB);
+
+					rgb[0] = point.r / point.w;
+					rgb[1] = point.g / point.w;
+					rgb[2] = point.b / point.w;
+				}
 			}
 
+			// the parent receives copies of the accepted points. 
+			// Children keep all their points, since the parent only stores averages of them.
 			auto accepted = make_shared<Buffer>(numAccepted * attributes.bytes);
-			vector<CumulativeColor> averagedColors;
-			averagedColors.reserve(numAccepted);
-
-			int offsetRGB = attributes.getOffset("rgb");
-			size_t j = 0;
-			for (int childIndex = 0; childIndex < 8; childIndex++) {
-				auto child = node->children[childIndex];
+			for (int64_t childIndex = 0; childIndex < 8; childIndex++) {
+				Node* child = node->child(childIndex);
 
 				if (child == nullptr) {
 					continue;
@@ -430,66 +309,27 @@ struct SamplerPoissonAverage : public Sampler {
 
 				auto numRejected = numRejectedPerChild[childIndex];
 				auto& acceptedFlags = acceptedChildPointFlags[childIndex];
-				auto rejected = make_shared<Buffer>(child->numPoints * attributes.bytes);
-
-				for (int i = 0; i < child->numPoints; i++) {
-					auto isAccepted = acceptedFlags[i];
-					int64_t pointOffset = i * attributes.bytes;
-
-					
-					Point& p = points[mainToSortMapping[j]];
-
-					uint16_t* rgbTarget = reinterpret_cast<uint16_t*>(child->points->data_u8 + i * attributes.bytes + offsetRGB);
-					rgbTarget[0] = p.r / p.w;
-					rgbTarget[1] = p.g / p.w;
-					rgbTarget[2] = p.b / p.w;
-
-					if (isAccepted) {
-						accepted->write(child->points->data_u8 + pointOffset, attributes.bytes);
 
-						CumulativeColor color;
-						color.r = p.r;
-						color.g = p.g;
-						color.b = p.b;
-						color.w = p.w;
-						averagedColors.push_back(color);
-
-						rejected->write(child->points->data_u8 + pointOffset, attributes.bytes);
-					} else {
-						rejected->write(child->points->data_u8 + pointOffset, attributes.bytes);
+				for (int64_t i = 0; i < child->numPoints; i++) {
+					if (acceptedFlags[i]) {
+						accepted->write(child->points->data_u8 + i * attributes.bytes, attributes.bytes);
 					}
-
-					j++;
 				}
 
-				if (numRejected == 0) {
-					node->children[childIndex] = nullptr;
-				} if (numRejected > 0) {
-					child->points = rejected;
-					//child->numPoints = numRejected;
-					//child->colors.clear();
-					//child->colors.shrink_to_fit();
+				if (numRejected == 0 && child->isLeaf() && !child->isChunkRoot) {
+					onNodeDiscarded(child);
 
-					onNodeCompleted(child.get());
+					node->removeChild(childIndex);
+				} else {
+					onNodeCompleted(child);
 				}
 			}
 
-			
-
-
 			node->points = accepted;
-			node->colors = averagedColors;
 			node->numPoints = numAccepted;
 
-			//{ // debug
-			//	auto avgChecks = dbgSumChecks / points.size();
-			//	string msg = "#checks: " + formatNumber(dbgSumChecks) + ", maxChecks: " + formatNumber(dbgMaxChecks) + ", avgChecks: " + formatNumber(avgChecks) + "\n";
-			//	cout << msg;
-			//}
-
 			return true;
 		});
 	}
 
 };
-
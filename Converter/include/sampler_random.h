@@ -10,6 +10,11 @@
 
 struct SamplerRandom : public Sampler {
 
+	// an accepted flag and two slots of the cell table. Leaves are shuffled in place.
+	int64_t scratchBytesPerPoint() {
+		return 9;
+	}
+
 	// subsample a local octree from bottom up
 	void sample(Node* node, Attributes attributes, double baseSpacing, 
 		function<void(Node*)> onNodeCompleted,
@@ -26,10 +31,11 @@ struct SamplerRandom : public Sampler {
 		};
 
 		function<void(Node*, function<void(Node*)>)> traversePost = [&traversePost](Node* node, function<void(Node*)> callback) {
-			for (auto child : node->children) {
+			for (int64_t i = 0; i < node->numChildren(); i++) {
+				Node* child = node->children[i];
 
-				if (child != nullptr && !child->sampled) {
-					traversePost(child.get(), callback);
+				if (!child->sampled) {
+					traversePost(child, callback);
 				}
 			}
 
@@ -46,9 +52,6 @@ struct SamplerRandom : public Sampler {
 			int64_t numPoints = node->numPoints;
 
 			int64_t gridSize = 128;
-			thread_local vector<int64_t> grid(gridSize* gridSize* gridSize, -1);
-			thread_local int64_t iteration = 0;
-			iteration++;
 
 			auto max = node->max;
 			auto min = node->min;
@@ -58,7 +61,7 @@ struct SamplerRandom : public Sampler {
 
 			struct CellIndex {
 				int64_t index = -1;
-				double distance = 0.0;
+				double squaredDistance = 0.0; // to the cell's center, in units of half a cell
 			};
 
 			auto toCellIndex = [min, size, gridSize](Vector3 point) -> CellIndex {
@@ -67,15 +70,19 @@ struct SamplerRandom : public Sampler {
 				double ny = (point.y - min.y) / size.y;
 				double nz = (point.z - min.z) / size.z;
 
-				double lx = 2.0 * fmod(double(gridSize) * nx, 1.0) - 1.0;
-				double ly = 2.0 * fmod(double(gridSize) * ny, 1.0) - 1.0;
-				double lz = 2.0 * fmod(double(gridSize) * nz, 1.0) - 1.0;
+				double gx = double(gridSize) * nx;
+				double gy = double(gridSize) * ny;
+				double gz = double(gridSize) * nz;
+
+				double lx = 2.0 * (gx - floor(gx)) - 1.0;
+				double ly = 2.0 * (gy - floor(gy)) - 1.0;
+				double lz = 2.0 * (gz - floor(gz)) - 1.0;
 
-				double distance = sqrt(lx * lx + ly * ly + lz * lz);
+				double squaredDistance = lx * lx + ly * ly + lz * lz;
 
-				int64_t x = double(gridSize) * nx;
-				int64_t y = double(gridSize) * ny;
-				int64_t z = double(gridSize) * nz;
+				int64_t x = gx;
+				int64_t y = gy;
+				int64_t z = gz;
 
 				x = std::max(int64_t(0), std::min(x, gridSize - 1));
 				y = std::max(int64_t(0), std::min(y, gridSize - 1));
@@ -83,40 +90,40 @@ struct SamplerRandom : public Sampler {
 
 				int64_t index = x + y * gridSize + z * gridSize * gridSize;
 
-				return { index, distance };
+				return { index, squaredDistance };
 			};
 
 			bool isLeaf = node->isLeaf();
 			if (isLeaf) {
-				// shuffle?
+				// Fisher-Yates shuffle of the points in place, so that every prefix of the leaf is a uniform random subset.
+				// A blocked shuffle would keep the points of a block together, and leaves of about maxPointsPerChunk points
+				// fit into the L2 cache, so the random accesses are cheap. Records longer than 64 bytes are swapped in pieces.
+				auto points = Buffer::writable(node->points);
+				uint8_t* data = points->data_u8;
 
-				//
-				// a not particularly efficient approach to shuffling:
-				// 
+				auto swapPoints = [bytesPerPoint](uint8_t* a, uint8_t* b) {
+					uint8_t block[64];
 
-				vector<int> indices(node->numPoints);
-				for (int i = 0; i < node->numPoints; i++) {
-					indices[i] = i;
-				}
+					for (int64_t offset = 0; offset < bytesPerPoint; offset += 64) {
+						int64_t blockSize = std::min(int64_t(64), bytesPerPoint - offset);
 
-				unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-
-				shuffle(indices.begin(), indices.end(), std::default_random_engine(seed));
-
-				auto buffer = make_shared<Buffer>(node->points->size);
-
-				for (int i = 0; i < node->numPoints; i++) {
+						memcpy(block, a + offset, blockSize);
+						memcpy(a + offset, b + offset, blockSize);
+						memcpy(b + offset, block, blockSize);
+					}
+				};
 
-					int64_t sourceOffset = i * attributes.bytes;
-					int64_t targetOffset = indices[i] * attributes.bytes;
+				unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+				std::default_random_engine generator(seed);
 
-					memcpy(buffer->data_u8 + targetOffset, node->points->data_u8 + sourceOffset, attributes.bytes);
+				for (int64_t i = node->numPoints - 1; i > 0; i--) {
+					int64_t j = std::uniform_int_distribution<int64_t>(0, i)(generator);
 
+					if (i != j) {
+						swapPoints(data + i * bytesPerPoint, data + j * bytesPerPoint);
+					}
 				}
 
-				node->points = buffer;
-
-
 				return false;
 			}
 
@@ -127,11 +134,40 @@ struct SamplerRandom : public Sampler {
 			// first, check for each point whether it's accepted or rejected
 			// save result in an array with one element for each point
 
+			int64_t numPointsInChildren = 0;
+			for (int64_t i = 0; i < node->numChildren(); i++) {
+				numPointsInChildren += node->children[i]->numPoints;
+			}
+
+			// cells that already hold an accepted point, in a hash table with linear probing.
+			// It's sized to the points of this node's children rather than the 128^3 cells of the grid.
+			uint64_t numSlots = std::bit_ceil(uint64_t(2 * numPointsInChildren + 2));
+			uint64_t slotMask = numSlots - 1;
+			vector<uint32_t> occupiedCells(numSlots, 0); // cell index + 1, 0 if the slot is empty
+
+			// marks <cell> as occupied. Returns false if it already was.
+			auto occupy = [&occupiedCells, slotMask](int64_t cellIndex) -> bool {
+				uint32_t cell = uint32_t(cellIndex) + 1;
+				uint64_t slot = ((uint64_t(cell) * 0x9E37'79B9'7F4A'7C15ull) >> 32) & slotMask;
+
+				while (occupiedCells[slot] != 0) {
+					if (occupiedCells[slot] == cell) {
+						return false;
+					}
+
+					slot = (slot + 1) & slotMask;
+				}
+
+				occupiedCells[slot] = cell;
+
+				return true;
+			};
+
 			vector<vector<int8_t>> acceptedChildPointFlags;
 			vector<int64_t> numRejectedPerChild;
 			int64_t numAccepted = 0;
 			for (int childIndex = 0; childIndex < 8; childIndex++) {
-				auto child = node->children[childIndex];
+				Node* child = node->child(childIndex);
 
 				if (child == nullptr) {
 					acceptedChildPointFlags.push_back({});
@@ -154,21 +190,20 @@ struct SamplerRandom : public Sampler {
 
 					CellIndex cellIndex = toCellIndex({ x, y, z });
 
-					auto& gridValue = grid[cellIndex.index];
-
 					static double all = sqrt(3.0);
+					static double maxDistance = 0.7 * all;
 
 					bool isAccepted;
 					if (child->numPoints < 100) {
+						occupy(cellIndex.index);
 						isAccepted = true;
-					} else if (cellIndex.distance < 0.7 * all && gridValue < iteration) {
-						isAccepted = true;
+					} else if (cellIndex.squaredDistance < maxDistance * maxDistance) {
+						isAccepted = occupy(cellIndex.index);
 					} else {
 						isAccepted = false;
 					}
 
 					if (isAccepted) {
-						gridValue = iteration;
 						numAccepted++;
 					} else {
 						numRejected++;
@@ -183,34 +218,20 @@ struct SamplerRandom : public Sampler {
 
 			auto accepted = make_shared<Buffer>(numAccepted * attributes.bytes);
 			for (int childIndex = 0; childIndex < 8; childIndex++) {
-				auto child = node->children[childIndex];
+				Node* child = node->child(childIndex);
 
 				if (child == nullptr) continue;
 
-				auto numRejected = numRejectedPerChild[childIndex];
+				// rejected points remain in the child's range, without being copied
 				auto& acceptedFlags = acceptedChildPointFlags[childIndex];
-				auto rejected = make_shared<Buffer>(numRejected * attributes.bytes);
+				auto numRejected = extractAcceptedPoints(child, acceptedFlags.data(), accepted.get(), attributes.bytes);
 
-				for (int i = 0; i < child->numPoints; i++) {
-					auto isAccepted = acceptedFlags[i];
-					int64_t pointOffset = i * attributes.bytes;
-
-					if (isAccepted) {
-						accepted->write(child->points->data_u8 + pointOffset, attributes.bytes);
-					} else {
-						rejected->write(child->points->data_u8 + pointOffset, attributes.bytes);
-					}
-				}
+				if (numRejected == 0 && child->isLeaf() && !child->isChunkRoot) {
+					onNodeDiscarded(child);
 
-				if (numRejected == 0 && child->isLeaf()) {
-					onNodeDiscarded(child.get());
-
-					node->children[childIndex] = nullptr;
+					node->removeChild(childIndex);
 				} if (numRejected > 0) {
-					child->points = rejected;
-					child->numPoints = numRejected;
-
-					onNodeCompleted(child.get());
+					onNodeCompleted(child);
 				} else if(numRejected == 0) {
 					// the parent has taken all points from this child, 
 					// so make this child an empty inner node.
@@ -220,7 +241,7 @@ struct SamplerRandom : public Sampler {
 					// https://github.com/potree/potree/issues/1125
 					child->points = nullptr;
 					child->numPoints = 0;
-					onNodeCompleted(child.get());
+					onNodeCompleted(child);
 				}
 			}
 
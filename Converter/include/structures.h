@@ -7,30 +7,68 @@
 #include <string>
 #include <functional>
 #include <mutex>
+#include <bit>
 
 #include "Vector3.h"
 #include "unsuck/unsuck.hpp"
 #include "Attributes.h"
+#include "converter_utils.h"
 
 using std::vector;
 using std::shared_ptr;
 using std::function;
 using std::mutex;
+using std::unique_ptr;
+using std::make_unique;
 
-struct CumulativeColor {
-	int64_t r = 0;
-	int64_t g = 0;
-	int64_t b = 0;
-	int64_t w = 0;
-};
+// nodes are identified by a locational code: a leading 1 bit, followed by 3 bits for the child index of each level.
+// "r" is 0b1, "r0" is 0b1'000 and "r73" is 0b1'111'011. Keys of the same level sort like their names.
+// 64 bits fit keys of nodes up to level 21. Nodes at that level aren't split further, even if they hold many points.
+constexpr int64_t maxNodeLevel = 21;
+
+inline int64_t levelOfKey(uint64_t key) {
+	return (63 - std::countl_zero(key)) / 3;
+}
+
+inline uint64_t childKeyOf(uint64_t key, int64_t index) {
+	return (key << 3) | uint64_t(index);
+}
+
+// e.g. "r073" -> 0b1'000'111'011
+inline uint64_t keyOfName(const string& name) {
+	uint64_t key = 1;
+
+	for (int64_t i = 1; i < int64_t(name.size()); i++) {
+		key = childKeyOf(key, name[i] - '0');
+	}
+
+	return key;
+}
+
+inline string nameOfKey(uint64_t key) {
+	int64_t level = levelOfKey(key);
+
+	string name(level + 1, 'r');
+	for (int64_t i = level; i >= 1; i--) {
+		name[i] = '0' + (key & 0b111);
+		key = key >> 3;
+	}
+
+	return name;
+}
+
+struct NodeArena;
 
 struct Node {
 
-	vector<shared_ptr<Node>> children;
+	uint64_t key = 1;
+
+	// one bit for each existing child. 
+	// <children> holds them in order of their index, see child().
+	uint8_t childMask = 0;
+	Node** children = nullptr;
 
-	string name;
 	shared_ptr<Buffer> points;
-	vector<CumulativeColor> colors;
 	Vector3 min;
 	Vector3 max;
 
@@ -42,103 +80,228 @@ struct Node {
 
 	bool sampled = false;
 
+	// chunk roots look like leaves once their children are detached, but the hierarchy below them is already written,
+	// so they must not be discarded
+	bool isChunkRoot = false;
+
 	Node() {
 
 	}
 
-	Node(string name, Vector3 min, Vector3 max) {
-		this->name = name;
+	Node(uint64_t key, Vector3 min, Vector3 max) {
+		this->key = key;
 		this->min = min;
 		this->max = max;
-
-		children.resize(8, nullptr);
 	}
 
 	int64_t level() {
-		return name.size() - 1;
+		return levelOfKey(key);
 	}
 
-	void addDescendant(shared_ptr<Node> descendant) {
-		static mutex mtx;
-		lock_guard<mutex> lock(mtx);
+	string name() {
+		return nameOfKey(key);
+	}
 
-		int descendantLevel = descendant->name.size() - 1;
+	int64_t numChildren() {
+		return std::popcount(childMask);
+	}
 
-		Node* current = this;
+	Node* child(int64_t index) {
+		uint8_t bit = 1 << index;
 
-		for (int level = 1; level < descendantLevel; level++) {
-			int index = descendant->name[level] - '0';
+		if ((childMask & bit) == 0) {
+			return nullptr;
+		}
 
-			if (current->children[index] != nullptr) {
-				current = current->children[index].get();
-			} else {
-				string childName = current->name + to_string(index);
-				auto box = childBoundingBoxOf(current->min, current->max, index);
+		return children[std::popcount(uint8_t(childMask & (bit - 1)))];
+	}
 
-				auto child = make_shared<Node>(childName, box.min, box.max);
+	// inserts <child> at <index>. Child arrays grow in powers of two, within <arena>.
+	void addChild(NodeArena& arena, int64_t index, Node* child);
 
-				current->children[index] = child;
+	// detaches the child at <index>. Its memory belongs to the arena it was created in.
+	void removeChild(int64_t index) {
+		uint8_t bit = 1 << index;
 
-				current = child.get();
-			}
+		if ((childMask & bit) == 0) {
+			return;
+		}
+
+		int64_t position = std::popcount(uint8_t(childMask & (bit - 1)));
+		int64_t count = numChildren();
+
+		for (int64_t i = position; i < count - 1; i++) {
+			children[i] = children[i + 1];
 		}
 
-		auto index = descendant->name[descendantLevel] - '0';
-		current->children[index] = descendant;
+		childMask = childMask & ~bit;
 	}
 
-	void traverse(function<void(Node*)> callback) {
-		callback(this);
+	// detaches all children, e.g. before the arena of the descendants is released
+	void clearChildren() {
+		childMask = 0;
+		children = nullptr;
+	}
 
-		for (auto child : children) {
+	// creates the missing nodes between this node and <descendant>, then attaches <descendant>
+	void addDescendant(NodeArena& arena, Node* descendant);
 
-			if (child != nullptr) {
-				child->traverse(callback);
-			}
+	void traverse(function<void(Node*)> callback) {
+		callback(this);
 
+		for (int64_t i = 0; i < numChildren(); i++) {
+			children[i]->traverse(callback);
 		}
 	}
 
 	void traversePost(function<void(Node*)> callback) {
-		for (auto child : children) {
-
-			if (child != nullptr) {
-				child->traversePost(callback);
-			}
+		for (int64_t i = 0; i < numChildren(); i++) {
+			children[i]->traversePost(callback);
 		}
 
 		callback(this);
 	}
 
 	bool isLeaf() {
+		return childMask == 0;
+	}
 
-		for (auto child : children) {
-			if (child != nullptr) {
-				return false;
-			}
+	Node* find(uint64_t key){
+
+		Node* current = this;
+
+		int64_t depth = levelOfKey(key) - level();
+
+		for(int64_t i = depth - 1; i >= 0 && current != nullptr; i--){
+			int64_t index = (key >> (3 * i)) & 0b111;
+
+			current = current->child(index);
 		}
 
+		return current;
+	}
+
+};
+
+// allocates nodes and their child arrays in blocks. Everything is released together with the arena.
+// Not thread-safe. Each chunk builds its local octree in an arena of its own, 
+// and the arena is released once the chunk is sampled and written.
+struct NodeArena {
+
+	vector<unique_ptr<Node[]>> nodeBlocks;
+	vector<unique_ptr<Node*[]>> pointerBlocks;
+
+	// free space in the current blocks
+	Node* nextNode = nullptr;
+	int64_t nodesLeft = 0;
+	Node** nextPointer = nullptr;
+	int64_t pointersLeft = 0;
+
+	// blocks double in size up to this many entries, so that arenas of small chunks stay small
+	static constexpr int64_t maxBlockSize = 4096;
+	int64_t nodeBlockSize = 16;
+	int64_t pointerBlockSize = 64;
+
+	NodeArena() {
 
-		return true;
 	}
 
-	Node* find(string name){
+	NodeArena(const NodeArena&) = delete;
+	NodeArena& operator=(const NodeArena&) = delete;
 
-		Node* current = this;
+	Node* create(uint64_t key, Vector3 min, Vector3 max) {
+		if (nodesLeft == 0) {
+			nodeBlocks.push_back(make_unique<Node[]>(nodeBlockSize));
+			nextNode = nodeBlocks.back().get();
+			nodesLeft = nodeBlockSize;
+			nodeBlockSize = std::min(2 * nodeBlockSize, maxBlockSize);
+		}
+
+		Node* node = nextNode;
+		nextNode++;
+		nodesLeft--;
 
-		int depth = name.size() - 1;
+		node->key = key;
+		node->min = min;
+		node->max = max;
 
-		for(int level = 1; level <= depth; level++){
-			int index = name.at(level) - '0';
+		return node;
+	}
 
-			current = current->children[index].get();
+	Node** allocateChildren(int64_t count) {
+		if (pointersLeft < count) {
+			pointerBlocks.push_back(make_unique<Node*[]>(pointerBlockSize));
+			nextPointer = pointerBlocks.back().get();
+			pointersLeft = pointerBlockSize;
+			pointerBlockSize = std::min(2 * pointerBlockSize, maxBlockSize);
 		}
 
-		return current;
+		Node** pointers = nextPointer;
+		nextPointer += count;
+		pointersLeft -= count;
+
+		return pointers;
 	}
 
 };
 
+inline void Node::addChild(NodeArena& arena, int64_t index, Node* child) {
+	uint8_t bit = 1 << index;
+
+	if ((childMask & bit) != 0) {
+		children[std::popcount(uint8_t(childMask & (bit - 1)))] = child;
+
+		return;
+	}
+
+	int64_t count = numChildren();
+	int64_t position = std::popcount(uint8_t(childMask & (bit - 1)));
+
+	// arrays have a capacity of bit_ceil(count), so they only move if count is a power of two
+	if (count == 0 || std::has_single_bit(uint64_t(count))) {
+		Node** grown = arena.allocateChildren(std::bit_ceil(uint64_t(count + 1)));
+
+		for (int64_t i = 0; i < count; i++) {
+			grown[i] = children[i];
+		}
+
+		children = grown;
+	}
+
+	for (int64_t i = count; i > position; i--) {
+		children[i] = children[i - 1];
+	}
+
+	children[position] = child;
+	childMask = childMask | bit;
+}
+
+inline void Node::addDescendant(NodeArena& arena, Node* descendant) {
+
+	int64_t descendantLevel = descendant->level();
+
+	Node* current = this;
+
+	for (int64_t childLevel = level() + 1; childLevel < descendantLevel; childLevel++) {
+		uint64_t key = descendant->key >> (3 * (descendantLevel - childLevel));
+		int64_t index = key & 0b111;
+
+		Node* child = current->child(index);
+
+		if (child == nullptr) {
+			auto box = childBoundingBoxOf(current->min, current->max, index);
+
+			child = arena.create(key, box.min, box.max);
+
+			current->addChild(arena, index, child);
+		}
+
+		current = child;
+	}
+
+	current->addChild(arena, descendant->key & 0b111, descendant);
+}
+
 struct SamplerState {
 	int bytesPerPoint;
 	double baseSpacing;
@@ -161,4 +324,39 @@ struct Sampler {
 		function<void(Node*)> callbackNodeDiscarded
 	) = 0;
 
-};
\ No newline at end of file
+	// estimate of the temporary memory that sample() needs per point, reserved before a chunk is indexed
+	virtual int64_t scratchBytesPerPoint() = 0;
+
+};
+
+// Appends the points of <child> that are flagged in <acceptedFlags> to <accepted>.
+// The rejected points stay in the child's range, moved to its start in their previous order,
+// and the child's points become a view of them. The range is only copied if it's shared, see Buffer::writable().
+inline int64_t extractAcceptedPoints(Node* child, const int8_t* acceptedFlags, Buffer* accepted, int64_t bytesPerPoint) {
+
+	auto points = Buffer::writable(child->points);
+	uint8_t* data = points->data_u8;
+
+	int64_t numRejected = 0;
+	for (int64_t i = 0; i < child->numPoints; i++) {
+		uint8_t* point = data + i * bytesPerPoint;
+
+		if (acceptedFlags[i]) {
+			accepted->write(point, bytesPerPoint);
+		} else {
+			// numRejected <= i, so points that are still unvisited aren't overwritten
+			if (numRejected != i) {
+				memcpy(data + numRejected * bytesPerPoint, point, bytesPerPoint);
+			}
+
+			numRejected++;
+		}
+	}
+
+	if (numRejected < child->numPoints) {
+		child->points = Buffer::view(points, 0, numRejected * bytesPerPoint);
+		child->numPoints = numRejected;
+	}
+
+	return numRejected;
+}
@@ -544,6 +544,15 @@ laszip_seek_point(
     , laszip_I64                       index
 );
 
+/*---------------------------------------------------------------------------*/
+LASZIP_API laszip_I32
+laszip_get_chunk_table(
+    laszip_POINTER                     pointer
+    , laszip_U32*                      number_chunks
+    , laszip_U32*                      chunk_size
+    , const laszip_U32**               chunk_totals
+);
+
 /*---------------------------------------------------------------------------*/
 LASZIP_API laszip_I32
 laszip_read_point(
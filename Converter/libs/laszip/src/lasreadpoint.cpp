@@ -402,6 +402,23 @@ BOOL LASreadPoint::seek(const U32 current, const U32 target)
   return TRUE;
 }
 
+BOOL LASreadPoint::get_chunk_table(U32* number_chunks, U32* chunk_size, const U32** chunk_totals)
+{
+  if (dec == 0) return FALSE;
+  // the chunk table is read lazily, same as in seek()
+  if (point_start == 0)
+  {
+    if (!init_dec()) return FALSE;
+    chunk_count = 0;
+  }
+  // incomplete or missing chunk table
+  if (tabled_chunks != this->number_chunks + 1) return FALSE;
+  *number_chunks = this->number_chunks;
+  *chunk_size = (this->chunk_totals ? U32_MAX : this->chunk_size);
+  *chunk_totals = this->chunk_totals;
+  return TRUE;
+}
+
 BOOL LASreadPoint::read(U8* const * point)
 {
   U32 i;
@@ -63,6 +63,7 @@ public:
 
   BOOL init(ByteStreamIn* instream);
   BOOL seek(const U32 current, const U32 target);
+  BOOL get_chunk_table(U32* number_chunks, U32* chunk_size, const U32** chunk_totals);
   BOOL read(U8* const * point);
   BOOL check_end();
   BOOL done();
@@ -4564,6 +4564,51 @@ laszip_seek_point(
   return 0;
 }
 
+/*---------------------------------------------------------------------------*/
+// chunk layout of a compressed file. for adaptive chunking, chunk_size is U32_MAX and
+// chunk_totals holds number_chunks+1 cumulative point counts, otherwise chunk_totals is 0.
+// chunk_totals is owned by the reader and valid until it is closed.
+LASZIP_API laszip_I32
+laszip_get_chunk_table(
+    laszip_POINTER                     pointer
+    , laszip_U32*                      number_chunks
+    , laszip_U32*                      chunk_size
+    , const laszip_U32**               chunk_totals
+)
+{
+  if (pointer == 0) return 1;
+  laszip_dll_struct* laszip_dll = (laszip_dll_struct*)pointer;
+
+  try
+  {
+    if ((number_chunks == 0) || (chunk_size == 0) || (chunk_totals == 0))
+    {
+      sprintf(laszip_dll->error, "laszip_U32 pointer 'number_chunks', 'chunk_size' or 'chunk_totals' is zero");
+      return 1;
+    }
+
+    if (laszip_dll->reader == 0)
+    {
+      sprintf(laszip_dll->error, "getting chunk table before reader was opened");
+      return 1;
+    }
+
+    if (!laszip_dll->reader->get_chunk_table(number_chunks, chunk_size, chunk_totals))
+    {
+      sprintf(laszip_dll->error, "no chunk table available");
+      return 1;
+    }
+  }
+  catch (...)
+  {
+    sprintf(laszip_dll->error, "internal error in laszip_get_chunk_table");
+    return 1;
+  }
+
+  laszip_dll->error[0] = '\0';
+  return 0;
+}
+
 /*---------------------------------------------------------------------------*/
 LASZIP_API laszip_I32
 laszip_read_point(
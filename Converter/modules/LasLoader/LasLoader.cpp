@@ -1,8 +1,6 @@
 
 #include "LasLoader/LasLoader.h"
 
-#include "laszip/laszip_api.h"
-
 
 LasTypeInfo lasTypeInfo(int typeID) {
 
@@ -68,6 +66,52 @@ LasTypeInfo lasTypeInfo(int typeID) {
 
 }
 
+int lasFirstExtraAttributeIndex(int pointDataFormat) {
+
+	unordered_map<int, int> formatToExtraIndex = {
+		{0, 8},
+		{1, 9},
+		{2, 9},
+		{3, 10},
+		{4, 14},
+		{5, 15},
+		{6, 10},
+		{7, 11},
+		{8, 12},
+		{9, 15},
+		{10, 17},
+	};
+
+	if (formatToExtraIndex.find(pointDataFormat) == formatToExtraIndex.end()) {
+		return -1;
+	}
+
+	return formatToExtraIndex[pointDataFormat];
+}
+
+int lasStandardRecordSize(int pointDataFormat) {
+
+	unordered_map<int, int> formatToSize = {
+		{0, 20},
+		{1, 28},
+		{2, 26},
+		{3, 34},
+		{4, 57},
+		{5, 63},
+		{6, 30},
+		{7, 36},
+		{8, 38},
+		{9, 59},
+		{10, 67},
+	};
+
+	if (formatToSize.find(pointDataFormat) == formatToSize.end()) {
+		return -1;
+	}
+
+	return formatToSize[pointDataFormat];
+}
+
 
 LasHeader loadLasHeader(string path) {
 	laszip_POINTER laszip_reader;
@@ -110,6 +154,8 @@ LasHeader loadLasHeader(string path) {
 
 		VLR vlr;
 
+		memcpy(vlr.userID, laszip_vlr.user_id, 16);
+		memcpy(vlr.description, laszip_vlr.description, 32);
 		vlr.recordID = laszip_vlr.record_id;
 		vlr.recordLengthAfterHeader = laszip_vlr.record_length_after_header;
 		vlr.data.resize(vlr.recordLengthAfterHeader);
@@ -126,4 +172,485 @@ LasHeader loadLasHeader(string path) {
 	laszip_destroy(laszip_reader);
 
 	return result;
-}
\ No newline at end of file
+}
+vector<int64_t> loadLazChunkSizes(string path) {
+
+	laszip_POINTER laszip_reader;
+	laszip_header* header;
+
+	laszip_BOOL request_reader = 1;
+	laszip_BOOL is_compressed = 1;
+
+	laszip_create(&laszip_reader);
+	laszip_request_compatibility_mode(laszip_reader, request_reader);
+	laszip_open_reader(laszip_reader, path.c_str(), &is_compressed);
+	laszip_get_header_pointer(laszip_reader, &header);
+
+	int64_t numPoints = std::max(uint64_t(header->number_of_point_records), header->extended_number_of_point_records);
+
+	laszip_U32 numberChunks = 0;
+	laszip_U32 chunkSize = 0;
+	const laszip_U32* chunkTotals = nullptr;
+
+	vector<int64_t> chunkSizes;
+
+	if (laszip_get_chunk_table(laszip_reader, &numberChunks, &chunkSize, &chunkTotals) == 0) {
+		if (chunkTotals != nullptr) {
+			// variable-sized chunks of LAZ 1.4
+			for (int64_t i = 0; i < numberChunks; i++) {
+				chunkSizes.push_back(int64_t(chunkTotals[i + 1]) - int64_t(chunkTotals[i]));
+			}
+		} else if (chunkSize > 0) {
+			for (int64_t first = 0; first < numPoints; first += chunkSize) {
+				chunkSizes.push_back(std::min(int64_t(chunkSize), numPoints - first));
+			}
+		}
+	}
+
+	laszip_close_reader(laszip_reader);
+	laszip_destroy(laszip_reader);
+
+	return chunkSizes;
+}
+
+// numPoints == -1 maps all records
+shared_ptr<LasPointRecords> mapLasPoints(string path, LasHeader& header, int64_t firstPoint, int64_t numPoints) {
+
+	if (!iEndsWith(path, ".las") || numPoints == 0) {
+		return nullptr;
+	}
+
+	auto rawHeader = readBinaryFile(path, 0, 227);
+
+	if (rawHeader.size() < 227 || memcmp(rawHeader.data(), "LASF", 4) != 0) {
+		return nullptr;
+	}
+
+	uint32_t offsetToPointData = read<uint32_t>(rawHeader, 96);
+	uint8_t pointDataFormat = read<uint8_t>(rawHeader, 104);
+	uint16_t recordLength = read<uint16_t>(rawHeader, 105);
+
+	// also rejects laz files, which are flagged through the upper two bits of the format
+	if (lasStandardRecordSize(pointDataFormat) < 0 || recordLength < lasStandardRecordSize(pointDataFormat)) {
+		return nullptr;
+	}
+
+	// laszip converts points of files that were written in compatibility mode to formats 6-10. 
+	// we leave those to laszip.
+	if (header.pointDataFormat != pointDataFormat) {
+		return nullptr;
+	}
+
+	if (numPoints == -1) {
+		numPoints = header.numPoints - firstPoint;
+	}
+
+	if (numPoints <= 0 || firstPoint + numPoints > header.numPoints) {
+		return nullptr;
+	}
+
+	int64_t start = int64_t(offsetToPointData) + firstPoint * int64_t(recordLength);
+	int64_t size = numPoints * int64_t(recordLength);
+
+	auto mapping = make_shared<MappedFile>(path, start, size);
+
+	if (mapping->data == nullptr) {
+		return nullptr;
+	}
+
+	auto records = make_shared<LasPointRecords>();
+	records->header = header;
+	records->offsetToPointData = offsetToPointData;
+	records->recordLength = recordLength;
+	records->firstPoint = firstPoint;
+	records->numPoints = numPoints;
+	records->mapping = mapping;
+	records->data = mapping->data;
+
+	return records;
+}
+
+shared_ptr<LasPointRecords> mapLasPoints(string path, int64_t firstPoint, int64_t numPoints) {
+
+	if (!iEndsWith(path, ".las")) {
+		return nullptr;
+	}
+
+	auto header = loadLasHeader(path);
+
+	return mapLasPoints(path, header, firstPoint, numPoints);
+}
+
+shared_ptr<LasPointRecords> mapLasPoints(string path, LasHeader& header) {
+	return mapLasPoints(path, header, 0, -1);
+}
+
+LaszipReader::LaszipReader(string path) {
+	this->path = path;
+
+	laszip_BOOL request_reader = 1;
+	laszip_BOOL is_compressed = iEndsWith(path, ".laz") ? 1 : 0;
+
+	laszip_create(&handle);
+	laszip_request_compatibility_mode(handle, request_reader);
+	laszip_open_reader(handle, path.c_str(), &is_compressed);
+	laszip_get_header_pointer(handle, &header);
+	laszip_get_point_pointer(handle, &point);
+}
+
+LaszipReader::~LaszipReader() {
+	laszip_close_reader(handle);
+	laszip_destroy(handle);
+}
+
+void LaszipReader::seek(int64_t index) {
+	if (index != position) {
+		laszip_seek_point(handle, index);
+		position = index;
+	}
+}
+
+void LaszipReader::read() {
+	laszip_read_point(handle);
+	position++;
+}
+
+void LaszipReader::getCoordinates(double* coordinates) {
+	laszip_get_coordinates(handle, coordinates);
+}
+
+LasReaderCache::Entry& LasReaderCache::getEntry(string path) {
+
+	for (int64_t i = 0; i < int64_t(entries.size()); i++) {
+		if (entries[i].path == path) {
+			// move to the back, it's now the most recently used one
+			Entry entry = entries[i];
+			entries.erase(entries.begin() + i);
+			entries.push_back(entry);
+
+			return entries.back();
+		}
+	}
+
+	if (int64_t(entries.size()) >= capacity) {
+		entries.erase(entries.begin());
+	}
+
+	Entry entry;
+	entry.path = path;
+	entries.push_back(entry);
+
+	return entries.back();
+}
+
+shared_ptr<LaszipReader> LasReaderCache::getLaszipReader(string path) {
+	Entry& entry = getEntry(path);
+
+	if (entry.laszipReader == nullptr) {
+		entry.laszipReader = make_shared<LaszipReader>(path);
+	}
+
+	return entry.laszipReader;
+}
+
+shared_ptr<LasPointRecords> LasReaderCache::getMappedRecords(string path, shared_ptr<LasHeader> header) {
+	Entry& entry = getEntry(path);
+
+	if (!entry.mappingAttempted) {
+		// laz files can't be mapped, don't bother loading their header
+		if (header == nullptr && iEndsWith(path, ".las")) {
+			header = make_shared<LasHeader>(loadLasHeader(path));
+		}
+
+		if (header != nullptr) {
+			entry.records = mapLasPoints(path, *header);
+		}
+
+		entry.mappingAttempted = true;
+	}
+
+	return entry.records;
+}
+
+template<class T>
+inline T readRecordValue(uint8_t* source) {
+	T value;
+	memcpy(&value, source, sizeof(T));
+
+	return value;
+}
+
+// reads a value from each record, writes it to the target layout and updates min/max
+template<class T, class Read>
+void decodeColumn(LasPointRecords& records, uint8_t* target, int64_t bpp, int64_t targetOffset, Attribute* attribute, Read read) {
+
+	double min = attribute->min.x;
+	double max = attribute->max.x;
+
+	uint8_t* record = records.data;
+	uint8_t* targetValue = target + targetOffset;
+
+	for (int64_t i = 0; i < records.numPoints; i++) {
+		T value = read(record);
+
+		memcpy(targetValue, &value, sizeof(T));
+
+		min = std::min(min, double(value));
+		max = std::max(max, double(value));
+
+		record += records.recordLength;
+		targetValue += bpp;
+	}
+
+	attribute->min.x = min;
+	attribute->max.x = max;
+}
+
+// copies an attribute with up to 3 elements of type T
+template<class T>
+void decodeVectorColumn(LasPointRecords& records, int64_t sourceOffset, int64_t size, uint8_t* target, int64_t bpp, int64_t targetOffset, Attribute* attribute) {
+
+	int numElements = attribute->numElements;
+
+	uint8_t* record = records.data;
+	uint8_t* targetValue = target + targetOffset;
+
+	for (int64_t i = 0; i < records.numPoints; i++) {
+		uint8_t* source = record + sourceOffset;
+
+		memcpy(targetValue, source, size);
+
+		for (int j = 0; j < numElements; j++) {
+			double value = double(readRecordValue<T>(source + j * sizeof(T)));
+
+			double* min = &attribute->min.x + j;
+			double* max = &attribute->max.x + j;
+			*min = std::min(*min, value);
+			*max = std::max(*max, value);
+		}
+
+		record += records.recordLength;
+		targetValue += bpp;
+	}
+}
+
+void decodeVectorColumn(LasPointRecords& records, int64_t sourceOffset, int64_t size, uint8_t* target, int64_t bpp, int64_t targetOffset, Attribute* attribute) {
+
+	auto type = attribute->type;
+
+	if (type == AttributeType::INT8) {
+		decodeVectorColumn<int8_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::INT16) {
+		decodeVectorColumn<int16_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::INT32) {
+		decodeVectorColumn<int32_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::INT64) {
+		decodeVectorColumn<int64_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::UINT8) {
+		decodeVectorColumn<uint8_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::UINT16) {
+		decodeVectorColumn<uint16_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::UINT32) {
+		decodeVectorColumn<uint32_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::UINT64) {
+		decodeVectorColumn<uint64_t>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::FLOAT) {
+		decodeVectorColumn<float>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else if (type == AttributeType::DOUBLE) {
+		decodeVectorColumn<double>(records, sourceOffset, size, target, bpp, targetOffset, attribute);
+	} else {
+		// unknown types are copied without min/max
+		uint8_t* record = records.data;
+		for (int64_t i = 0; i < records.numPoints; i++) {
+			memcpy(target + i * bpp + targetOffset, record + sourceOffset, size);
+			record += records.recordLength;
+		}
+	}
+}
+
+void decodeLasPoints(LasPointRecords& records, Attributes& inputAttributes, Attributes& outputAttributes, uint8_t* target) {
+
+	auto& header = records.header;
+	int format = header.pointDataFormat;
+	bool isLegacyFormat = format < 6;
+	int64_t bpp = outputAttributes.bytes;
+
+	// reset min/max, the caller passes a per-thread copy of the output attributes
+	for (auto& attribute : outputAttributes.list) {
+		attribute.min = { Infinity, Infinity, Infinity };
+		attribute.max = { -Infinity, -Infinity, -Infinity };
+	}
+
+	{ // POSITION
+		Attribute* aPosition = outputAttributes.get("position");
+		Vector3 scale = header.scale;
+		Vector3 offset = header.offset;
+		Vector3 posScale = outputAttributes.posScale;
+		Vector3 posOffset = outputAttributes.posOffset;
+
+		Vector3 min = aPosition->min;
+		Vector3 max = aPosition->max;
+
+		uint8_t* record = records.data;
+		for (int64_t i = 0; i < records.numPoints; i++) {
+
+			// same as laszip_get_coordinates()
+			double x = scale.x * double(readRecordValue<int32_t>(record + 0)) + offset.x;
+			double y = scale.y * double(readRecordValue<int32_t>(record + 4)) + offset.y;
+			double z = scale.z * double(readRecordValue<int32_t>(record + 8)) + offset.z;
+
+			int32_t X = int32_t((x - posOffset.x) / posScale.x);
+			int32_t Y = int32_t((y - posOffset.y) / posScale.y);
+			int32_t Z = int32_t((z - posOffset.z) / posScale.z);
+
+			memcpy(target + i * bpp + 0, &X, 4);
+			memcpy(target + i * bpp + 4, &Y, 4);
+			memcpy(target + i * bpp + 8, &Z, 4);
+
+			min.x = std::min(min.x, x);
+			min.y = std::min(min.y, y);
+			min.z = std::min(min.z, z);
+
+			max.x = std::max(max.x, x);
+			max.y = std::max(max.y, y);
+			max.z = std::max(max.z, z);
+
+			record += records.recordLength;
+		}
+
+		aPosition->min = min;
+		aPosition->max = max;
+	}
+
+	// return numbers of formats 6-10 are clamped to the 3 bits of the legacy fields, the same way laszip does it.
+	auto legacyReturns = [](uint8_t* record) -> std::pair<uint8_t, uint8_t> {
+		uint8_t returnNumber = record[14] & 0b1111;
+		uint8_t numberOfReturns = record[14] >> 4;
+
+		if (numberOfReturns > 7) {
+			if (returnNumber > 6) {
+				returnNumber = returnNumber >= numberOfReturns ? 7 : 6;
+			}
+			numberOfReturns = 7;
+		}
+
+		return { returnNumber & 0b111, numberOfReturns };
+	};
+
+	unordered_map<int, int> rgbOffsets = { {2, 20}, {3, 28}, {5, 28}, {7, 30}, {8, 30}, {10, 30} };
+	unordered_map<int, int> wavePacketOffsets = { {4, 28}, {5, 34}, {9, 30}, {10, 38} };
+
+	{ // STANDARD LAS ATTRIBUTES
+		for (auto& inputAttribute : inputAttributes.list) {
+			string name = inputAttribute.name;
+			Attribute* attribute = outputAttributes.get(name);
+			int64_t targetOffset = outputAttributes.getOffset(name);
+
+			if (name == "position" || attribute == nullptr) {
+				continue;
+			}
+
+			if (name == "intensity") {
+				decodeColumn<uint16_t>(records, target, bpp, targetOffset, attribute, [](uint8_t* record) {
+					return readRecordValue<uint16_t>(record + 12);
+				});
+			} else if (name == "return number" && isLegacyFormat) {
+				decodeColumn<uint8_t>(records, target, bpp, targetOffset, attribute, [](uint8_t* record) {
+					return uint8_t(record[14] & 0b111);
+				});
+			} else if (name == "return number") {
+				decodeColumn<uint8_t>(records, target, bpp, targetOffset, attribute, [legacyReturns](uint8_t* record) {
+					return legacyReturns(record).first;
+				});
+			} else if (name == "number of returns" && isLegacyFormat) {
+				decodeColumn<uint8_t>(records, target, bpp, targetOffset, attribute, [](uint8_t* record) {
+					return uint8_t((record[14] >> 3) & 0b111);
+				});
+			} else if (name == "number of returns") {
+				decodeColumn<uint8_t>(records, target, bpp, targetOffset, attribute, [legacyReturns](uint8_t* record) {
+					return legacyReturns(record).second;
+				});
+			} else if (name == "classification") {
+				int64_t classificationOffset = isLegacyFormat ? 15 : 16;
+				uint8_t mask = isLegacyFormat ? 0b11111 : 0xFF;
+				auto& histogram = attribute->histogram;
+
+				decodeColumn<uint8_t>(records, target, bpp, targetOffset, attribute, [classificationOffset, mask, &histogram](uint8_t* record) {
+					uint8_t value = record[classificationOffset] & mask;
+					histogram[value]++;
+
+					return value;
+				});
+			} else if (name == "classification flags") {
+				decodeColumn<uint8_t>(records, target, bpp, targetOffset, attribute, [](uint8_t* record) {
+					return uint8_t(record[15] & 0b1111);
+				});
+			} else if (name == "scan angle rank") {
+				decodeColumn<int8_t>(records, target, bpp, targetOffset, attribute, [](uint8_t* record) {
+					return readRecordValue<int8_t>(record + 16);
+				});
+			} else if (name == "scan angle") {
+				decodeColumn<int16_t>(records, target, bpp, targetOffset, attribute, [](uint8_t* record) {
+					return readRecordValue<int16_t>(record + 18);
+				});
+			} else if (name == "user data") {
+				decodeColumn<uint8_t>(records, target, bpp, targetOffset, attribute, [](uint8_t* record) {
+					return record[17];
+				});
+			} else if (name == "point source id") {
+				int64_t sourceOffset = isLegacyFormat ? 18 : 20;
+				decodeColumn<uint16_t>(records, target, bpp, targetOffset, attribute, [sourceOffset](uint8_t* record) {
+					return readRecordValue<uint16_t>(record + sourceOffset);
+				});
+			} else if (name == "gps-time") {
+				int64_t sourceOffset = isLegacyFormat ? 20 : 22;
+				decodeColumn<double>(records, target, bpp, targetOffset, attribute, [sourceOffset](uint8_t* record) {
+					return readRecordValue<double>(record + sourceOffset);
+				});
+			} else if (name == "rgb" && rgbOffsets.find(format) != rgbOffsets.end()) {
+				decodeVectorColumn(records, rgbOffsets[format], 6, target, bpp, targetOffset, attribute);
+			} else if (name == "nir" && rgbOffsets.find(format) != rgbOffsets.end()) {
+				decodeVectorColumn(records, rgbOffsets[format] + 6, 2, target, bpp, targetOffset, attribute);
+			} else if (wavePacketOffsets.find(format) != wavePacketOffsets.end()) {
+				int64_t waveOffset = wavePacketOffsets[format];
+
+				if (name == "wave packet descriptor index") {
+					decodeVectorColumn(records, waveOffset + 0, 1, target, bpp, targetOffset, attribute);
+				} else if (name == "byte offset to waveform data") {
+					decodeVectorColumn(records, waveOffset + 1, 8, target, bpp, targetOffset, attribute);
+				} else if (name == "waveform packet size") {
+					decodeVectorColumn(records, waveOffset + 9, 4, target, bpp, targetOffset, attribute);
+				} else if (name == "return point waveform location") {
+					decodeVectorColumn(records, waveOffset + 13, 4, target, bpp, targetOffset, attribute);
+				} else if (name == "XYZ(t)") {
+					decodeVectorColumn(records, waveOffset + 17, 12, target, bpp, targetOffset, attribute);
+				}
+			}
+		}
+	}
+
+	{ // EXTRA ATTRIBUTES
+		int firstExtraIndex = lasFirstExtraAttributeIndex(format);
+		int64_t sourceOffset = lasStandardRecordSize(format);
+
+		// same target offsets as the laszip path in the chunker
+		int64_t attributeOffset = 0;
+		for (int i = 0; i < firstExtraIndex; i++) {
+			attributeOffset += inputAttributes.list[i].size;
+		}
+
+		for (int i = firstExtraIndex; i < int(inputAttributes.list.size()); i++) {
+			Attribute& inputAttribute = inputAttributes.list[i];
+			Attribute* attribute = outputAttributes.get(inputAttribute.name);
+
+			if (attribute != nullptr) {
+				decodeVectorColumn(records, sourceOffset, inputAttribute.size, target, bpp, attributeOffset, attribute);
+
+				attributeOffset += attribute->size;
+			}
+
+			sourceOffset += inputAttribute.size;
+		}
+	}
+
+}
@@ -5,6 +5,8 @@
 #include "Vector3.h"
 #include "Attributes.h"
 
+#include "laszip/laszip_api.h"
+
 
 struct LasTypeInfo {
 	AttributeType type = AttributeType::UNDEFINED;
@@ -34,9 +36,115 @@ struct LasHeader {
 };
 
 
+// point records of an uncompressed las file, accessed through a memory mapping.
+// allows decoding points in batches without going through laszip point by point.
+struct LasPointRecords {
+	LasHeader header;
+
+	int64_t offsetToPointData = 0;
+	int64_t recordLength = 0;
+
+	int64_t firstPoint = 0;
+	int64_t numPoints = 0;
+
+	shared_ptr<MappedFile> mapping;
+
+	// first mapped record
+	uint8_t* data = nullptr;
+
+	// a subset of the mapped records, sharing the same mapping
+	LasPointRecords range(int64_t firstPoint, int64_t numPoints) {
+		LasPointRecords records = *this;
+		records.data = data + (firstPoint - this->firstPoint) * recordLength;
+		records.firstPoint = firstPoint;
+		records.numPoints = numPoints;
+
+		return records;
+	}
+};
+
+// a laszip reader that stays open between batches. 
+// keeps track of its position, so that reading on where the previous batch stopped doesn't need a seek.
+struct LaszipReader {
+
+	string path;
+
+	laszip_POINTER handle = nullptr;
+	laszip_header* header = nullptr;
+	laszip_point* point = nullptr;
+
+	// index of the point that is returned by the next read()
+	int64_t position = 0;
+
+	LaszipReader(string path);
+
+	~LaszipReader();
+
+	LaszipReader(const LaszipReader&) = delete;
+	LaszipReader& operator=(const LaszipReader&) = delete;
+
+	void seek(int64_t index);
+
+	void read();
+
+	void getCoordinates(double* coordinates);
+};
+
+// readers of a single thread, keyed by path. mapped las files and open laszip readers are
+// reused by consecutive batches of the same file. the least recently used entries are closed
+// once <capacity> is exceeded, to keep the number of open file handles in check.
+struct LasReaderCache {
+
+	struct Entry {
+		string path;
+		shared_ptr<LaszipReader> laszipReader;
+		shared_ptr<LasPointRecords> records;
+		bool mappingAttempted = false;
+	};
+
+	int64_t capacity = 4;
+
+	// most recently used entry last
+	vector<Entry> entries;
+
+	shared_ptr<LaszipReader> getLaszipReader(string path);
+
+	// nullptr if the file can't be read natively. see mapLasPoints().
+	// <header> may be nullptr, in which case it is loaded from the file.
+	shared_ptr<LasPointRecords> getMappedRecords(string path, shared_ptr<LasHeader> header);
+
+private: 
+
+	Entry& getEntry(string path);
+
+};
+
+
 LasTypeInfo lasTypeInfo(int typeID);
 
+// index of the first extra attribute in the attribute list of a point format, -1 if the format isn't supported
+// +1 for all formats with returns, which is split into return number and number of returns
+int lasFirstExtraAttributeIndex(int pointDataFormat);
+
+// size of the standard part of a point record. extra bytes start at this offset.
+int lasStandardRecordSize(int pointDataFormat);
+
 LasHeader loadLasHeader(string path);
 
+// point counts of the chunks of a laz file, in order. 
+// empty if the file isn't chunked or the chunk table can't be read.
+vector<int64_t> loadLazChunkSizes(string path);
+
+// maps <numPoints> records of a las file, starting at <firstPoint>. 
+// returns nullptr if the points can't be read natively, e.g. because the file is compressed.
+shared_ptr<LasPointRecords> mapLasPoints(string path, int64_t firstPoint, int64_t numPoints);
+
+// maps all records of a las file whose header was already loaded
+shared_ptr<LasPointRecords> mapLasPoints(string path, LasHeader& header);
+
+// converts the mapped records into the point layout of <outputAttributes>, like the laszip path in the chunker does.
+// min, max and histograms of the decoded values are accumulated in <outputAttributes>.
+void decodeLasPoints(LasPointRecords& records, Attributes& inputAttributes, Attributes& outputAttributes, uint8_t* target);
+
 
 
@@ -1,13 +1,13 @@
-
 #pragma once
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
-#include <deque>
+#include <queue>
 #include <vector>
+#include <memory>
 #include <functional>
-#include <atomic>
 
 //using namespace std;
 
@@ -15,65 +15,106 @@ using std::thread;
 using std::atomic;
 using std::mutex;
 using std::vector;
-using std::deque;
 using std::function;
 using std::lock_guard;
-
-// might be better off using https://github.com/progschj/ThreadPool
+using std::unique_lock;
+using std::condition_variable;
+using std::shared_ptr;
+using std::unique_ptr;
+
+// Work-stealing thread pool.
+// Each worker has its own queue and takes the task with the highest priority from it.
+// Workers whose queue is empty steal from the other workers, and sleep if there is no work at all.
+// Tasks that are added by a running task go to the queue of the worker that runs it,
+// all other tasks are distributed over the workers in turn.
 template<class Task>
 class TaskPool {
 public:
+
+	struct Entry {
+		int64_t priority = 0;
+		int64_t sequence = 0;
+		shared_ptr<Task> task;
+
+		// higher priority first, and tasks with the same priority in the order in which they were added
+		bool operator<(const Entry& other) const {
+			if (priority != other.priority) {
+				return priority < other.priority;
+			}
+
+			return sequence > other.sequence;
+		}
+	};
+
+	struct Worker {
+		mutex mtx;
+		std::priority_queue<Entry> queue;
+	};
+
 	size_t numThreads = 0;
-	deque<shared_ptr<Task>> tasks;
 	using TaskProcessorType = function<void(shared_ptr<Task>)>;
 	TaskProcessorType processor;
 
+	vector<unique_ptr<Worker>> workers;
 	vector<thread> threads;
 
-	atomic<bool> isClosed = false;
+	// numQueued: tasks in any of the queues. numPending: tasks that are queued or in process
+	mutex mtx_state;
+	condition_variable cv_work;
+	condition_variable cv_idle;
+	int64_t numQueued = 0;
+	int64_t numPending = 0;
+	bool isClosed = false;
+	bool isJoined = false;
+
+	atomic<int64_t> sequence = 0;
+	atomic<int64_t> nextWorker = 0;
 	atomic<int> busyThreads = 0;
 
-	mutex mtx_task;
+	// the pool and worker that the current thread belongs to, if any
+	static inline thread_local TaskPool* currentPool = nullptr;
+	static inline thread_local int64_t currentWorker = -1;
 
 	TaskPool(size_t numThreads, TaskProcessorType processor) {
 		this->numThreads = numThreads;
 		this->processor = processor;
 
-		for (int i = 0; i < numThreads; i++) {
-
-			threads.emplace_back([this]() {
-
-				while (true) {
+		for (int64_t i = 0; i < int64_t(numThreads); i++) {
+			workers.push_back(std::make_unique<Worker>());
+		}
 
-					shared_ptr<Task> task = nullptr;
+		for (int64_t i = 0; i < int64_t(numThreads); i++) {
 
-					{ // retrieve task or leave thread if done
-						lock_guard<mutex> lock(mtx_task);
+			threads.emplace_back([this, i]() {
 
-						bool allDone = tasks.size() == 0 && isClosed;
-						bool waitingForWork = tasks.size() == 0 && !allDone;
-						bool workAvailable = tasks.size() > 0;
+				currentPool = this;
+				currentWorker = i;
 
-						if (allDone) {
-							break;
-						} else if (workAvailable) {
-							task = tasks.front();
-							tasks.pop_front();
-
-							if (task != nullptr) {
-								busyThreads++;
-							}
-						}
+				while (true) {
 
-
-					}
+					shared_ptr<Task> task = take(i);
 
 					if (task != nullptr) {
+						busyThreads++;
 						this->processor(task);
 						busyThreads--;
+
+						finish();
+
+						continue;
 					}
 
-					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					{ // sleep until there is work, or leave thread if done
+						unique_lock<mutex> lock(mtx_state);
+
+						cv_work.wait(lock, [this]() {
+							return numQueued > 0 || (isClosed && numPending == 0);
+						});
+
+						if (numQueued == 0 && isClosed && numPending == 0) {
+							break;
+						}
+					}
 				}
 
 			});
@@ -85,55 +126,117 @@ public:
 		this->close();
 	}
 
-	void addTask(shared_ptr<Task> t) {
-		lock_guard<mutex> lock(mtx_task);
+	// takes a task from the worker's own queue, or steals one from another worker
+	shared_ptr<Task> take(int64_t workerIndex) {
 
-		tasks.push_back(t);
-	}
+		for (int64_t i = 0; i < int64_t(numThreads); i++) {
+			auto& worker = *workers[(workerIndex + i) % numThreads];
 
-	void close() {
-		if (isClosed) {
-			return;
-		}
+			shared_ptr<Task> task = nullptr;
+			{
+				lock_guard<mutex> lock(worker.mtx);
 
-		isClosed = true;
+				if (worker.queue.empty()) {
+					continue;
+				}
 
-		for (thread& t : threads) {
-			t.join();
+				task = worker.queue.top().task;
+				worker.queue.pop();
+			}
+
+			{
+				lock_guard<mutex> lock(mtx_state);
+				numQueued--;
+			}
+
+			return task;
 		}
+
+		return nullptr;
 	}
 
-	bool isWorkDone() {
+	void finish() {
+		bool isIdle = false;
 
-		lock_guard<mutex> lock(mtx_task);
+		{
+			lock_guard<mutex> lock(mtx_state);
 
-		bool noTasksLeft = tasks.size() == 0;
-		bool noTasksInProcess = busyThreads == 0;
+			numPending--;
+			isIdle = numPending == 0;
+		}
 
-		return noTasksLeft && noTasksInProcess;
+		if (isIdle) {
+			cv_idle.notify_all();
+			cv_work.notify_all();
+		}
 	}
 
-	void waitTillEmpty() {
+	void addTask(shared_ptr<Task> t, int64_t priority = 0) {
 
-		while (true) {
+		{
+			lock_guard<mutex> lock(mtx_state);
+			numPending++;
+		}
 
-			size_t size = 0;
+		int64_t workerIndex = currentPool == this
+			? currentWorker
+			: nextWorker.fetch_add(1) % numThreads;
 
-			{
-				lock_guard<mutex> lock(mtx_task);
+		{
+			auto& worker = *workers[workerIndex];
+			lock_guard<mutex> lock(worker.mtx);
 
-				size = tasks.size();
-			}
+			worker.queue.push({ priority, sequence.fetch_add(1), t });
+		}
 
-			if (size == 0) {
-				return;
-			} else {
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			}
+		{
+			lock_guard<mutex> lock(mtx_state);
+			numQueued++;
+		}
 
+		cv_work.notify_one();
+	}
+
+	// waits until all tasks are processed, including tasks that were added by other tasks, and stops the workers
+	void close() {
+		if (isJoined) {
+			return;
 		}
 
+		{
+			lock_guard<mutex> lock(mtx_state);
+			isClosed = true;
+		}
+
+		cv_work.notify_all();
+
+		for (thread& t : threads) {
+			t.join();
+		}
+
+		isJoined = true;
 	}
 
-};
+	// tasks that were added but not yet taken by a worker
+	int64_t numTasksQueued() {
+		lock_guard<mutex> lock(mtx_state);
+
+		return numQueued;
+	}
 
+	bool isWorkDone() {
+		lock_guard<mutex> lock(mtx_state);
+
+		return numPending == 0;
+	}
+
+	// waits until all tasks are processed. The pool remains open for more tasks.
+	void waitTillEmpty() {
+		unique_lock<mutex> lock(mtx_state);
+
+		cv_idle.wait(lock, [this]() {
+			return numPending == 0;
+		});
+	}
+
+};
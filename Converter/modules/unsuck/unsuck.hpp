@@ -107,6 +107,9 @@ struct Buffer {
 	int64_t size = 0;
 	int64_t pos = 0;
 
+	// set if this buffer is a view of a range of another buffer, see Buffer::view()
+	shared_ptr<Buffer> owner = nullptr;
+
 	Buffer() {
 
 	}
@@ -140,6 +143,49 @@ struct Buffer {
 			exit(4312);
 		}
 
+		setData(data);
+
+		this->size = size;
+	}
+
+	~Buffer() {
+		if (owner == nullptr) {
+			free(data);
+		}
+	}
+
+	Buffer(const Buffer&) = delete;
+	Buffer& operator=(const Buffer&) = delete;
+
+	// <size> bytes at <offset> of <source>, without copying them.
+	// The view keeps the memory of <source> alive. Views of views refer to the buffer that owns the memory.
+	static shared_ptr<Buffer> view(shared_ptr<Buffer> source, int64_t offset, int64_t size) {
+		auto buffer = make_shared<Buffer>();
+
+		buffer->owner = source->owner != nullptr ? source->owner : source;
+		buffer->setData(source->data_u8 + offset);
+		buffer->size = size;
+
+		return buffer;
+	}
+
+	// <buffer> if nothing else refers to it, otherwise <buffer> is replaced with a copy of itself.
+	// Points are modified in place through the returned buffer, so that ranges that are
+	// only read are never copied, and ranges that are modified are only copied if they are shared.
+	static shared_ptr<Buffer> writable(shared_ptr<Buffer>& buffer) {
+		if (buffer.use_count() > 1) {
+			auto copy = make_shared<Buffer>(buffer->size);
+			memcpy(copy->data, buffer->data, buffer->size);
+
+			buffer = copy;
+		}
+
+		return buffer;
+	}
+
+	void setData(void* data) {
+		this->data = data;
+
 		data_u8 = reinterpret_cast<uint8_t*>(data);
 		data_u16 = reinterpret_cast<uint16_t*>(data);
 		data_u32 = reinterpret_cast<uint32_t*>(data);
@@ -151,12 +197,6 @@ struct Buffer {
 		data_f32 = reinterpret_cast<float*>(data);
 		data_f64 = reinterpret_cast<double*>(data);
 		data_char = reinterpret_cast<char*>(data);
-
-		this->size = size;
-	}
-
-	~Buffer() {
-		free(data);
 	}
 
 	template<class T>
@@ -185,6 +225,51 @@ struct Buffer {
 
 };
 
+// read-only memory mapping of a byte range of a file.
+// data is nullptr if the file couldn't be mapped.
+struct MappedFile {
+
+	uint8_t* data = nullptr;
+	int64_t size = 0;
+
+	// start and size of the page-aligned mapping that contains the requested range
+	void* mappingStart = nullptr;
+	int64_t mappingSize = 0;
+
+	MappedFile(string path, int64_t offset, int64_t size);
+
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+};
+
+// file that is written at explicit offsets. 
+// Writes to disjoint ranges may be issued concurrently from multiple threads.
+struct OffsetFile {
+
+	// file descriptor, or HANDLE on windows
+	int64_t handle = -1;
+	string path;
+
+	// creates the file if it doesn't exist
+	OffsetFile(string path);
+
+	~OffsetFile();
+
+	OffsetFile(const OffsetFile&) = delete;
+	OffsetFile& operator=(const OffsetFile&) = delete;
+
+	// reserves disk space for the whole file, so that later writes don't need to allocate blocks.
+	// also sets the file size.
+	void preallocate(int64_t size);
+
+	// exits on failure
+	void write(int64_t offset, const void* data, int64_t size);
+
+};
+
 
 
 inline double now() {
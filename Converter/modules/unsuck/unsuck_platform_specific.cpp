@@ -145,12 +145,114 @@ CpuData getCpuData() {
 	return data;
 }
 
+MappedFile::MappedFile(string path, int64_t offset, int64_t size) {
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+	if (mapping == NULL) {
+		CloseHandle(file);
+		return;
+	}
+
+	// views must start at a multiple of the allocation granularity
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	int64_t granularity = sysInfo.dwAllocationGranularity;
+	int64_t alignedOffset = offset - (offset % granularity);
+	int64_t alignedSize = size + (offset - alignedOffset);
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 
+		DWORD(alignedOffset >> 32), DWORD(alignedOffset & 0xFFFFFFFF), 
+		SIZE_T(alignedSize));
+
+	// the view keeps the mapping alive
+	CloseHandle(mapping);
+	CloseHandle(file);
+
+	if (view == NULL) {
+		return;
+	}
+
+	this->mappingStart = view;
+	this->mappingSize = alignedSize;
+	this->data = reinterpret_cast<uint8_t*>(view) + (offset - alignedOffset);
+	this->size = size;
+}
+
+MappedFile::~MappedFile() {
+	if (mappingStart != nullptr) {
+		UnmapViewOfFile(mappingStart);
+	}
+}
+
+OffsetFile::OffsetFile(string path) {
+	this->path = path;
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		cout << "ERROR: could not open file for writing: " << path << endl;
+		exit(123);
+	}
+
+	this->handle = reinterpret_cast<int64_t>(file);
+}
+
+OffsetFile::~OffsetFile() {
+	CloseHandle(reinterpret_cast<HANDLE>(handle));
+}
+
+void OffsetFile::preallocate(int64_t size) {
+	HANDLE file = reinterpret_cast<HANDLE>(handle);
+
+	FILE_ALLOCATION_INFO allocationInfo;
+	allocationInfo.AllocationSize.QuadPart = size;
+	SetFileInformationByHandle(file, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo));
+
+	FILE_END_OF_FILE_INFO endOfFileInfo;
+	endOfFileInfo.EndOfFile.QuadPart = size;
+	SetFileInformationByHandle(file, FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo));
+}
+
+void OffsetFile::write(int64_t offset, const void* data, int64_t size) {
+	HANDLE file = reinterpret_cast<HANDLE>(handle);
+	const uint8_t* source = reinterpret_cast<const uint8_t*>(data);
+
+	while (size > 0) {
+		DWORD toWrite = DWORD(std::min(size, int64_t(1024 * 1024 * 1024)));
+		DWORD written = 0;
+
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = DWORD(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+
+		if (!WriteFile(file, source, toWrite, &written, &overlapped)) {
+			cout << "ERROR: failed to write " << formatNumber(size) << " bytes to " << path << endl;
+			exit(123);
+		}
+
+		source += written;
+		offset += written;
+		size -= written;
+	}
+}
+
 #elif defined(__linux__)
 
 // see https://stackoverflow.com/questions/63166/how-to-determine-cpu-and-memory-consumption-from-inside-a-process
 
 #include "sys/types.h"
 #include "sys/sysinfo.h"
+#include "sys/mman.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "errno.h"
 
 #include "stdlib.h"
 #include "stdio.h"
@@ -356,5 +458,87 @@ CpuData getCpuData() {
 	return data;
 }
 
+MappedFile::MappedFile(string path, int64_t offset, int64_t size) {
+
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd == -1) {
+		return;
+	}
+
+	// mappings must start at a multiple of the page size
+	int64_t pageSize = sysconf(_SC_PAGESIZE);
+	int64_t alignedOffset = offset - (offset % pageSize);
+	int64_t alignedSize = size + (offset - alignedOffset);
+
+	void* mapped = mmap(nullptr, alignedSize, PROT_READ, MAP_PRIVATE, fd, alignedOffset);
+
+	// the mapping keeps the file alive
+	close(fd);
+
+	if (mapped == MAP_FAILED) {
+		return;
+	}
+
+	// points are decoded front to back, let the kernel read ahead aggressively
+	madvise(mapped, alignedSize, MADV_SEQUENTIAL);
+
+	this->mappingStart = mapped;
+	this->mappingSize = alignedSize;
+	this->data = reinterpret_cast<uint8_t*>(mapped) + (offset - alignedOffset);
+	this->size = size;
+}
+
+MappedFile::~MappedFile() {
+	if (mappingStart != nullptr) {
+		munmap(mappingStart, mappingSize);
+	}
+}
+
+OffsetFile::OffsetFile(string path) {
+	this->path = path;
+
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd == -1) {
+		cout << "ERROR: could not open file for writing: " << path << ", " << strerror(errno) << endl;
+		exit(123);
+	}
+
+	this->handle = fd;
+}
+
+OffsetFile::~OffsetFile() {
+	close(handle);
+}
+
+void OffsetFile::preallocate(int64_t size) {
+	// not all file systems support fallocate, just set the size in that case
+	if (fallocate(handle, 0, 0, size) != 0) {
+		if (ftruncate(handle, size) != 0) {
+			cout << "WARNING: could not preallocate " << formatNumber(size) << " bytes for " << path << endl;
+		}
+	}
+}
+
+void OffsetFile::write(int64_t offset, const void* data, int64_t size) {
+	const uint8_t* source = reinterpret_cast<const uint8_t*>(data);
+
+	while (size > 0) {
+		ssize_t written = pwrite(handle, source, size, offset);
+
+		if (written < 0 && errno == EINTR) {
+			continue;
+		} else if (written <= 0) {
+			cout << "ERROR: failed to write " << formatNumber(size) << " bytes to " << path << ", " << strerror(errno) << endl;
+			exit(123);
+		}
+
+		source += written;
+		offset += written;
+		size -= written;
+	}
+}
+
 
 #endif
\ No newline at end of file
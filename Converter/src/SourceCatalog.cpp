@@ -0,0 +1,223 @@
+
+#include "SourceCatalog.h"
+
+#include <execution>
+#include <mutex>
+#include <filesystem>
+
+#include "json/json.hpp"
+#include "logger.h"
+
+using json = nlohmann::json;
+
+using std::mutex;
+using std::lock_guard;
+
+namespace fs = std::filesystem;
+
+// bump if the layout of the catalog file changes. catalogs with a different version are ignored.
+constexpr int catalogVersion = 1;
+
+static string toHex(const uint8_t* data, int64_t size) {
+	const char* digits = "0123456789abcdef";
+
+	string hex(2 * size, '0');
+	for (int64_t i = 0; i < size; i++) {
+		hex[2 * i + 0] = digits[data[i] >> 4];
+		hex[2 * i + 1] = digits[data[i] & 15];
+	}
+
+	return hex;
+}
+
+static vector<uint8_t> fromHex(string hex) {
+	auto nibble = [](char c) {
+		return (c >= 'a') ? (c - 'a' + 10) : (c - '0');
+	};
+
+	vector<uint8_t> data(hex.size() / 2);
+	for (int64_t i = 0; i < int64_t(data.size()); i++) {
+		data[i] = (nibble(hex[2 * i + 0]) << 4) | nibble(hex[2 * i + 1]);
+	}
+
+	return data;
+}
+
+static json toJson(Vector3 v) {
+	return { v.x, v.y, v.z };
+}
+
+static Vector3 toVector3(json& js) {
+	return { js[0].get<double>(), js[1].get<double>(), js[2].get<double>() };
+}
+
+// catalog entries are keyed by absolute path, so the catalog also works if it's used from another working directory
+static string getKey(string path) {
+	return fs::absolute(path).lexically_normal().string();
+}
+
+static int64_t getLastModified(string path) {
+	return fs::last_write_time(path).time_since_epoch().count();
+}
+
+SourceCatalog SourceCatalog::load(string path) {
+
+	SourceCatalog catalog;
+
+	if (!fs::exists(path)) {
+		return catalog;
+	}
+
+	try {
+		json js = json::parse(readFile(path));
+
+		if (js["version"].get<int>() != catalogVersion) {
+			logger::WARN("ignoring source catalog with unsupported version: " + path);
+
+			return catalog;
+		}
+
+		for (auto& jsEntry : js["entries"]) {
+			Entry entry;
+			entry.path = jsEntry["path"];
+			entry.filesize = jsEntry["filesize"];
+			entry.lastModified = jsEntry["lastModified"];
+			entry.chunkSizes = jsEntry["chunkSizes"].get<vector<int64_t>>();
+
+			auto& jsHeader = jsEntry["header"];
+			auto header = make_shared<LasHeader>();
+			header->min = toVector3(jsHeader["min"]);
+			header->max = toVector3(jsHeader["max"]);
+			header->scale = toVector3(jsHeader["scale"]);
+			header->offset = toVector3(jsHeader["offset"]);
+			header->numPoints = jsHeader["numPoints"];
+			header->pointDataFormat = jsHeader["pointDataFormat"];
+
+			for (auto& jsVlr : jsHeader["vlrs"]) {
+				VLR vlr;
+
+				string userID = jsVlr["userID"];
+				string description = jsVlr["description"];
+
+				memset(vlr.userID, 0, sizeof(vlr.userID));
+				memset(vlr.description, 0, sizeof(vlr.description));
+				memcpy(vlr.userID, userID.data(), std::min(userID.size(), sizeof(vlr.userID)));
+				memcpy(vlr.description, description.data(), std::min(description.size(), sizeof(vlr.description)));
+
+				vlr.recordID = jsVlr["recordID"];
+				vlr.data = fromHex(jsVlr["data"]);
+				vlr.recordLengthAfterHeader = vlr.data.size();
+
+				header->vlrs.push_back(vlr);
+			}
+
+			entry.header = header;
+
+			catalog.entries[getKey(entry.path)] = entry;
+		}
+	} catch (std::exception& e) {
+		logger::WARN("could not read source catalog " + path + ", headers will be parsed again. " + e.what());
+
+		return SourceCatalog();
+	}
+
+	return catalog;
+}
+
+void SourceCatalog::save(string path) {
+
+	json js;
+	js["version"] = catalogVersion;
+	js["entries"] = json::array();
+
+	for (auto& [key, entry] : entries) {
+		auto& header = *entry.header;
+
+		json jsHeader;
+		jsHeader["min"] = toJson(header.min);
+		jsHeader["max"] = toJson(header.max);
+		jsHeader["scale"] = toJson(header.scale);
+		jsHeader["offset"] = toJson(header.offset);
+		jsHeader["numPoints"] = header.numPoints;
+		jsHeader["pointDataFormat"] = header.pointDataFormat;
+		jsHeader["vlrs"] = json::array();
+
+		for (auto& vlr : header.vlrs) {
+			json jsVlr;
+			jsVlr["userID"] = string(vlr.userID, strnlen(vlr.userID, sizeof(vlr.userID)));
+			jsVlr["recordID"] = vlr.recordID;
+			jsVlr["description"] = string(vlr.description, strnlen(vlr.description, sizeof(vlr.description)));
+			jsVlr["data"] = toHex(vlr.data.data(), vlr.data.size());
+
+			jsHeader["vlrs"].push_back(jsVlr);
+		}
+
+		json jsEntry;
+		jsEntry["path"] = entry.path;
+		jsEntry["filesize"] = entry.filesize;
+		jsEntry["lastModified"] = entry.lastModified;
+		jsEntry["chunkSizes"] = entry.chunkSizes;
+		jsEntry["header"] = jsHeader;
+
+		js["entries"].push_back(jsEntry);
+	}
+
+	// write to a temporary file first, so that an interrupted conversion doesn't leave a broken catalog behind
+	string tmpPath = path + ".tmp";
+	writeFile(tmpPath, js.dump(1, '\t'));
+	fs::rename(tmpPath, path);
+}
+
+void SourceCatalog::update(vector<string> paths) {
+
+	vector<string> outdated;
+
+	for (auto& path : paths) {
+		auto it = entries.find(getKey(path));
+
+		bool isUpToDate = it != entries.end()
+			&& it->second.filesize == int64_t(fs::file_size(path))
+			&& it->second.lastModified == getLastModified(path);
+
+		if (!isUpToDate) {
+			outdated.push_back(path);
+		}
+	}
+
+	mutex mtx;
+	auto parallel = std::execution::par;
+	for_each(parallel, outdated.begin(), outdated.end(), [this, &mtx](string path) {
+
+		Entry entry;
+		entry.path = path;
+		entry.filesize = fs::file_size(path);
+		entry.lastModified = getLastModified(path);
+		entry.header = make_shared<LasHeader>(loadLasHeader(path));
+
+		if (iEndsWith(path, ".laz")) {
+			entry.chunkSizes = loadLazChunkSizes(path);
+		}
+
+		lock_guard<mutex> lock(mtx);
+		entries[getKey(path)] = entry;
+	});
+
+	numParsed = outdated.size();
+}
+
+Source SourceCatalog::createSource(string path) {
+
+	auto& entry = entries[getKey(path)];
+	auto& header = *entry.header;
+
+	Source source;
+	source.path = path;
+	source.min = header.min;
+	source.max = header.max;
+	source.numPoints = header.numPoints;
+	source.filesize = entry.filesize;
+	source.header = entry.header;
+	source.chunkSizes = entry.chunkSizes;
+
+	return source;
+}
@@ -0,0 +1,111 @@
+#include "chunk_codec.h"
+
+#include <cstring>
+#include <vector>
+
+#include "brotli/encode.h"
+#include "brotli/decode.h"
+
+#include "logger.h"
+
+using std::vector;
+
+namespace chunk_codec {
+
+	// fastest settings that still find most of the redundancy of transposed point records
+	constexpr int quality = 1;
+	constexpr int lgwin = 22;
+
+	inline uint32_t zigzag(int32_t value) {
+		return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+	}
+
+	inline int32_t unzigzag(uint32_t value) {
+		return int32_t(value >> 1) ^ -int32_t(value & 1);
+	}
+
+	shared_ptr<Buffer> encode(uint8_t* points, int64_t numPoints, int64_t bytesPerPoint) {
+
+		int64_t size = numPoints * bytesPerPoint;
+
+		thread_local vector<uint8_t> transposed;
+		thread_local vector<uint8_t> encoded;
+		transposed.resize(size);
+		encoded.resize(BrotliEncoderMaxCompressedSize(size));
+
+		int32_t previous[3] = { 0, 0, 0 };
+		for (int64_t i = 0; i < numPoints; i++) {
+			uint8_t* point = points + i * bytesPerPoint;
+
+			for (int c = 0; c < 3; c++) {
+				int32_t value;
+				memcpy(&value, point + 4 * c, 4);
+
+				uint32_t delta = zigzag(int32_t(uint32_t(value) - uint32_t(previous[c])));
+				previous[c] = value;
+
+				for (int b = 0; b < 4; b++) {
+					transposed[(4 * c + b) * numPoints + i] = (delta >> (8 * b)) & 0xff;
+				}
+			}
+
+			for (int64_t b = 12; b < bytesPerPoint; b++) {
+				transposed[b * numPoints + i] = point[b];
+			}
+		}
+
+		size_t encodedSize = encoded.size();
+		BROTLI_BOOL success = BrotliEncoderCompress(quality, lgwin, BROTLI_MODE_GENERIC, size, transposed.data(), &encodedSize, encoded.data());
+
+		if (success == BROTLI_FALSE) {
+			logger::ERROR("failed to compress chunk data. aborting conversion.");
+
+			exit(123);
+		}
+
+		auto buffer = make_shared<Buffer>(encodedSize);
+		memcpy(buffer->data, encoded.data(), encodedSize);
+
+		return buffer;
+	}
+
+	void decode(uint8_t* encoded, int64_t encodedSize, int64_t numPoints, int64_t bytesPerPoint, uint8_t* target) {
+
+		int64_t size = numPoints * bytesPerPoint;
+
+		thread_local vector<uint8_t> transposed;
+		transposed.resize(size);
+
+		size_t decodedSize = size;
+		auto result = BrotliDecoderDecompress(encodedSize, encoded, &decodedSize, transposed.data());
+
+		if (result != BROTLI_DECODER_RESULT_SUCCESS || int64_t(decodedSize) != size) {
+			logger::ERROR("failed to decompress chunk data, expected " + formatNumber(size) + " bytes, got " + formatNumber(decodedSize) + ". aborting conversion.");
+
+			exit(123);
+		}
+
+		int32_t previous[3] = { 0, 0, 0 };
+		for (int64_t i = 0; i < numPoints; i++) {
+			uint8_t* point = target + i * bytesPerPoint;
+
+			for (int c = 0; c < 3; c++) {
+				uint32_t delta = 0;
+				for (int b = 0; b < 4; b++) {
+					delta |= uint32_t(transposed[(4 * c + b) * numPoints + i]) << (8 * b);
+				}
+
+				int32_t value = int32_t(uint32_t(previous[c]) + uint32_t(unzigzag(delta)));
+				previous[c] = value;
+
+				memcpy(point + 4 * c, &value, 4);
+			}
+
+			for (int64_t b = 12; b < bytesPerPoint; b++) {
+				point[b] = transposed[b * numPoints + i];
+			}
+		}
+
+	}
+
+}
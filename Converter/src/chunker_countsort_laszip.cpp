@@ -6,6 +6,8 @@
 #include <mutex>
 #include <memory>
 #include <atomic>
+#include <execution>
+#include <numeric>
 
 #include "chunker_countsort_laszip.h"
 
@@ -15,6 +17,10 @@
 #include "unsuck/TaskPool.hpp"
 #include "Vector3.h"
 #include "ConcurrentWriter.h"
+#include "grid_kernels.h"
+#include "chunk_codec.h"
+#include "cell_histogram.h"
+#include "MemoryGovernor.h"
 
 #include "json/json.hpp"
 #include "laszip/laszip_api.h"
@@ -33,6 +39,7 @@ using std::lock_guard;
 using std::make_shared;
 using std::shared_ptr;
 using std::unique_ptr;
+using std::make_unique;
 using std::atomic_int32_t;
 
 namespace fs = std::filesystem;
@@ -48,6 +55,15 @@ namespace chunker_countsort_laszip {
 	// auto numFlushThreads = 1;
 
 	int maxPointsPerChunk = 5'000'000;
+
+	// all chunks are stored in this file in the chunk directory. chunks/metadata.json lists their extents.
+	string chunkFileName = "chunks.bin";
+
+	// compress chunk data in blocks with chunk_codec, for when there isn't enough scratch space for raw chunks
+	bool compressChunks = false;
+
+	// chunks are kept in memory for the indexer while their total size fits into this part of the memory budget
+	int64_t maxResidentBytes = 0;
 	int gridSize = 128;
 	mutex mtx_attributes;
 
@@ -61,6 +77,13 @@ namespace chunker_countsort_laszip {
 
 	ConcurrentWriter* writer = nullptr;
 
+	// a compressed block of chunk points in the chunk file
+	struct ChunkBlock {
+		int64_t offset = 0;
+		int64_t size = 0;
+		int64_t numPoints = 0;
+	};
+
 	struct Node {
 
 		string id = "";
@@ -71,6 +94,15 @@ namespace chunker_countsort_laszip {
 		int64_t size;
 		int64_t numPoints;
 
+		// position of the chunk's points in the chunk file
+		int64_t byteOffset = 0;
+
+		// if chunks are compressed, the points are spread over blocks anywhere in the chunk file
+		vector<ChunkBlock> blocks;
+
+		// points of the chunk, if it's kept in memory rather than written to the chunk file
+		shared_ptr<Buffer> points;
+
 		Node(string id, int numPoints) {
 			this->id = id;
 			this->numPoints = numPoints;
@@ -79,6 +111,18 @@ namespace chunker_countsort_laszip {
 
 	vector<Node> nodes;
 
+	// inverse of splitBy3(), extracts every third bit
+	inline int64_t compactBy3(int64_t x) {
+		x = x & 0x1249249249249249;
+		x = (x | x >> 2) & 0x10c30c30c30c30c3;
+		x = (x | x >> 4) & 0x100f00f00f00f00f;
+		x = (x | x >> 8) & 0x1f0000ff0000ff;
+		x = (x | x >> 16) & 0x1f00000000ffff;
+		x = (x | x >> 32) & 0x1fffff;
+
+		return x;
+	}
+
 	string toNodeID(int level, int gridSize, int64_t x, int64_t y, int64_t z) {
 
 		string id = "r";
@@ -114,550 +158,978 @@ namespace chunker_countsort_laszip {
 		return id;
 	}
 
-	template<class T>
-	double asDouble(uint8_t* data) {
-		T value = reinterpret_cast<T*>(data)[0];
+	// morton-ordered range of finest-level cells that belong to a node
+	struct NodeRange {
+		int64_t start;
+		int64_t end;
+		int64_t nodeIndex;
+	};
 
-		return double(value);
-	}
+	// maps morton-ordered cells of the finest level to the index of the node in nodes
+	struct NodeLUT {
+		int64_t gridSize = 0;
 
+		// sorted by start, not overlapping
+		vector<NodeRange> ranges;
 
-	// grid contains index of node in nodes
-	struct NodeLUT {
-		int64_t gridSize;
-		vector<int> grid;
-	};
+		// for each cell of a coarser level, the index of the first range that ends after the start of the coarse cell. 
+		// Limits the binary search to the ranges that overlap with the coarse cell. 
+		vector<int32_t> directory;
+		int64_t directoryShift = 0;
 
-	vector<std::atomic_int32_t> countPointsInCells(vector<Source> sources, Vector3 min, Vector3 max, int64_t gridSize, State& state, Attributes& outputAttributes, Monitor* monitor) {
+		NodeLUT() {}
 
-		cout << endl;
-		cout << "=======================================" << endl;
-		cout << "=== COUNTING                           " << endl;
-		cout << "=======================================" << endl;
+		NodeLUT(int64_t gridSize, vector<NodeRange> ranges) {
+			this->gridSize = gridSize;
+			this->ranges = std::move(ranges);
 
-		auto tStart = now();
+			int64_t level_max = int64_t(log2(gridSize));
+			int64_t directoryLevel = std::min(level_max, int64_t(6));
+			int64_t numEntries = int64_t(1) << (3 * directoryLevel);
 
-		//Vector3 size = max - min;
+			directoryShift = 3 * (level_max - directoryLevel);
+			directory.resize(numEntries + 1);
 
-		vector<std::atomic_int32_t> grid(gridSize * gridSize * gridSize);
+			int64_t rangeIndex = 0;
+			for (int64_t i = 0; i < numEntries; i++) {
+				int64_t start = i << directoryShift;
 
-		struct Task{
-			string path;
-			int64_t totalPoints = 0;
-			int64_t firstPoint;
-			int64_t firstByte;
-			int64_t numBytes;
-			int64_t numPoints;
-			int64_t bpp;
-			Vector3 scale;
-			Vector3 offset;
-			Vector3 min;
-			Vector3 max;
-		};
+				while (rangeIndex < int64_t(this->ranges.size()) && this->ranges[rangeIndex].end <= start) {
+					rangeIndex++;
+				}
 
-		auto processor = [gridSize, &grid, tStart, &state, &outputAttributes, monitor](shared_ptr<Task> task){
-			string path = task->path;
-			int64_t start = task->firstByte;
-			int64_t numBytes = task->numBytes;
-			int64_t numToRead = task->numPoints;
-			int64_t bpp = task->bpp;
-			//Vector3 scale = task->scale;
-			//Vector3 offset = task->offset;
-			Vector3 min = task->min;
-			Vector3 max = task->max;
+				directory[i] = rangeIndex;
+			}
+			directory[numEntries] = this->ranges.size();
+		}
 
-			stringstream ss;
-			ss << "counting " << fs::path(task->path).filename().string() 
-				<< ", first point: " << formatNumber(task->firstPoint)
-				<< ", num points: " << formatNumber(task->numPoints);
-			// cout << ss.str();
-			// monitor->print("counter message", ss.str());
+		// returns -1 if no node contains the cell
+		int64_t find(int64_t cell) {
+			int64_t entry = cell >> directoryShift;
 
-			logger::INFO(ss.str());
-			
-			
+			auto first = ranges.begin() + directory[entry];
+			auto last = ranges.begin() + std::min(int64_t(directory[entry + 1]) + 1, int64_t(ranges.size()));
 
-			thread_local unique_ptr<void, void(*)(void*)> buffer(nullptr, free);
-			thread_local int64_t bufferSize = -1;
+			auto it = std::upper_bound(first, last, cell, [](int64_t cell, const NodeRange& range) {
+				return cell < range.start;
+			});
 
-			{ // sanity checks
-				if(numBytes < 0){
-					logger::ERROR("invalid malloc size: " + formatNumber(numBytes));
-				}
+			if (it == first) {
+				return -1;
 			}
 
-			if (bufferSize < numBytes){
-				buffer.reset(malloc(numBytes));
-				bufferSize = numBytes;
+			it--;
+
+			return cell < it->end ? it->nodeIndex : -1;
+		}
+	};
+
+	// Write-combining buffers of a distributing thread, one per chunk. They persist across batches, 
+	// and a chunk's buffer is only passed to the writer once it's full, or if the thread exceeds its memory budget.
+	// Buffers start small and grow up to partitionCapacity, so that chunks with few points don't reserve the full capacity.
+	// All chunks are stored in one file. cursors holds the next free position within each chunk's extent, shared by all threads.
+	// Compressed buffers are appended to the file instead, and their positions are collected in blocks.
+	// Chunks that are kept in memory receive points directly, at the cursor position within their resident buffer.
+	struct PartitionBuffers {
+
+		static constexpr int64_t partitionCapacity = 4 * 1024 * 1024;
+
+		string path;
+		vector<atomic_int64_t>* cursors = nullptr;
+		int64_t bpp = 0;
+		int64_t maxBytes = 0;
+		bool compress = false;
+
+		vector<shared_ptr<Buffer>> buffers;
+		vector<vector<ChunkBlock>> blocks;
+		int64_t bufferedBytes = 0;
+
+		PartitionBuffers(string path, vector<atomic_int64_t>* cursors, int64_t bpp, int64_t maxBytes, bool compress) {
+			this->path = path;
+			this->cursors = cursors;
+			this->bpp = bpp;
+			this->maxBytes = maxBytes;
+			this->compress = compress;
+
+			buffers.resize(cursors->size(), nullptr);
+			blocks.resize(cursors->size());
+		}
+
+		void add(int64_t partition, uint8_t* points, int64_t numPoints) {
+			int64_t bytes = numPoints * bpp;
+
+			auto& resident = nodes[partition].points;
+			if (resident) {
+				int64_t offset = cursors->at(partition).fetch_add(bytes);
+				memcpy(resident->data_u8 + offset, points, bytes);
+
+				return;
 			}
 
-			laszip_POINTER laszip_reader;
-			{
-				laszip_BOOL is_compressed = iEndsWith(path, ".laz") ? 1 : 0;
-				laszip_BOOL request_reader = 1;
+			auto& buffer = buffers[partition];
+			int64_t used = buffer ? buffer->pos : 0;
 
-				laszip_create(&laszip_reader);
-				laszip_request_compatibility_mode(laszip_reader, request_reader);
-				laszip_open_reader(laszip_reader, path.c_str(), &is_compressed);
-				laszip_seek_point(laszip_reader, task->firstPoint);
+			if (used + bytes > partitionCapacity) {
+				flush(partition);
+				used = 0;
 			}
 
-			double cubeSize = (max - min).max();
-			Vector3 size = { cubeSize, cubeSize, cubeSize };
-			max = min + cubeSize;
+			if (!buffer || used + bytes > buffer->size) {
+				int64_t previousSize = buffer ? buffer->size : 0;
+				int64_t size = std::clamp(2 * previousSize, 64 * bpp, partitionCapacity);
+				size = std::max(size, used + bytes);
 
-			double dGridSize = double(gridSize);
+				auto grown = make_shared<Buffer>(size);
+				if (used > 0) {
+					memcpy(grown->data, buffer->data, used);
+				}
+				grown->pos = used;
 
-			double coordinates[3];
+				buffer = grown;
+			}
 
-			auto posScale = outputAttributes.posScale;
-			auto posOffset = outputAttributes.posOffset;
+			buffer->write(points, bytes);
+			bufferedBytes += bytes;
 
-			for (int i = 0; i < numToRead; i++) {
-				int64_t pointOffset = i * bpp;
-
-				laszip_read_point(laszip_reader);
-				laszip_get_coordinates(laszip_reader, coordinates);
-
-				{
-					// transfer las integer coordinates to new scale/offset/box values
-					double x = coordinates[0];
-					double y = coordinates[1];
-					double z = coordinates[2];
-
-					int32_t X = int32_t((x - posOffset.x) / posScale.x);
-					int32_t Y = int32_t((y - posOffset.y) / posScale.y);
-					int32_t Z = int32_t((z - posOffset.z) / posScale.z);
-
-					double ux = (double(X) * posScale.x + posOffset.x - min.x) / size.x;
-					double uy = (double(Y) * posScale.y + posOffset.y - min.y) / size.y;
-					double uz = (double(Z) * posScale.z + posOffset.z - min.z) / size.z;
-
-					bool inBox = ux >= 0.0 && uy >= 0.0 && uz >= 0.0;
-					inBox = inBox && ux <= 1.0 && uy <= 1.0 && uz <= 1.0;
-
-					if (!inBox) {
-						stringstream ss;
-						ss << "encountered point outside bounding box." << endl;
-						ss << "box.min: " << min.toString() << endl;
-						ss << "box.max: " << max.toString() << endl;
-						ss << "point: " << Vector3(x, y, z).toString() << endl;
-						ss << "file: " << path << endl;
-						ss << "PotreeConverter requires a valid bounding box to operate." << endl;
-						ss << "Please try to repair the bounding box, e.g. using lasinfo with the -repair_bb argument." << endl;
-						logger::ERROR(ss.str());
-
-						exit(123);
-					}
+			if (bufferedBytes > maxBytes) {
+				flush();
+			}
+		}
 
-					int64_t ix = int64_t(std::min(dGridSize * ux, dGridSize - 1.0));
-					int64_t iy = int64_t(std::min(dGridSize * uy, dGridSize - 1.0));
-					int64_t iz = int64_t(std::min(dGridSize * uz, dGridSize - 1.0));
+		void flush(int64_t partition) {
+			auto& buffer = buffers[partition];
 
-					int64_t index = ix + iy * gridSize + iz * gridSize * gridSize;
+			if (!buffer) {
+				return;
+			}
+
+			bufferedBytes -= buffer->pos;
 
-					grid[index]++;
+			write(partition);
+		}
+
+		void flush() {
+			// partitions are independent, and compressing them is expensive, so they're flushed in parallel
+			vector<int64_t> partitions(buffers.size());
+			std::iota(partitions.begin(), partitions.end(), 0);
+
+			std::for_each(std::execution::par, partitions.begin(), partitions.end(), [this](int64_t partition) {
+				if (buffers[partition]) {
+					write(partition);
 				}
+			});
+
+			bufferedBytes = 0;
+		}
 
+		void write(int64_t partition) {
+			auto& buffer = buffers[partition];
+
+			if (compress) {
+				int64_t numPoints = buffer->pos / bpp;
+				auto encoded = chunk_codec::encode(buffer->data_u8, numPoints, bpp);
+
+				int64_t offset = writer->write(path, encoded);
+
+				blocks[partition].push_back({ offset, encoded->size, numPoints });
+			} else {
+				// the writer writes <size> bytes
+				buffer->size = buffer->pos;
+
+				int64_t offset = cursors->at(partition).fetch_add(buffer->size);
+
+				writer->write(path, offset, buffer);
 			}
 
-			laszip_close_reader(laszip_reader);
-			laszip_destroy(laszip_reader);
+			buffer = nullptr;
+		}
 
-			static int64_t pointsProcessed = 0;
-			pointsProcessed += task->numPoints;
+	};
 
-			state.name = "COUNTING";
-			state.pointsProcessed = pointsProcessed;
-			state.duration = now() - tStart;
+	// min/max of an attribute, accumulated in locals while a batch is decoded and 
+	// merged into the attribute once the batch is done.
+	struct AttributeRange {
+		Attribute* attribute = nullptr;
+		int64_t targetOffset = -1;
 
-			//cout << ("end: " + formatNumber(dbgCurr)) << endl;
-		};
+		double min[3] = { Infinity, Infinity, Infinity };
+		double max[3] = { -Infinity, -Infinity, -Infinity };
 
-		TaskPool<Task> pool(numChunkerThreads, processor);
+		inline void expand(int element, double value) {
+			min[element] = std::min(min[element], value);
+			max[element] = std::max(max[element], value);
+		}
 
-		auto tStartTaskAssembly = now();
+		void apply() {
+			if (attribute == nullptr) {
+				return;
+			}
+
+			for (int i = 0; i < 3; i++) {
+				double* attributeMin = &attribute->min.x + i;
+				double* attributeMax = &attribute->max.x + i;
+				*attributeMin = std::min(*attributeMin, min[i]);
+				*attributeMax = std::max(*attributeMax, max[i]);
+			}
+		}
+	};
 
-		for (auto source : sources) {
-		//auto parallel = std::execution::par;
-		//for_each(parallel, paths.begin(), paths.end(), [&mtx, &sources](string path) {
+	// attributes that are copied from the source as they are, i.e. extra bytes and wave packet fields.
+	// <expand> is instantiated for the attribute type and computes min/max of up to 3 elements.
+	struct BlobAttribute {
+		int64_t sourceOffset = 0;
+		int64_t size = 0;
+		int numElements = 0;
+		AttributeRange range;
+		void (*expand)(uint8_t* source, int numElements, AttributeRange& range) = nullptr;
+	};
 
-			laszip_POINTER laszip_reader;
-			laszip_header* header;
-			//laszip_point* point;
-			{
-				laszip_create(&laszip_reader);
+	template<class T>
+	void expandRange(uint8_t* source, int numElements, AttributeRange& range) {
+		for (int i = 0; i < numElements; i++) {
+			T value;
+			memcpy(&value, source + i * sizeof(T), sizeof(T));
 
-				laszip_BOOL request_reader = 1;
-				laszip_BOOL is_compressed = iEndsWith(source.path, ".laz") ? 1 : 0;
+			range.expand(i, double(value));
+		}
+	}
 
-				laszip_request_compatibility_mode(laszip_reader, request_reader);
-				laszip_open_reader(laszip_reader, source.path.c_str(), &is_compressed);
-				laszip_get_header_pointer(laszip_reader, &header);
+	// unknown types are copied without min/max
+	void expandNothing(uint8_t* source, int numElements, AttributeRange& range) {}
+
+	auto getRangeExpander(AttributeType type) {
+		if (type == AttributeType::INT8) {
+			return expandRange<int8_t>;
+		} else if (type == AttributeType::INT16) {
+			return expandRange<int16_t>;
+		} else if (type == AttributeType::INT32) {
+			return expandRange<int32_t>;
+		} else if (type == AttributeType::INT64) {
+			return expandRange<int64_t>;
+		} else if (type == AttributeType::UINT8) {
+			return expandRange<uint8_t>;
+		} else if (type == AttributeType::UINT16) {
+			return expandRange<uint16_t>;
+		} else if (type == AttributeType::UINT32) {
+			return expandRange<uint32_t>;
+		} else if (type == AttributeType::UINT64) {
+			return expandRange<uint64_t>;
+		} else if (type == AttributeType::FLOAT) {
+			return expandRange<float>;
+		} else if (type == AttributeType::DOUBLE) {
+			return expandRange<double>;
+		} else {
+			return expandNothing;
+		}
+	}
+
+	// target offsets and ranges of all attributes of a batch, resolved once per batch.
+	// standard attributes that aren't part of both the input and the output have a target offset of -1.
+	struct LaszipTargets {
+		AttributeRange position;
+		AttributeRange intensity;
+		AttributeRange returnNumber;
+		AttributeRange numberOfReturns;
+		AttributeRange classification;
+		AttributeRange classificationFlags;
+		AttributeRange scanAngleRank;
+		AttributeRange scanAngle;
+		AttributeRange userData;
+		AttributeRange pointSourceId;
+		AttributeRange gpsTime;
+		AttributeRange rgb;
+		AttributeRange nir;
+
+		vector<BlobAttribute> wavePacket;
+		vector<BlobAttribute> extraBytes;
+
+		vector<int64_t> classificationHistogram = vector<int64_t>(256, 0);
+
+		void apply() {
+			for (auto* range : { &position, &intensity, &returnNumber, &numberOfReturns, &classification, &classificationFlags,
+				&scanAngleRank, &scanAngle, &userData, &pointSourceId, &gpsTime, &rgb, &nir }) {
+				range->apply();
 			}
-			
-			int64_t bpp = header->point_data_record_length;
-			int64_t numPoints = std::max(uint64_t(header->number_of_point_records), header->extended_number_of_point_records);
 
-			int64_t pointsLeft = numPoints;
-			int64_t batchSize = 1'000'000;
-			int64_t numRead = 0;
+			for (auto& blob : wavePacket) {
+				blob.range.apply();
+			}
 
-			while (pointsLeft > 0) {
+			for (auto& blob : extraBytes) {
+				blob.range.apply();
+			}
 
-				int64_t numToRead;
-				if (pointsLeft < batchSize) {
-					numToRead = pointsLeft;
-					pointsLeft = 0;
-				} else {
-					numToRead = batchSize;
-					pointsLeft = pointsLeft - batchSize;
+			if (classification.attribute != nullptr) {
+				auto& histogram = classification.attribute->histogram;
+				for (int64_t i = 0; i < int64_t(histogram.size()); i++) {
+					histogram[i] += classificationHistogram[i];
 				}
-				
-				int64_t firstByte = header->offset_to_point_data + numRead * bpp;
-				int64_t numBytes = numToRead * bpp;
-
-				auto task = make_shared<Task>();
-				task->path = source.path;
-				task->totalPoints = numPoints;
-				task->firstPoint = numRead;
-				task->firstByte = firstByte;
-				task->numBytes = numBytes;
-				task->numPoints = numToRead;
-				task->bpp = header->point_data_record_length; 
-				//task->scale = { header->x_scale_factor, header->y_scale_factor, header->z_scale_factor };
-				//task->offset = { header->x_offset, header->y_offset, header->z_offset };
-				task->min = min;
-				task->max = max;
-
-				pool.addTask(task);
-
-				numRead += batchSize;
-			}
-
-			laszip_close_reader(laszip_reader);
-			laszip_destroy(laszip_reader);
+			}
 		}
+	};
 
-		printElapsedTime("tStartTaskAssembly", tStartTaskAssembly);
+	LaszipTargets createLaszipTargets(int pointDataFormat, Attributes& inputAttributes, Attributes& outputAttributes) {
 
-		pool.waitTillEmpty();
-		pool.close();
+		LaszipTargets targets;
 
-		printElapsedTime("countPointsInCells", tStart);
+		auto resolve = [&inputAttributes, &outputAttributes](string name) {
+			AttributeRange range;
 
-		double duration = now() - tStart;
+			if (inputAttributes.get(name) != nullptr && outputAttributes.get(name) != nullptr) {
+				range.attribute = outputAttributes.get(name);
+				range.targetOffset = outputAttributes.getOffset(name);
+			}
 
-		cout << "finished counting in " << formatNumber(duration) << "s" << endl;
-		cout << "=======================================" << endl;
+			return range;
+		};
 
-		{
-			double duration = now() - tStart;
-			state.values["duration(chunking-count)"] = formatNumber(duration, 3);
+		targets.position = resolve("position");
+		targets.intensity = resolve("intensity");
+		targets.returnNumber = resolve("return number");
+		targets.numberOfReturns = resolve("number of returns");
+		targets.classification = resolve("classification");
+		targets.classificationFlags = resolve("classification flags");
+		targets.scanAngleRank = resolve("scan angle rank");
+		targets.scanAngle = resolve("scan angle");
+		targets.userData = resolve("user data");
+		targets.pointSourceId = resolve("point source id");
+		targets.gpsTime = resolve("gps-time");
+		targets.rgb = resolve("rgb");
+		targets.nir = resolve("nir");
+
+		{ // WAVE PACKETS
+			// wave packets are stored as a 29 byte blob in laszip_point, copy the individual fields
+			vector<std::pair<string, int>> fields = {
+				{"wave packet descriptor index", 0},
+				{"byte offset to waveform data", 1},
+				{"waveform packet size", 9},
+				{"return point waveform location", 13},
+				{"XYZ(t)", 17},
+			};
+
+			for (auto [name, sourceOffset] : fields) {
+				AttributeRange range = resolve(name);
+
+				if (range.attribute != nullptr) {
+					BlobAttribute blob;
+					blob.sourceOffset = sourceOffset;
+					blob.size = range.attribute->size;
+					blob.numElements = range.attribute->numElements;
+					blob.range = range;
+					blob.expand = getRangeExpander(range.attribute->type);
+
+					targets.wavePacket.push_back(blob);
+				}
+			}
+		}
+
+		{ // EXTRA ATTRIBUTES
+
+			int firstExtraIndex = lasFirstExtraAttributeIndex(pointDataFormat);
+
+			if (firstExtraIndex < 0) {
+				string msg = "ERROR: las format not supported: " + formatNumber(pointDataFormat) + "\n";
+				cout << msg;
+
+				exit(123);
+			}
+
+			// handle extra bytes individually to compute per-attribute information
+			int sourceOffset = 0;
+
+			int attributeOffset = 0;
+			for (int i = 0; i < firstExtraIndex; i++) {
+				attributeOffset += inputAttributes.list[i].size;
+			}
+
+			for (int i = firstExtraIndex; i < int(inputAttributes.list.size()); i++) {
+				Attribute& inputAttribute = inputAttributes.list[i];
+				Attribute* attribute = outputAttributes.get(inputAttribute.name);
+
+				if (attribute != nullptr) {
+					BlobAttribute blob;
+					blob.sourceOffset = sourceOffset;
+					blob.size = inputAttribute.size;
+					blob.numElements = std::min(attribute->numElements, 3);
+					blob.range.attribute = attribute;
+					blob.range.targetOffset = attributeOffset;
+					blob.expand = getRangeExpander(attribute->type);
+
+					targets.extraBytes.push_back(blob);
+
+					attributeOffset += attribute->size;
+				}
+
+				sourceOffset += inputAttribute.size;
+			}
 		}
 
+		return targets;
+	}
+
+	template<class T>
+	inline void writeValue(uint8_t* point, AttributeRange& range, T value) {
+		memcpy(point + range.targetOffset, &value, sizeof(T));
 
-		return std::move(grid);
+		range.expand(0, double(value));
 	}
 
-	void addBuckets(string targetDir, vector<shared_ptr<Buffer>>& newBuckets) {
+	// converts <numPoints> points from the laszip reader into the output layout.
+	// instantiated per point format, so that attributes the format doesn't have are compiled out
+	// and the remaining ones are handled with straight-line code instead of per-attribute callbacks.
+	template<int format>
+	void decodeLaszipPoints(LaszipReader& reader, int64_t numPoints, LaszipTargets& targets, Attributes& outputAttributes, uint8_t* data) {
+
+		constexpr bool isExtended = format >= 6;
+		constexpr bool hasGpsTime = format != 0 && format != 2;
+		constexpr bool hasRGB = format == 2 || format == 3 || format == 5 || format == 7 || format == 8 || format == 10;
+		constexpr bool hasNIR = format == 8 || format == 10;
+		constexpr bool hasWavePacket = format == 4 || format == 5 || format == 9 || format == 10;
+
+		auto scale = outputAttributes.posScale;
+		auto offset = outputAttributes.posOffset;
+		auto bpp = outputAttributes.bytes;
+
+		laszip_header* header = reader.header;
+		laszip_point* point = reader.point;
+
+		Vector3 lasScale = { header->x_scale_factor, header->y_scale_factor, header->z_scale_factor };
+		Vector3 lasOffset = { header->x_offset, header->y_offset, header->z_offset };
 
-		for(int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++){
+		for (int64_t i = 0; i < numPoints; i++) {
+			reader.read();
 
-			if (newBuckets[nodeIndex]->size == 0) {
-				continue;
+			uint8_t* target = data + i * bpp;
+
+			{ // POSITION
+				// same as laszip_get_coordinates()
+				double x = lasScale.x * point->X + lasOffset.x;
+				double y = lasScale.y * point->Y + lasOffset.y;
+				double z = lasScale.z * point->Z + lasOffset.z;
+
+				int32_t X = int32_t((x - offset.x) / scale.x);
+				int32_t Y = int32_t((y - offset.y) / scale.y);
+				int32_t Z = int32_t((z - offset.z) / scale.z);
+
+				memcpy(target + 0, &X, 4);
+				memcpy(target + 4, &Y, 4);
+				memcpy(target + 8, &Z, 4);
+
+				targets.position.expand(0, x);
+				targets.position.expand(1, y);
+				targets.position.expand(2, z);
+			}
+
+			if (targets.intensity.targetOffset >= 0) {
+				writeValue<uint16_t>(target, targets.intensity, point->intensity);
+			}
+
+			if (targets.returnNumber.targetOffset >= 0) {
+				writeValue<uint8_t>(target, targets.returnNumber, point->return_number);
+			}
+
+			if (targets.numberOfReturns.targetOffset >= 0) {
+				writeValue<uint8_t>(target, targets.numberOfReturns, point->number_of_returns);
 			}
 
-			auto& node = nodes[nodeIndex];
-			string path = targetDir + "/chunks/" + node.id + ".bin";
-			auto buffer = newBuckets[nodeIndex];
+			if (targets.classification.targetOffset >= 0) {
+				uint8_t value = point->extended_classification > 31 ? point->extended_classification : point->classification;
 
-			writer->write(path, buffer);
+				writeValue<uint8_t>(target, targets.classification, value);
+				targets.classificationHistogram[value]++;
+			}
+
+			if (targets.userData.targetOffset >= 0) {
+				writeValue<uint8_t>(target, targets.userData, point->user_data);
+			}
+
+			if (targets.pointSourceId.targetOffset >= 0) {
+				writeValue<uint16_t>(target, targets.pointSourceId, point->point_source_ID);
+			}
 
+			if constexpr (isExtended) {
+				if (targets.classificationFlags.targetOffset >= 0) {
+					writeValue<uint8_t>(target, targets.classificationFlags, point->extended_classification_flags);
+				}
+
+				if (targets.scanAngle.targetOffset >= 0) {
+					writeValue<int16_t>(target, targets.scanAngle, point->extended_scan_angle);
+				}
+			} else {
+				if (targets.scanAngleRank.targetOffset >= 0) {
+					writeValue<int8_t>(target, targets.scanAngleRank, point->scan_angle_rank);
+				}
+			}
+
+			if constexpr (hasGpsTime) {
+				if (targets.gpsTime.targetOffset >= 0) {
+					writeValue<double>(target, targets.gpsTime, point->gps_time);
+				}
+			}
+
+			if constexpr (hasRGB) {
+				if (targets.rgb.targetOffset >= 0) {
+					memcpy(target + targets.rgb.targetOffset, point->rgb, 6);
+
+					targets.rgb.expand(0, point->rgb[0]);
+					targets.rgb.expand(1, point->rgb[1]);
+					targets.rgb.expand(2, point->rgb[2]);
+				}
+			}
+
+			if constexpr (hasNIR) {
+				if (targets.nir.targetOffset >= 0) {
+					writeValue<uint16_t>(target, targets.nir, point->rgb[3]);
+				}
+			}
+
+			if constexpr (hasWavePacket) {
+				for (auto& blob : targets.wavePacket) {
+					uint8_t* source = point->wave_packet + blob.sourceOffset;
+					memcpy(target + blob.range.targetOffset, source, blob.size);
+					blob.expand(source, blob.numElements, blob.range);
+				}
+			}
+
+			for (auto& blob : targets.extraBytes) {
+				uint8_t* source = point->extra_bytes + blob.sourceOffset;
+				memcpy(target + blob.range.targetOffset, source, blob.size);
+				blob.expand(source, blob.numElements, blob.range);
+			}
+		}
+	}
+
+	void decodeLaszipPoints(LaszipReader& reader, int64_t numPoints, Attributes& inputAttributes, Attributes& outputAttributes, uint8_t* data) {
+
+		int format = reader.header->point_data_format;
+
+		LaszipTargets targets = createLaszipTargets(format, inputAttributes, outputAttributes);
+
+		if (format == 0) {
+			decodeLaszipPoints<0>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 1) {
+			decodeLaszipPoints<1>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 2) {
+			decodeLaszipPoints<2>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 3) {
+			decodeLaszipPoints<3>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 4) {
+			decodeLaszipPoints<4>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 5) {
+			decodeLaszipPoints<5>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 6) {
+			decodeLaszipPoints<6>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 7) {
+			decodeLaszipPoints<7>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 8) {
+			decodeLaszipPoints<8>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 9) {
+			decodeLaszipPoints<9>(reader, numPoints, targets, outputAttributes, data);
+		} else if (format == 10) {
+			decodeLaszipPoints<10>(reader, numPoints, targets, outputAttributes, data);
+		}
+
+		targets.apply();
+	}
+
+	// per-thread copy of outputAttributes to compute min/max in a thread-safe way
+	// merge it into the global instance with mergeAttributeStats() once a batch is done
+	Attributes createAttributeStats(Attributes& outputAttributes) {
+		Attributes stats = outputAttributes;
+
+		for(auto& attribute: stats.list){
+			if(attribute.name == "classification"){
+				for(int64_t i = 0; i < int64_t(attribute.histogram.size()); i++){
+					attribute.histogram[i] = 0;
+				}
+			}
+		}
+
+		return stats;
+	}
+
+	void mergeAttributeStats(Attributes& outputAttributes, Attributes& stats) {
+
+		lock_guard<mutex> lock(mtx_attributes);
+
+		for (int64_t i = 0; i < int64_t(stats.list.size()); i++) {
+			Attribute& source = stats.list[i];
+			Attribute& target = outputAttributes.list[i];
+
+			target.min.x = std::min(target.min.x, source.min.x);
+			target.min.y = std::min(target.min.y, source.min.y);
+			target.min.z = std::min(target.min.z, source.min.z);
+
+			target.max.x = std::max(target.max.x, source.max.x);
+			target.max.y = std::max(target.max.y, source.max.y);
+			target.max.z = std::max(target.max.z, source.max.z);
+
+			// target.mask = target.mask | source.mask;
+			
+			for(int64_t j = 0; j < int64_t(target.histogram.size()); j++){
+				target.histogram[j] = target.histogram[j] + source.histogram[j];
+			}
 		}
 	}
 
-	vector<function<void(int64_t)>> createAttributeHandlers(laszip_header* header, uint8_t* data, laszip_point* point, Attributes& inputAttributes, Attributes& outputAttributes) {
+	// readers stay open for the lifetime of the thread, so consecutive batches of the same file
+	// don't pay for reopening, reparsing the header and, in case of laz, seeking to the first point. 
+	LasReaderCache& getThreadLocalReaders() {
+		thread_local LasReaderCache readers;
+
+		return readers;
+	}
+
+	// decodes <numPoints> points, starting at <firstPoint>, and converts them into the output layout.
+	// min/max and histograms of the batch are accumulated in <stats>.
+	void decodeBatch(string path, shared_ptr<LasHeader> header, int64_t firstPoint, int64_t numPoints, Attributes& inputAttributes, Attributes& outputAttributes, Attributes& stats, uint8_t* data) {
+
+		auto bpp = outputAttributes.bytes;
 
-		vector<function<void(int64_t)>> handlers;
-		int attributeOffset = 0;
+		// memset necessary if attribute handlers don't set all values. 
+		// previous handlers from input with different point formats
+		// may have set the values before.
+		memset(data, 0, numPoints * bpp);
 
-		// reset min/max, we're writing the values to a per-thread copy anyway
-		for (auto& attribute : outputAttributes.list) {
-			attribute.min = { Infinity, Infinity, Infinity };
-			attribute.max = { -Infinity, -Infinity, -Infinity };
+		auto& readers = getThreadLocalReaders();
+
+		// uncompressed las files are decoded straight from a memory mapping
+		auto records = readers.getMappedRecords(path, header);
+		if (records != nullptr) {
+			auto range = records->range(firstPoint, numPoints);
+			decodeLasPoints(range, inputAttributes, stats, data);
+
+			return;
 		}
 
-		{ // STANDARD LAS ATTRIBUTES
+		auto reader = readers.getLaszipReader(path);
+		reader->seek(firstPoint);
+		
+		decodeLaszipPoints(*reader, numPoints, inputAttributes, stats, data);
+	}
+
+	// a range of points of a source, processed by one task in each pass
+	struct Batch {
+		int64_t sourceIndex = 0;
+		int64_t firstPoint = 0;
+		int64_t numPoints = 0;
+	};
 
-			int offsetRGB = outputAttributes.getOffset("rgb");
-			Attribute* attributeRGB = outputAttributes.get("rgb");
-			auto rgb = [data, point, header, offsetRGB, attributeRGB](int64_t offset) {
-				if (offsetRGB >= 0) {
+	// splits sources into batches of up to <maxBatchSize> points.
+	// laz batches start and end at chunk boundaries. seeking to a chunk's first point doesn't need to 
+	// decompress anything, and no chunk is decoded by two tasks. Small chunks are merged, none are split.
+	vector<Batch> createBatches(vector<Source>& sources, int64_t maxBatchSize) {
 
-					uint16_t rgb[] = { 0, 0, 0 };
-					memcpy(rgb, &point->rgb, 6);
-					memcpy(data + offset + offsetRGB, rgb, 6);
-					
-					attributeRGB->min.x = std::min(attributeRGB->min.x, double(rgb[0]));
-					attributeRGB->min.y = std::min(attributeRGB->min.y, double(rgb[1]));
-					attributeRGB->min.z = std::min(attributeRGB->min.z, double(rgb[2]));
+		vector<Batch> batches;
+
+		for (int64_t sourceIndex = 0; sourceIndex < int64_t(sources.size()); sourceIndex++) {
+			auto& source = sources[sourceIndex];
+
+			int64_t numPoints = source.numPoints;
+
+			// chunk tables are read by the SourceCatalog
+			vector<int64_t> chunkSizes = source.chunkSizes;
+
+			int64_t numChunked = 0;
+			for (auto chunkSize : chunkSizes) {
+				numChunked += chunkSize;
+			}
 
-					attributeRGB->max.x = std::max(attributeRGB->max.x, double(rgb[0]));
-					attributeRGB->max.y = std::max(attributeRGB->max.y, double(rgb[1]));
-					attributeRGB->max.z = std::max(attributeRGB->max.z, double(rgb[2]));
+			if (chunkSizes.size() == 0 || numChunked != numPoints) {
+				// not chunked, or the chunk table is unusable. fall back to fixed-size batches
+				chunkSizes.clear();
+				for (int64_t first = 0; first < numPoints; first += maxBatchSize) {
+					chunkSizes.push_back(std::min(maxBatchSize, numPoints - first));
 				}
-			};
+			}
 
-			int offsetIntensity = outputAttributes.getOffset("intensity");
-			Attribute* attributeIntensity = outputAttributes.get("intensity");
-			auto intensity = [data, point, header, offsetIntensity, attributeIntensity](int64_t offset) {
-				memcpy(data + offset + offsetIntensity, &point->intensity, 2);
+			Batch batch;
+			batch.sourceIndex = sourceIndex;
 
-				attributeIntensity->min.x = std::min(attributeIntensity->min.x, double(point->intensity));
-				attributeIntensity->max.x = std::max(attributeIntensity->max.x, double(point->intensity));
-			};
+			for (auto chunkSize : chunkSizes) {
+				if (batch.numPoints > 0 && batch.numPoints + chunkSize > maxBatchSize) {
+					batches.push_back(batch);
 
-			int offsetReturnNumber = outputAttributes.getOffset("return number");
-			Attribute* attributeReturnNumber = outputAttributes.get("return number");
-			auto returnNumber = [data, point, header, offsetReturnNumber, attributeReturnNumber](int64_t offset) {
-				uint8_t value = point->return_number;
+					batch.firstPoint = batch.firstPoint + batch.numPoints;
+					batch.numPoints = 0;
+				}
 
-				memcpy(data + offset + offsetReturnNumber, &value, 1);
+				batch.numPoints += chunkSize;
+			}
 
-				attributeReturnNumber->min.x = std::min(attributeReturnNumber->min.x, double(value));
-				attributeReturnNumber->max.x = std::max(attributeReturnNumber->max.x, double(value));
-			};
+			if (batch.numPoints > 0) {
+				batches.push_back(batch);
+			}
+		}
 
-			int offsetNumberOfReturns = outputAttributes.getOffset("number of returns");
-			Attribute* attributeNumberOfReturns = outputAttributes.get("number of returns");
-			auto numberOfReturns = [data, point, header, offsetNumberOfReturns, attributeNumberOfReturns](int64_t offset) {
-				uint8_t value = point->number_of_returns;
+		return batches;
+	}
 
-				memcpy(data + offset + offsetNumberOfReturns, &value, 1);
+	// if spillPaths contains a path for a source, its points are decoded and converted to the output layout
+	// once during counting and spilled to that file, so that distributePoints() can read them back as they are.
+	// returns the occupied cells of the counting grid, sorted by cell
+	vector<CellCount> countPointsInCells(vector<Source> sources, vector<Attributes>& inputAttributes, vector<Batch>& batches, vector<string>& spillPaths, Vector3 min, Vector3 max, int64_t gridSize, State& state, Attributes& outputAttributes, Monitor* monitor) {
 
-				attributeNumberOfReturns->min.x = std::min(attributeNumberOfReturns->min.x, double(value));
-				attributeNumberOfReturns->max.x = std::max(attributeNumberOfReturns->max.x, double(value));
-			};
+		cout << endl;
+		cout << "=======================================" << endl;
+		cout << "=== COUNTING                           " << endl;
+		cout << "=======================================" << endl;
 
-			int offsetScanAngleRank = outputAttributes.getOffset("scan angle rank");
-			Attribute* attributeScanAngleRank = outputAttributes.get("scan angle rank");
-			auto scanAngleRank = [data, point, header, offsetScanAngleRank, attributeScanAngleRank](int64_t offset) {
-				memcpy(data + offset + offsetScanAngleRank, &point->scan_angle_rank, 1);
+		auto tStart = now();
 
-				attributeScanAngleRank->min.x = std::min(attributeScanAngleRank->min.x, double(point->scan_angle_rank));
-				attributeScanAngleRank->max.x = std::max(attributeScanAngleRank->max.x, double(point->scan_angle_rank));
-			};
+		//Vector3 size = max - min;
 
-			int offsetScanAngle= outputAttributes.getOffset("scan angle");
-			Attribute* attributeScanAngle = outputAttributes.get("scan angle");
-			auto scanAngle = [data, point, header, offsetScanAngle, attributeScanAngle](int64_t offset) {
-				memcpy(data + offset + offsetScanAngle, &point->extended_scan_angle, 2);
+		// one histogram per counting thread
+		mutex mtx_histograms;
+		unordered_map<std::thread::id, unique_ptr<CellHistogram>> histograms;
 
-				attributeScanAngle->min.x = std::min(attributeScanAngle->min.x, double(point->extended_scan_angle));
-				attributeScanAngle->max.x = std::max(attributeScanAngle->max.x, double(point->extended_scan_angle));
-			};
+		struct Task{
+			string path;
+			shared_ptr<LasHeader> header;
+			int64_t totalPoints = 0;
+			int64_t firstPoint;
+			int64_t numBytes;
+			int64_t numPoints;
+			int64_t bpp;
+			Vector3 scale;
+			Vector3 offset;
+			Vector3 min;
+			Vector3 max;
+			Attributes inputAttributes;
+			string spillPath;
+		};
 
-			int offsetUserData = outputAttributes.getOffset("user data");
-			Attribute* attributeUserData = outputAttributes.get("user data");
-			auto userData = [data, point, header, offsetUserData, attributeUserData](int64_t offset) {
-				memcpy(data + offset + offsetUserData, &point->user_data, 1);
+		auto processor = [gridSize, &mtx_histograms, &histograms, tStart, &state, &outputAttributes, monitor](shared_ptr<Task> task){
+			string path = task->path;
+			int64_t numBytes = task->numBytes;
+			int64_t numToRead = task->numPoints;
+			int64_t bpp = task->bpp;
+			//Vector3 scale = task->scale;
+			//Vector3 offset = task->offset;
+			Vector3 min = task->min;
+			Vector3 max = task->max;
 
-				attributeUserData->min.x = std::min(attributeUserData->min.x, double(point->user_data));
-				attributeUserData->max.x = std::max(attributeUserData->max.x, double(point->user_data));
-			};
+			stringstream ss;
+			ss << "counting " << fs::path(task->path).filename().string() 
+				<< ", first point: " << formatNumber(task->firstPoint)
+				<< ", num points: " << formatNumber(task->numPoints);
+			// cout << ss.str();
+			// monitor->print("counter message", ss.str());
+
+			logger::INFO(ss.str());
+
+			// decoded points and their cell indices
+			int64_t workingSet = numBytes + numToRead * int64_t(sizeof(int64_t));
+			memoryGovernor.reserve(workingSet);
+			
+			
 
-			int offsetClassification = outputAttributes.getOffset("classification");
-			Attribute* attributeClassification = outputAttributes.get("classification");
-			auto classification = [data, point, header, offsetClassification, attributeClassification](int64_t offset) {
-				
-				uint8_t value = 0;
-				if (point->extended_classification > 31){
-					value = point->extended_classification;
-				}else{
-					value = point->classification;
+			thread_local unique_ptr<void, void(*)(void*)> buffer(nullptr, free);
+			thread_local int64_t bufferSize = -1;
+
+			{ // sanity checks
+				if(numBytes < 0){
+					logger::ERROR("invalid malloc size: " + formatNumber(numBytes));
 				}
+			}
+
+			if (bufferSize < numBytes){
+				buffer.reset(malloc(numBytes));
+				bufferSize = numBytes;
+			}
+
+			double cubeSize = (max - min).max();
+			Vector3 size = { cubeSize, cubeSize, cubeSize };
+			max = min + cubeSize;
 
-				data[offset + offsetClassification] = value;
-				attributeClassification->histogram[value]++;
+			auto posScale = outputAttributes.posScale;
+			auto posOffset = outputAttributes.posOffset;
 
-				attributeClassification->min.x = std::min(attributeClassification->min.x, double(value));
-				attributeClassification->max.x = std::max(attributeClassification->max.x, double(value));
-			};
+			grid_kernels::CellGrid cellGrid;
+			cellGrid.scale = posScale;
+			cellGrid.offset = posOffset;
+			cellGrid.min = min;
+			cellGrid.size = size;
+			cellGrid.gridSize = gridSize;
+
+			// coordinates in the output scale/offset, either in the converted points or in a separate xyz buffer
+			thread_local vector<int32_t> rawXYZ;
+			thread_local vector<int32_t> quantizedXYZ;
+			thread_local vector<int64_t> indices;
+			uint8_t* xyz = nullptr;
+			int64_t xyzStride = 0;
+
+			indices.resize(numToRead);
+
+			if (task->spillPath.size() > 0) {
+				// decode-once: convert to the output layout, count, and spill the converted points
+				uint8_t* data = reinterpret_cast<uint8_t*>(buffer.get());
+				Attributes stats = createAttributeStats(outputAttributes);
+
+				decodeBatch(path, task->header, task->firstPoint, numToRead, task->inputAttributes, outputAttributes, stats, data);
+
+				mergeAttributeStats(outputAttributes, stats);
+
+				xyz = data;
+				xyzStride = bpp;
+			} else if (auto records = getThreadLocalReaders().getMappedRecords(path, task->header)) {
+				// uncompressed las, read coordinates straight from the mapped records
+				uint8_t* record = records->range(task->firstPoint, numToRead).data;
+
+				quantizedXYZ.resize(3 * numToRead);
+				grid_kernels::quantize(record, records->recordLength, numToRead, 
+					records->header.scale, records->header.offset, posScale, posOffset, quantizedXYZ.data());
+
+				xyz = reinterpret_cast<uint8_t*>(quantizedXYZ.data());
+				xyzStride = 12;
+			} else {
+				auto reader = getThreadLocalReaders().getLaszipReader(path);
+				reader->seek(task->firstPoint);
+
+				laszip_header* header = reader->header;
+				laszip_point* point = reader->point;
+
+				rawXYZ.resize(3 * numToRead);
+				for (int64_t i = 0; i < numToRead; i++) {
+					reader->read();
+
+					rawXYZ[3 * i + 0] = point->X;
+					rawXYZ[3 * i + 1] = point->Y;
+					rawXYZ[3 * i + 2] = point->Z;
+				}
 
-			int offsetSourceId = outputAttributes.getOffset("point source id");
-			Attribute* attributePointSourceId = outputAttributes.get("point source id");
-			auto pointSourceId = [data, point, header, offsetSourceId, attributePointSourceId](int64_t offset) {
-				memcpy(data + offset + offsetSourceId, &point->point_source_ID, 2);
+				// transfer las integer coordinates to new scale/offset/box values
+				Vector3 lasScale = { header->x_scale_factor, header->y_scale_factor, header->z_scale_factor };
+				Vector3 lasOffset = { header->x_offset, header->y_offset, header->z_offset };
 
-				attributePointSourceId->min.x = std::min(attributePointSourceId->min.x, double(point->point_source_ID));
-				attributePointSourceId->max.x = std::max(attributePointSourceId->max.x, double(point->point_source_ID));
-			};
+				quantizedXYZ.resize(3 * numToRead);
+				grid_kernels::quantize(reinterpret_cast<uint8_t*>(rawXYZ.data()), 12, numToRead, 
+					lasScale, lasOffset, posScale, posOffset, quantizedXYZ.data());
 
-			int offsetGpsTime= outputAttributes.getOffset("gps-time");
-			Attribute* attributeGpsTime = outputAttributes.get("gps-time");
-			auto gpsTime = [data, point, header, offsetGpsTime, attributeGpsTime](int64_t offset) {
-				memcpy(data + offset + offsetGpsTime, &point->gps_time, 8);
+				xyz = reinterpret_cast<uint8_t*>(quantizedXYZ.data());
+				xyzStride = 12;
+			}
 
-				attributeGpsTime->min.x = std::min(attributeGpsTime->min.x, point->gps_time);
-				attributeGpsTime->max.x = std::max(attributeGpsTime->max.x, point->gps_time);
-			};
+			grid_kernels::computeCellIndices(xyz, xyzStride, numToRead, cellGrid, indices.data());
 
-			int offsetClassificationFlags = outputAttributes.getOffset("classification flags");
-			Attribute* attributeClassificationFlags = outputAttributes.get("classification flags");
-			auto classificationFlags = [data, point, header, offsetClassificationFlags, attributeClassificationFlags](int64_t offset) {
-				uint8_t value = point->extended_classification_flags;
+			CellHistogram* histogram = nullptr;
+			{
+				lock_guard<mutex> lock(mtx_histograms);
 
-				memcpy(data + offset + offsetClassificationFlags, &value, 1);
+				auto& entry = histograms[std::this_thread::get_id()];
+				if (!entry) {
+					entry = make_unique<CellHistogram>();
+				}
+				histogram = entry.get();
+			}
 
-				attributeClassificationFlags->min.x = std::min(attributeClassificationFlags->min.x, double(point->extended_classification_flags));
-				attributeClassificationFlags->max.x = std::max(attributeClassificationFlags->max.x, double(point->extended_classification_flags));
-			};
+			for (int64_t i = 0; i < numToRead; i++) {
+				int64_t index = indices[i];
 
-			unordered_map<string, function<void(int64_t)>> mapping = {
-				{"rgb", rgb},
-				{"intensity", intensity},
-				{"return number", returnNumber},
-				{"number of returns", numberOfReturns},
-				{"classification", classification},
-				{"scan angle rank", scanAngleRank},
-				{"scan angle", scanAngle},
-				{"user data", userData},
-				{"point source id", pointSourceId},
-				{"gps-time", gpsTime},
-				{"classification flags", classificationFlags},
-			};
+				if (index < 0) {
+					int32_t XYZ[3];
+					memcpy(XYZ, xyz + i * xyzStride, 12);
 
-			for (auto& attribute : inputAttributes.list) {
+					double x = double(XYZ[0]) * posScale.x + posOffset.x;
+					double y = double(XYZ[1]) * posScale.y + posOffset.y;
+					double z = double(XYZ[2]) * posScale.z + posOffset.z;
 
-				attributeOffset += attribute.size;
+					stringstream ss;
+					ss << "encountered point outside bounding box." << endl;
+					ss << "box.min: " << min.toString() << endl;
+					ss << "box.max: " << max.toString() << endl;
+					ss << "point: " << Vector3(x, y, z).toString() << endl;
+					ss << "file: " << path << endl;
+					ss << "PotreeConverter requires a valid bounding box to operate." << endl;
+					ss << "Please try to repair the bounding box, e.g. using lasinfo with the -repair_bb argument." << endl;
+					logger::ERROR(ss.str());
 
-				if (attribute.name == "position") {
-					continue;
+					exit(123);
 				}
 
-				bool standardMappingExists = mapping.find(attribute.name) != mapping.end();
-				bool isIncludedInOutput = outputAttributes.get(attribute.name) != nullptr;
-				if (standardMappingExists && isIncludedInOutput) {
-					handlers.push_back(mapping[attribute.name]);
-				}
+				histogram->add(index);
 			}
-		}
-
-		{ // EXTRA ATTRIBUTES
-
-			// mapping from las format to index of first extra attribute
-			// +1 for all formats with returns, which is split into return number and number of returns
-			unordered_map<int, int> formatToExtraIndex = {
-				{0, 8},
-				{1, 9},
-				{2, 9},
-				{3, 10},
-				{4, 14},
-				{5, 15},
-				{6, 10},
-				{7, 11},
-			};
-
-			bool noMapping = formatToExtraIndex.find(header->point_data_format) == formatToExtraIndex.end();
-			if (noMapping) {
-				string msg = "ERROR: las format not supported: " + formatNumber(header->point_data_format) + "\n";
-				cout << msg;
 
-				exit(123);
+			if (task->spillPath.size() > 0) {
+				fstream file(task->spillPath, ios::in | ios::out | ios::binary);
+				file.seekp(task->firstPoint * bpp);
+				file.write(reinterpret_cast<char*>(xyz), numBytes);
 			}
 
-			// handle extra bytes individually to compute per-attribute information
-			int firstExtraIndex = formatToExtraIndex[header->point_data_format];
-			int sourceOffset = 0;
+			static int64_t pointsProcessed = 0;
+			pointsProcessed += task->numPoints;
 
-			int attributeOffset = 0;
-			for (int i = 0; i < firstExtraIndex; i++) {
-				attributeOffset += inputAttributes.list[i].size;
-			}
+			state.name = "COUNTING";
+			state.pointsProcessed = pointsProcessed;
+			state.duration = now() - tStart;
 
-			for (int i = firstExtraIndex; i < inputAttributes.list.size(); i++) {
-				Attribute& inputAttribute = inputAttributes.list[i];
-				Attribute* attribute = outputAttributes.get(inputAttribute.name);
-				int targetOffset = outputAttributes.getOffset(inputAttribute.name);
+			memoryGovernor.release(workingSet);
 
-				int attributeSize = inputAttribute.size;
+			//cout << ("end: " + formatNumber(dbgCurr)) << endl;
+		};
 
-				if (attribute != nullptr) {
-					auto handleAttribute = [data, point, header, attributeSize, attributeOffset, sourceOffset, attribute](int64_t offset) {
-						memcpy(data + offset + attributeOffset, point->extra_bytes + sourceOffset, attributeSize);
-
-						std::function<double(uint8_t*)> f;
-
-						// TODO: shouldn't use DOUBLE as a unifying type
-						// it won't work with uint64_t and int64_t
-						if (attribute->type == AttributeType::INT8) {
-							f = asDouble<int8_t>;
-						} else if (attribute->type == AttributeType::INT16) {
-							f = asDouble<int16_t>;
-						} else if (attribute->type == AttributeType::INT32) {
-							f = asDouble<int32_t>;
-						} else if (attribute->type == AttributeType::INT64) {
-							f = asDouble<int64_t>;
-						} else if (attribute->type == AttributeType::UINT8) {
-							f = asDouble<uint8_t>;
-						} else if (attribute->type == AttributeType::UINT16) {
-							f = asDouble<uint16_t>;
-						} else if (attribute->type == AttributeType::UINT32) {
-							f = asDouble<uint32_t>;
-						} else if (attribute->type == AttributeType::UINT64) {
-							f = asDouble<uint64_t>;
-						} else if (attribute->type == AttributeType::FLOAT) {
-							f = asDouble<float>;
-						} else if (attribute->type == AttributeType::DOUBLE) {
-							f = asDouble<double>;
-						}
+		TaskPool<Task> pool(numChunkerThreads, processor);
 
-						if (attribute->numElements == 1) {
-							double x = f(point->extra_bytes + sourceOffset);
-
-							attribute->min.x = std::min(attribute->min.x, x);
-							attribute->max.x = std::max(attribute->max.x, x);
-						} else if (attribute->numElements == 2) {
-							double x = f(point->extra_bytes + sourceOffset + 0 * attribute->elementSize);
-							double y = f(point->extra_bytes + sourceOffset + 1 * attribute->elementSize);
-
-							attribute->min.x = std::min(attribute->min.x, x);
-							attribute->min.y = std::min(attribute->min.y, y);
-							attribute->max.x = std::max(attribute->max.x, x);
-							attribute->max.y = std::max(attribute->max.y, y);
-
-						} else if (attribute->numElements == 3) {
-							double x = f(point->extra_bytes + sourceOffset + 0 * attribute->elementSize);
-							double y = f(point->extra_bytes + sourceOffset + 1 * attribute->elementSize);
-							double z = f(point->extra_bytes + sourceOffset + 2 * attribute->elementSize);
-
-							attribute->min.x = std::min(attribute->min.x, x);
-							attribute->min.y = std::min(attribute->min.y, y);
-							attribute->min.z = std::min(attribute->min.z, z);
-							attribute->max.x = std::max(attribute->max.x, x);
-							attribute->max.y = std::max(attribute->max.y, y);
-							attribute->max.z = std::max(attribute->max.z, z);
-						}
+		auto tStartTaskAssembly = now();
 
+		for (auto& batch : batches) {
+			auto& source = sources[batch.sourceIndex];
+			string spillPath = spillPaths[batch.sourceIndex];
+
+			// spilled batches are converted to the output layout in a per-thread buffer
+			int64_t bpp = spillPath.size() > 0 ? outputAttributes.bytes : source.bytesPerPoint;
+
+			auto task = make_shared<Task>();
+			task->path = source.path;
+			task->header = source.header;
+			task->totalPoints = source.numPoints;
+			task->firstPoint = batch.firstPoint;
+			task->numBytes = batch.numPoints * bpp;
+			task->numPoints = batch.numPoints;
+			task->bpp = bpp;
+			task->min = min;
+			task->max = max;
+			task->inputAttributes = inputAttributes[batch.sourceIndex];
+			task->spillPath = spillPath;
+
+			pool.addTask(task);
+		}
 
-					};
+		printElapsedTime("tStartTaskAssembly", tStartTaskAssembly);
 
-					handlers.push_back(handleAttribute);
-					attributeOffset += attribute->size;
-				}
+		pool.waitTillEmpty();
+		pool.close();
 
-				sourceOffset += inputAttribute.size;
+		// MERGE HISTOGRAMS
+		vector<CellCount> grid;
+		{
+			vector<CellHistogram*> threadHistograms;
+			for (auto& [id, histogram] : histograms) {
+				threadHistograms.push_back(histogram.get());
 			}
 
+			grid = mergeHistograms(threadHistograms);
+
+			histograms.clear();
 		}
 
+		printElapsedTime("countPointsInCells", tStart);
+
+		double duration = now() - tStart;
+
+		cout << "finished counting in " << formatNumber(duration) << "s" << endl;
+		cout << "=======================================" << endl;
+
+		{
+			double duration = now() - tStart;
+			state.values["duration(chunking-count)"] = formatNumber(duration, 3);
+		}
 
-		return handlers;
 
+		return grid;
 	}
 
-	void distributePoints(vector<Source> sources, Vector3 min, Vector3 max, string targetDir, NodeLUT& lut, State& state, Attributes& outputAttributes, Monitor* monitor) {
+	void distributePoints(vector<Source> sources, vector<Attributes>& inputAttributes, vector<Batch>& batches, vector<string>& spillPaths, Vector3 min, Vector3 max, string targetDir, NodeLUT& lut, State& state, Attributes& outputAttributes, Monitor* monitor) {
 
 		cout << endl;
 		cout << "=======================================" << endl;
@@ -674,11 +1146,54 @@ namespace chunker_countsort_laszip {
 
 		printElapsedTime("distributePoints0", tStart);
 
-		vector<std::atomic_int32_t> counters(nodes.size());
+		// chunks stay in memory as long as they fit into the budget. The others are spilled to the chunk file.
+		{
+			int64_t numResident = 0;
+
+			for (auto& node : nodes) {
+				int64_t bytes = node.numPoints * outputAttributes.bytes;
+
+				// the claim is released by the indexer, once it's done with the chunk
+				if (memoryGovernor.tryClaim(bytes, maxResidentBytes)) {
+					node.points = make_shared<Buffer>(bytes);
+
+					numResident++;
+				}
+			}
+
+			state.values["resident chunks"] = formatNumber(numResident) + " of " + formatNumber(nodes.size());
+		}
+
+		// sizes of all chunks are known from counting, so each spilled chunk gets a fixed extent in a single, preallocated file.
+		// The size of compressed chunks is not known in advance, their blocks are appended to the file.
+		string chunkFilePath = targetDir + "/chunks/" + chunkFileName;
+		vector<atomic_int64_t> chunkCursors(nodes.size());
+		if (!compressChunks) {
+			int64_t byteOffset = 0;
+			for (int64_t i = 0; i < int64_t(nodes.size()); i++) {
+				if (nodes[i].points) {
+					continue;
+				}
+
+				nodes[i].byteOffset = byteOffset;
+				chunkCursors[i] = byteOffset;
+
+				byteOffset += nodes[i].numPoints * outputAttributes.bytes;
+			}
+
+			if (byteOffset > 0) {
+				writer->preallocate(chunkFilePath, byteOffset);
+			}
+		}
+
+		// each distributing thread combines writes in its own partition buffers
+		mutex mtx_partitions;
+		unordered_map<std::thread::id, unique_ptr<PartitionBuffers>> partitions;
+		int64_t maxBufferedBytes = std::max(std::min(int64_t(512 * 1024 * 1024), memoryGovernor.budget / 8) / int64_t(numChunkerThreads), int64_t(16 * 1024 * 1024));
 
 		struct Task {
 			string path;
-			int64_t maxBatchSize;
+			shared_ptr<LasHeader> header;
 			int64_t batchSize;
 			int64_t firstPoint;
 			NodeLUT* lut;
@@ -687,13 +1202,12 @@ namespace chunker_countsort_laszip {
 			Vector3 min;
 			Vector3 max;
 			Attributes inputAttributes;
+			string spillPath;
 		};
 
-		mutex mtx_push_point;
-
 		printElapsedTime("distributePoints1", tStart);
 
-		auto processor = [&mtx_push_point, &counters, targetDir, &state, tStart, &outputAttributes](shared_ptr<Task> task) {
+		auto processor = [&mtx_partitions, &partitions, chunkFilePath, &chunkCursors, maxBufferedBytes, &state, tStart, &outputAttributes](shared_ptr<Task> task) {
 
 			auto path = task->path;
 			auto batchSize = task->batchSize;
@@ -707,8 +1221,6 @@ namespace chunker_countsort_laszip {
 			Attributes inputAttributes = task->inputAttributes;
 
 			auto gridSize = lut->gridSize;
-			auto& grid = lut->grid;
-
 
 			thread_local unique_ptr<void, void(*)(void*)> buffer(nullptr, free);
 			thread_local int64_t bufferSize = -1;
@@ -726,123 +1238,53 @@ namespace chunker_countsort_laszip {
 			}
 
 			uint8_t* data = reinterpret_cast<uint8_t*>(buffer.get());
-			// memset necessary if attribute handlers don't set all values. 
-			// previous handlers from input with different point formats
-			// may have set the values before.
-			memset(data, 0, bufferSize); 
-
-			writer->waitUntilMemoryBelow(2'000);
-
-			int pointFormat = -1;
-			// per-thread copy of outputAttributes to compute min/max in a thread-safe way
-			// will be merged to global outputAttributes instance at the end of this function
-			Attributes outputAttributesCopy = outputAttributes;
-			
-			for(auto& attribute: outputAttributesCopy.list){
-				if(attribute.name == "classification"){
-					for(int i = 0; i < attribute.histogram.size(); i++){
-						attribute.histogram[i] = 0;
-					}
-				}
-			}
-
-			{
-				laszip_POINTER laszip_reader;
-				laszip_header* header;
-				laszip_point* point;
-
-				laszip_BOOL request_reader = 1;
-				laszip_BOOL is_compressed = iEndsWith(path, ".laz") ? 1 : 0;
-
-				laszip_create(&laszip_reader);
-				laszip_request_compatibility_mode(laszip_reader, request_reader);
-				laszip_open_reader(laszip_reader, path.c_str(), &is_compressed);
-				laszip_get_header_pointer(laszip_reader, &header);
-				laszip_get_point_pointer(laszip_reader, &point);
-
-				laszip_seek_point(laszip_reader, task->firstPoint);
-				
-				auto attributeHandlers = createAttributeHandlers(header, data, point, inputAttributes, outputAttributesCopy);
-
-				double coordinates[3];
-				auto aPosition = outputAttributesCopy.get("position");
-
-				for (int64_t i = 0; i < batchSize; i++) {
-					laszip_read_point(laszip_reader);
-					laszip_get_coordinates(laszip_reader, coordinates);
-
-					int64_t offset = i * outputAttributes.bytes;
 
-					{ // copy position
-						double x = coordinates[0];
-						double y = coordinates[1];
-						double z = coordinates[2];
+			// decoded points and their cell or node indices
+			int64_t workingSet = numBytes + batchSize * int64_t(sizeof(int64_t));
+			memoryGovernor.reserve(workingSet);
 
-						int32_t X = int32_t((x - outputAttributes.posOffset.x) / scale.x);
-						int32_t Y = int32_t((y - outputAttributes.posOffset.y) / scale.y);
-						int32_t Z = int32_t((z - outputAttributes.posOffset.z) / scale.z);
+			// spilled batches were already decoded and accounted for during counting
+			bool isSpilled = task->spillPath.size() > 0;
+			Attributes outputAttributesCopy;
 
-						memcpy(data + offset + 0, &X, 4);
-						memcpy(data + offset + 4, &Y, 4);
-						memcpy(data + offset + 8, &Z, 4);
+			if(isSpilled){
+				readBinaryFile(task->spillPath, task->firstPoint * bpp, numBytes, data);
+			}else{
+				outputAttributesCopy = createAttributeStats(outputAttributes);
 
-						aPosition->min.x = std::min(aPosition->min.x, x);
-						aPosition->min.y = std::min(aPosition->min.y, y);
-						aPosition->min.z = std::min(aPosition->min.z, z);
-
-						aPosition->max.x = std::max(aPosition->max.x, x);
-						aPosition->max.y = std::max(aPosition->max.y, y);
-						aPosition->max.z = std::max(aPosition->max.z, z);
-					}
-
-					// copy other attributes
-					for (auto& handler : attributeHandlers) {
-						handler(offset);
-					}
-
-				}
-
-				pointFormat = header->point_data_format;
-
-				laszip_close_reader(laszip_reader);
-				laszip_destroy(laszip_reader);
+				decodeBatch(path, task->header, task->firstPoint, batchSize, inputAttributes, outputAttributes, outputAttributesCopy, data);
 			}
 
 			double cubeSize = (max - min).max();
 			Vector3 size = { cubeSize, cubeSize, cubeSize };
 			max = min + cubeSize;
 
-			double dGridSize = double(gridSize);
+			grid_kernels::CellGrid cellGrid;
+			cellGrid.scale = scale;
+			cellGrid.offset = outputAttributes.posOffset;
+			cellGrid.min = min;
+			cellGrid.size = size;
+			cellGrid.gridSize = gridSize;
 
-			auto toIndex = [data, &outputAttributes, scale, gridSize, dGridSize, size, min](int64_t pointOffset) {
-				int32_t* xyz = reinterpret_cast<int32_t*>(&data[0] + pointOffset);
+			thread_local vector<int64_t> indices;
+			indices.resize(batchSize);
 
-				int32_t X = xyz[0];
-				int32_t Y = xyz[1];
-				int32_t Z = xyz[2];
-
-				double ux = (double(X) * scale.x + outputAttributes.posOffset.x - min.x) / size.x;
-				double uy = (double(Y) * scale.y + outputAttributes.posOffset.y - min.y) / size.y;
-				double uz = (double(Z) * scale.z + outputAttributes.posOffset.z - min.z) / size.z;
-
-				int64_t ix = int64_t(std::min(dGridSize * ux, dGridSize - 1.0));
-				int64_t iy = int64_t(std::min(dGridSize * uy, dGridSize - 1.0));
-				int64_t iz = int64_t(std::min(dGridSize * uz, dGridSize - 1.0));
-
-				int64_t index = ix + iy * gridSize + iz * gridSize * gridSize;
-
-				return index;
-			};
+			grid_kernels::computeCellIndices(data, bpp, batchSize, cellGrid, indices.data());
 			
-			// COUNT POINTS PER BUCKET
-			vector<int64_t> counts(nodes.size(), 0);
+			// FIND NODES
+			int64_t previousCell = -1;
+			int64_t previousNode = -1;
 			for (int64_t i = 0; i < batchSize; i++) {
-				auto index = toIndex(i * bpp);
+				auto index = indices[i];
 
-				auto nodeIndex = grid[index];
+				// consecutive points are often in the same cell, only search the lut if the cell changes
+				if (index != previousCell) {
+					previousCell = index;
+					previousNode = index < 0 ? -1 : lut->find(index);
+				}
 
 				// ERROR
-				if (nodeIndex == -1) {
+				if (previousNode == -1) {
 
 					int32_t* xyz = reinterpret_cast<int32_t*>(&data[0] + i * bpp);
 
@@ -850,21 +1292,10 @@ namespace chunker_countsort_laszip {
 					auto y = xyz[1];
 					auto z = xyz[2];
 
-					double ux = (xyz[0] * scale.x + outputAttributes.posOffset.x) / size.x;
-					double uy = (xyz[1] * scale.y + outputAttributes.posOffset.y) / size.y;
-					double uz = (xyz[2] * scale.z + outputAttributes.posOffset.z) / size.z;
-
-					int64_t ix = int64_t(std::min(dGridSize * ux, dGridSize - 1.0));
-					int64_t iy = int64_t(std::min(dGridSize * uy, dGridSize - 1.0));
-					int64_t iz = int64_t(std::min(dGridSize * uz, dGridSize - 1.0));
-
-					int64_t index = ix + iy * gridSize + iz * gridSize * gridSize;
-
 					stringstream ss;
 					ss << "point to node lookup failed, no node found." << endl;
 					ss << "point: " << formatNumber(x, 3) << ", " << formatNumber(y, 3) << ", " << formatNumber(z, 3) << endl;
-					ss << "3d grid index: " << ix << ", " << iy << ", " << iz << endl;
-					ss << "1d grid index: " << index << endl;
+					ss << "morton grid index: " << index << endl;
 
 
 					logger::ERROR(ss.str());
@@ -872,127 +1303,83 @@ namespace chunker_countsort_laszip {
 					exit(123);
 				}
 
-				counts[nodeIndex]++;
+				// from here on, indices contains node indices rather than cells
+				indices[i] = previousNode;
 			}
 
-			// ALLOCATE BUCKETS
-			vector<shared_ptr<Buffer>> buckets(nodes.size(), nullptr);
-			for (int i = 0; i < nodes.size(); i++) {
-				int64_t numPoints = counts[i];
-				int64_t bytes = numPoints * bpp;
-				buckets[i] = make_shared<Buffer>(bytes);
-			}
-			
-			// ADD POINTS TO BUCKETS
-			shared_ptr<Buffer> previousBucket = nullptr;
-			int64_t previousNodeIndex = -1;
-			for (int64_t i = 0; i < batchSize; i++) {
-				int64_t pointOffset = i * bpp;
+			PartitionBuffers* partitionBuffers = nullptr;
+			{
+				lock_guard<mutex> lock(mtx_partitions);
 
-				auto index = toIndex(pointOffset);
+				auto& entry = partitions[std::this_thread::get_id()];
+				if (!entry) {
+					entry = make_unique<PartitionBuffers>(chunkFilePath, &chunkCursors, bpp, maxBufferedBytes, compressChunks);
+					memoryGovernor.claim(maxBufferedBytes);
+				}
+				partitionBuffers = entry.get();
+			}
 
-				auto nodeIndex = grid[index];
-				auto& node = nodes[nodeIndex];
+			// ADD POINTS TO PARTITIONS, consecutive points of the same node at once
+			for (int64_t i = 0; i < batchSize;) {
+				int64_t nodeIndex = indices[i];
 
-				if (nodeIndex == previousNodeIndex) {
-					previousBucket->write(&data[0] + pointOffset, bpp);
-				} else {
-					previousBucket = buckets[nodeIndex];
-					previousNodeIndex = nodeIndex;
-					previousBucket->write(&data[0] + pointOffset, bpp);
+				int64_t end = i + 1;
+				while (end < batchSize && indices[end] == nodeIndex) {
+					end++;
 				}
+
+				partitionBuffers->add(nodeIndex, data + i * bpp, end - i);
+
+				i = end;
 			}
 
 			state.pointsProcessed += batchSize;
 			state.bytesProcessed += numBytes;
 			state.duration = now() - tStart;
 
-			auto tAddBuckets = now();
-			addBuckets(targetDir, buckets);
-
 			// merge attribute metadata of this batch into global attribute metadata
-			for (int i = 0; i < outputAttributesCopy.list.size(); i++) {
-				Attribute& source = outputAttributesCopy.list[i];
-				Attribute& target = outputAttributes.list[i];
-
-				lock_guard<mutex> lock(mtx_attributes);
-				target.min.x = std::min(target.min.x, source.min.x);
-				target.min.y = std::min(target.min.y, source.min.y);
-				target.min.z = std::min(target.min.z, source.min.z);
-
-				target.max.x = std::max(target.max.x, source.max.x);
-				target.max.y = std::max(target.max.y, source.max.y);
-				target.max.z = std::max(target.max.z, source.max.z);
-
-				// target.mask = target.mask | source.mask;
-				
-				for(int j = 0; j < target.histogram.size(); j++){
-					target.histogram[j] = target.histogram[j] + source.histogram[j];
-				}
+			if(!isSpilled){
+				mergeAttributeStats(outputAttributes, outputAttributesCopy);
 			}
 
-
+			memoryGovernor.release(workingSet);
 		};
 
 		TaskPool<Task> pool(numChunkerThreads, processor);
 
-		for (auto source: sources) {
-
-			laszip_POINTER laszip_reader;
-			laszip_header* header;
-			{
-				laszip_BOOL request_reader = 1;
-				laszip_BOOL is_compressed = iEndsWith(source.path, ".laz") ? 1 : 0;
-
-				laszip_create(&laszip_reader);
-				laszip_request_compatibility_mode(laszip_reader, request_reader);
-				laszip_open_reader(laszip_reader, source.path.c_str(), &is_compressed);
-				laszip_get_header_pointer(laszip_reader, &header);
-			}
-
-			int64_t numPoints = std::max(uint64_t(header->number_of_point_records), header->extended_number_of_point_records);
-			int64_t pointsLeft = numPoints;
-			int64_t maxBatchSize = 1'000'000;
-			int64_t numRead = 0;
-
-			vector<Source> tmpSources = { source };
-			Attributes inputAttributes = computeOutputAttributes(tmpSources, {});
-
-			while (pointsLeft > 0) {
-
-				int64_t numToRead;
-				if (pointsLeft < maxBatchSize) {
-					numToRead = pointsLeft;
-					pointsLeft = 0;
-				} else {
-					numToRead = maxBatchSize;
-					pointsLeft = pointsLeft - maxBatchSize;
-				}
+		for (auto& batch : batches) {
+			auto& source = sources[batch.sourceIndex];
+
+			auto task = make_shared<Task>();
+			task->batchSize = batch.numPoints;
+			task->lut = &lut;
+			task->firstPoint = batch.firstPoint;
+			task->path = source.path;
+			task->header = source.header;
+			task->scale = outputAttributes.posScale;
+			task->offset = outputAttributes.posOffset;
+			task->min = min;
+			task->max = max;
+			task->inputAttributes = inputAttributes[batch.sourceIndex];
+			task->spillPath = spillPaths[batch.sourceIndex];
+
+			pool.addTask(task);
+		}
 
-				auto task = make_shared<Task>();
-				task->maxBatchSize = maxBatchSize;
-				task->batchSize = numToRead;
-				task->lut = &lut;
-				task->firstPoint = numRead;
-				task->path = source.path;
-				//task->scale = { header->x_scale_factor, header->y_scale_factor, header->z_scale_factor };
-				task->scale = outputAttributes.posScale;
-				task->offset = outputAttributes.posOffset;
-				task->min = min;
-				task->max = max;
-				task->inputAttributes = inputAttributes;
+		pool.close();
 
-				pool.addTask(task);
+		for (auto& [id, partitionBuffers] : partitions) {
+			partitionBuffers->flush();
 
-				numRead += numToRead;
+			for (int64_t i = 0; i < int64_t(nodes.size()); i++) {
+				auto& blocks = partitionBuffers->blocks[i];
+				nodes[i].blocks.insert(nodes[i].blocks.end(), blocks.begin(), blocks.end());
 			}
 
-			laszip_close_reader(laszip_reader);
-			laszip_destroy(laszip_reader);
-
+			memoryGovernor.unclaim(maxBufferedBytes);
 		}
+		partitions.clear();
 
-		pool.close();
 		writer->join();
 
 		delete writer;
@@ -1002,7 +1389,7 @@ namespace chunker_countsort_laszip {
 		cout << "=======================================" << endl;
 	}
 
-	void writeMetadata(string path, Vector3 min, Vector3 max, Attributes& attributes) {
+	json createMetadata(Vector3 min, Vector3 max, Attributes& attributes) {
 		json js;
 
 		js["min"] = { min.x, min.y, min.z };
@@ -1062,148 +1449,233 @@ namespace chunker_countsort_laszip {
 			attributes.posOffset.y,
 			attributes.posOffset.z });
 
-		string content = js.dump(4);
+		// chunk manifest
+		js["chunkFile"] = chunkFileName;
+		js["chunkEncoding"] = compressChunks ? chunk_codec::name : "RAW";
+		js["chunks"] = json::array();
+		for (auto& node : nodes) {
+			BoundingBox box = { min, max };
+
+			for (int64_t i = 1; i < int64_t(node.id.size()); i++) {
+				int index = node.id[i] - '0';
+
+				box = childBoundingBoxOf(box.min, box.max, index);
+			}
+
+			json jsChunk;
+			jsChunk["id"] = node.id;
+			jsChunk["numPoints"] = node.numPoints;
+			jsChunk["min"] = { box.min.x, box.min.y, box.min.z };
+			jsChunk["max"] = { box.max.x, box.max.y, box.max.z };
+
+			if (node.points) {
+				jsChunk["resident"] = true;
+			} else if (compressChunks) {
+				jsChunk["blocks"] = json::array();
+				for (auto& block : node.blocks) {
+					jsChunk["blocks"].push_back({
+						{"offset", block.offset},
+						{"size", block.size},
+						{"numPoints", block.numPoints},
+					});
+				}
+			} else {
+				jsChunk["offset"] = node.byteOffset;
+			}
+
+			js["chunks"].push_back(jsChunk);
+		}
 
-		writeFile(path, content);
+		return js;
 	}
 
 	// 
 	// XXX_high: variables of the higher/more detailed level of the pyramid that we're evaluating right now
 	// XXX_low: one level lower than _high; the target of the "downsampling" operation
 	// 
-	NodeLUT createLUT(vector<atomic_int32_t>& grid, int64_t gridSize) {
+	NodeLUT createLUT(vector<CellCount> grid, int64_t gridSize) {
 		auto tStart = now();
 
-		auto for_xyz = [](int64_t gridSize, function< void(int64_t, int64_t, int64_t)> callback) {
-
-			for (int x = 0; x < gridSize; x++) {
-			for (int y = 0; y < gridSize; y++) {
-			for (int z = 0; z < gridSize; z++) {
-				callback(x, y, z);
-			}
-			}
-			}
-
-		};
+		// occupied cells of the level that we're evaluating, sorted by morton code. 
+		// Each level is merged in-place into the same list, since it has at most as many cells as the level above.
+		// -1 marks cells that could not be merged.
+		vector<CellCount> grid_high = std::move(grid);
 
-		// atomic vectors are cumbersome, convert the highest level into a regular integer vector first.
-		vector<int64_t> grid_high;
-		grid_high.reserve(grid.size());
-		for (auto& value : grid) {
-			grid_high.push_back(value);
-		}
-		
 		int64_t level_max = int64_t(log2(gridSize));
 
-		// - evaluate counting grid in "image pyramid" fashion
-		// - merge smaller cells into larger ones
-		// - unmergeable cells are resulting chunks; push them to "nodes" array.
-		for (int64_t level_low = level_max - 1; level_low >= 0; level_low--) {
-
-			int64_t level_high = level_low + 1;
+		// merges cells [start, end) of the higher level into cells of the lower level, starting at start.
+		// returns the number of lower level cells, and adds unmergeable cells to finishedNodes.
+		auto mergeCells = [&grid_high, level_max](int64_t level_high, int64_t start, int64_t end, vector<Node>& finishedNodes) {
 
 			int64_t gridSize_high = pow(2, level_high);
-			int64_t gridSize_low = pow(2, level_low);
+			int64_t numCells_low = 0;
 
-			vector<int64_t> grid_low(gridSize_low * gridSize_low * gridSize_low, 0);
-			// grid_high
+			// the up to 8 occupied children of a lower detail cell are adjacent in morton order
+			for (int64_t i = start; i < end;) {
 
-			// loop through all cells of the lower detail target grid, and for each cell through the 8 enclosed cells of the higher level grid
-			for_xyz(gridSize_low, [&grid_low,  &grid_high, gridSize_low, gridSize_high, level_low, level_high, level_max](int64_t x, int64_t y, int64_t z){
+				int64_t cell_low = grid_high[i].cell >> 3;
 
-				int64_t index_low = x + y * gridSize_low + z * gridSize_low * gridSize_low;
-				
+				int64_t childrenEnd = i;
 				int64_t sum = 0;
-				int64_t max = 0;
 				bool unmergeable = false;
 
-				// loop through the 8 enclosed cells of the higher detailed grid
-				for (int64_t j = 0; j < 8; j++) {
-					int64_t ox = (j & 0b100) >> 2;
-					int64_t oy = (j & 0b010) >> 1;
-					int64_t oz = (j & 0b001) >> 0;
-
-					int64_t nx = 2 * x + ox;
-					int64_t ny = 2 * y + oy;
-					int64_t nz = 2 * z + oz;
-
-					int64_t index_high = nx + ny * gridSize_high + nz * gridSize_high * gridSize_high;
-
-					auto value = grid_high[index_high];
+				for (; childrenEnd < end && (grid_high[childrenEnd].cell >> 3) == cell_low; childrenEnd++) {
+					auto value = grid_high[childrenEnd].count;
 
 					if (value == -1) {
 						unmergeable = true;
 					} else {
 						sum += value;
 					}
-
-					max = std::max(max, value);
 				}
-				
 
 				if (unmergeable || sum > maxPointsPerChunk) {
 
 					// finished chunks
-					for (int64_t j = 0; j < 8; j++) {
-						int64_t ox = (j & 0b100) >> 2;
-						int64_t oy = (j & 0b010) >> 1;
-						int64_t oz = (j & 0b001) >> 0;
-
-						int64_t nx = 2 * x + ox;
-						int64_t ny = 2 * y + oy;
-						int64_t nz = 2 * z + oz;
-
-						int64_t index_high = nx + ny * gridSize_high + nz * gridSize_high * gridSize_high;
-
-						auto value = grid_high[index_high];
-
+					for (int64_t j = i; j < childrenEnd; j++) {
+						auto [cell_high, value] = grid_high[j];
 
 						if (value > 0) {
+							int64_t nx = compactBy3(cell_high >> 2);
+							int64_t ny = compactBy3(cell_high >> 1);
+							int64_t nz = compactBy3(cell_high >> 0);
+
 							string nodeID = toNodeID(level_high, gridSize_high, nx, ny, nz);
 
 							Node node(nodeID, value);
+							node.level = level_high;
 							node.x = nx;
 							node.y = ny;
 							node.z = nz;
 							node.size = pow(2, (level_max - level_high));
 
-							nodes.push_back(node);
+							finishedNodes.push_back(node);
 						}
 					}
 
 					// invalidate the field to show the parent that nothing can be merged with it
-					grid_low[index_low] = -1;
+					grid_high[start + numCells_low] = {cell_low, -1};
 				} else {
-					grid_low[index_low] = sum;
+					grid_high[start + numCells_low] = {cell_low, sum};
+				}
+
+				numCells_low++;
+				i = childrenEnd;
+			}
+
+			return numCells_low;
+		};
+
+		// - evaluate counting grid in "image pyramid" fashion
+		// - merge smaller cells into larger ones
+		// - unmergeable cells are resulting chunks; push them to "nodes" array.
+		for (int64_t level_low = level_max - 1; level_low >= 0; level_low--) {
+
+			int64_t level_high = level_low + 1;
+			int64_t numCells = grid_high.size();
+
+			// split into segments that are merged in parallel. Segment boundaries may not separate siblings.
+			int64_t numSegments = std::clamp(numCells / 10'000, int64_t(1), int64_t(4 * numChunkerThreads));
+			vector<int64_t> segmentStarts(numSegments + 1, numCells);
+			segmentStarts[0] = 0;
+			for (int64_t i = 1; i < numSegments; i++) {
+				int64_t start = std::max(numCells * i / numSegments, segmentStarts[i - 1]);
+
+				while (start > 0 && start < numCells && (grid_high[start].cell >> 3) == (grid_high[start - 1].cell >> 3)) {
+					start++;
 				}
 
+				segmentStarts[i] = start;
+			}
+
+			vector<int64_t> segments(numSegments);
+			std::iota(segments.begin(), segments.end(), 0);
+			vector<int64_t> segmentSizes(numSegments, 0);
+			vector<vector<Node>> segmentNodes(numSegments);
+
+			for_each(std::execution::par, segments.begin(), segments.end(), [&](int64_t segment) {
+				int64_t start = segmentStarts[segment];
+				int64_t end = segmentStarts[segment + 1];
+
+				segmentSizes[segment] = mergeCells(level_high, start, end, segmentNodes[segment]);
 			});
 
-			grid_high = grid_low;
+			// close the gaps between merged segments, and collect finished nodes in the same order as a sequential merge would
+			int64_t numCells_low = 0;
+			for (int64_t segment = 0; segment < numSegments; segment++) {
+				auto first = grid_high.begin() + segmentStarts[segment];
+				std::move(first, first + segmentSizes[segment], grid_high.begin() + numCells_low);
+				numCells_low += segmentSizes[segment];
+
+				nodes.insert(nodes.end(), segmentNodes[segment].begin(), segmentNodes[segment].end());
+			}
+			grid_high.resize(numCells_low);
 		}
 
 		// - create lookup table
-		// - loop through nodes, add pointers to node/chunk for all enclosed cells in LUT.
-		vector<int32_t> lut(gridSize* gridSize* gridSize, -1);
-		for (int i = 0; i < nodes.size(); i++) {
-			auto node = nodes[i];
-
-			for_xyz(node.size, [node, &lut, gridSize, i](int64_t ox, int64_t oy, int64_t oz) {
-				int64_t x = node.size * node.x + ox;
-				int64_t y = node.size * node.y + oy;
-				int64_t z = node.size * node.z + oz;
-				int64_t index = x + y * gridSize + z * gridSize * gridSize;
-
-				lut[index] = i;
-			});
+		// - each node covers a contiguous morton range of cells at the finest level
+		vector<NodeRange> ranges;
+		for (int64_t i = 0; i < int64_t(nodes.size()); i++) {
+			auto& node = nodes[i];
+
+			int64_t shift = 3 * (level_max - node.level);
+			int64_t cell = mortonEncode_magicbits(node.z, node.y, node.x);
+
+			ranges.push_back({cell << shift, (cell + 1) << shift, i});
 		}
 
+		std::sort(std::execution::par, ranges.begin(), ranges.end(), [](const NodeRange& a, const NodeRange& b) {
+			return a.start < b.start;
+		});
+
 		printElapsedTime("createLUT", tStart);
 
-		return {gridSize, lut};
+		return NodeLUT(gridSize, std::move(ranges));
+	}
+
+	// Counting grids are sparse, so their cost depends on the number of occupied cells rather than on the volume.
+	// Inputs that only fill a small part of their cubic bounding box, e.g. corridors or scattered tiles, 
+	// get finer grids, as long as they occupy no more cells than a dense input would at the base resolution.
+	int64_t computeGridSize(vector<Source>& sources, Vector3 min, Vector3 max, int64_t numPoints) {
+
+		int64_t baseGridSize = 512;
+		if (numPoints < 100'000'000) {
+			baseGridSize = 128;
+		}else if(numPoints < 500'000'000){
+			baseGridSize = 256;
+		}
+
+		int64_t maxGridSize = 4096;
+		double maxOccupiedCells = pow(double(baseGridSize), 3.0);
+		double cubeSize = (max - min).max();
+
+		// upper bound of the cells that the bounding boxes of the sources overlap with
+		auto estimateOccupiedCells = [&sources, cubeSize](int64_t gridSize) {
+			double cellSize = cubeSize / double(gridSize);
+			double numCells = 0.0;
+
+			for (auto& source : sources) {
+				Vector3 size = source.max - source.min;
+
+				double cx = std::min(ceil(size.x / cellSize) + 1.0, double(gridSize));
+				double cy = std::min(ceil(size.y / cellSize) + 1.0, double(gridSize));
+				double cz = std::min(ceil(size.z / cellSize) + 1.0, double(gridSize));
+
+				numCells += cx * cy * cz;
+			}
+
+			return numCells;
+		};
+
+		int64_t gridSize = baseGridSize;
+		while (gridSize < maxGridSize && estimateOccupiedCells(2 * gridSize) <= maxOccupiedCells) {
+			gridSize = 2 * gridSize;
+		}
+
+		return gridSize;
 	}
 
-	void doChunking(vector<Source> sources, string targetDir, Vector3 min, Vector3 max, State& state, Attributes outputAttributes, Monitor* monitor) {
+	shared_ptr<ResidentChunks> doChunking(vector<Source> sources, string targetDir, Vector3 min, Vector3 max, State& state, Attributes outputAttributes, Options& options, Monitor* monitor) {
 
 		auto tStart = now();
 
@@ -1211,13 +1683,8 @@ namespace chunker_countsort_laszip {
 		maxPointsPerChunk = std::min(tmp, int64_t(10'000'000));
 		// cout << "maxPointsPerChunk: " << maxPointsPerChunk << endl;
 
-		if (state.pointsTotal < 100'000'000) {
-			gridSize = 128;
-		}else if(state.pointsTotal < 500'000'000){
-			gridSize = 256;
-		} else {
-			gridSize = 512;
-		}
+		gridSize = computeGridSize(sources, min, max, state.pointsTotal);
+		state.values["chunking grid"] = to_string(gridSize);
 
 		state.currentPass = 1;
 
@@ -1230,16 +1697,121 @@ namespace chunker_countsort_laszip {
 			}
 		}
 
+		// IN-MEMORY CHUNKS
+		// chunks that fit into memory are handed to the indexer directly, without a round trip through the disk.
+		// --keep-chunks and --no-indexing need all chunks on disk, the latter for a later run with --no-chunking.
+		if (options.keepChunks || options.noIndexing) {
+			maxResidentBytes = 0;
+		} else {
+			maxResidentBytes = memoryGovernor.budget / 2;
+		}
+
+		// CHUNK COMPRESSION
+		// chunks, the chunk roots that the indexer spills and the octree coexist until indexing is finished, 
+		// and each of them can be about as large as the converted points.
+		// If they don't fit into the scratch space, chunks are compressed. 
+		{
+			int64_t chunkBytes = state.pointsTotal * outputAttributes.bytes;
+			int64_t spilledChunkBytes = std::max(chunkBytes - maxResidentBytes, int64_t(0));
+			int64_t requiredBytes = int64_t(2.2 * double(chunkBytes) + 1.1 * double(spilledChunkBytes));
+
+			std::error_code ec;
+			auto space = fs::space(targetDir, ec);
+			int64_t availableBytes = ec ? 0 : int64_t(space.available);
+
+			if (options.chunkCompression == "ON") {
+				compressChunks = true;
+			} else if (options.chunkCompression == "OFF") {
+				compressChunks = false;
+			} else {
+				compressChunks = !ec && availableBytes < requiredBytes;
+			}
+
+			if (compressChunks) {
+				logger::INFO("compressing chunks, " + formatNumber(double(availableBytes) / (1024.0 * 1024.0), 1) + "MB of scratch space available for "
+					+ formatNumber(double(spilledChunkBytes) / (1024.0 * 1024.0), 1) + "MB of raw chunks");
+			}
+
+			state.values["chunk encoding"] = compressChunks ? chunk_codec::name : "RAW";
+		}
+
+		// DECODE-ONCE
+		// laz sources are expensive to decode, so if there is enough scratch space, 
+		// we convert them to the output layout while counting and distribute from the spilled points
+		string spillDir = targetDir + "/.chunking_spill";
+		vector<string> spillPaths(sources.size(), "");
+		{
+			int64_t spillBytes = 0;
+			for (auto& source : sources) {
+				if (iEndsWith(source.path, ".laz")) {
+					spillBytes += source.numPoints * outputAttributes.bytes;
+				}
+			}
+
+			// spilled points and chunks coexist until distribution is finished
+			int64_t chunkBytes = std::max(state.pointsTotal * outputAttributes.bytes - maxResidentBytes, int64_t(0));
+			int64_t requiredBytes = int64_t(1.1 * double(spillBytes + chunkBytes));
+
+			std::error_code ec;
+			auto space = fs::space(targetDir, ec);
+			int64_t availableBytes = ec ? 0 : int64_t(space.available);
+
+			bool decodeOnce = spillBytes > 0 && availableBytes > requiredBytes;
+
+			if (decodeOnce) {
+				fs::create_directories(spillDir);
+
+				for (int64_t i = 0; i < int64_t(sources.size()); i++) {
+					auto& source = sources[i];
+
+					if (!iEndsWith(source.path, ".laz")) {
+						continue;
+					}
+
+					string path = spillDir + "/" + to_string(i) + ".bin";
+
+					{ // create spill file, tasks write their batches into it at their respective offsets
+						fstream file(path, ios::out | ios::binary);
+					}
+					fs::resize_file(path, source.numPoints * outputAttributes.bytes);
+
+					spillPaths[i] = path;
+				}
+
+				logger::INFO("chunking mode: decode-once, spilling " + formatNumber(double(spillBytes) / (1024.0 * 1024.0), 1) + "MB of converted laz points");
+			} else if (spillBytes > 0) {
+				logger::INFO("chunking mode: decode-twice, not enough scratch space to spill "
+					+ formatNumber(double(spillBytes) / (1024.0 * 1024.0), 1) + "MB of converted laz points");
+			}
+
+			state.values["chunking mode"] = decodeOnce ? "decode-once" : "decode-twice";
+		}
+
+		state.values["grid kernels"] = grid_kernels::getKernelName();
+
+		// per-source input layouts, shared by both passes
+		vector<Attributes> inputAttributes;
+		for (auto& source : sources) {
+			vector<Source> tmpSources = { source };
+			inputAttributes.push_back(computeOutputAttributes(tmpSources, {}));
+		}
+
+		// batches of up to 1M points, but small enough to keep all threads busy on small inputs
+		int64_t maxBatchSize = std::clamp(state.pointsTotal / (4 * int64_t(numChunkerThreads)), int64_t(100'000), int64_t(1'000'000));
+		auto batches = createBatches(sources, maxBatchSize);
+
 		// COUNT
-		auto grid = countPointsInCells(sources, min, max, gridSize, state, outputAttributes, monitor);
+		auto grid = countPointsInCells(sources, inputAttributes, batches, spillPaths, min, max, gridSize, state, outputAttributes, monitor);
 
 		{ // DISTIRBUTE
 			auto tStartDistribute = now();
 
-			auto lut = createLUT(grid, gridSize);
+			auto lut = createLUT(std::move(grid), gridSize);
 
 			state.currentPass = 2;
-			distributePoints(sources, min, max, targetDir, lut, state, outputAttributes, monitor);
+			distributePoints(sources, inputAttributes, batches, spillPaths, min, max, targetDir, lut, state, outputAttributes, monitor);
+
+			fs::remove_all(spillDir);
 
 			{
 				double duration = now() - tStartDistribute;
@@ -1253,11 +1825,29 @@ namespace chunker_countsort_laszip {
 		Vector3 size = { cubeSize, cubeSize, cubeSize };
 		max = min + cubeSize;
 
-		writeMetadata(metadataPath, min, max, outputAttributes);
+		json metadata = createMetadata(min, max, outputAttributes);
+
+		auto residentChunks = make_shared<ResidentChunks>();
+		residentChunks->manifest = metadata.dump();
+
+		for (auto& node : nodes) {
+			if (node.points) {
+				residentChunks->points[node.id] = node.points;
+				node.points = nullptr;
+			}
+		}
+
+		// without spilled chunks, there is nothing left to do for the chunk directory
+		if (residentChunks->points.size() == nodes.size()) {
+			fs::remove_all(targetDir + "/chunks");
+		} else {
+			writeFile(metadataPath, metadata.dump(4));
+		}
 
 		double duration = now() - tStart;
 		state.values["duration(chunking-total)"] = formatNumber(duration, 3);
 
+		return residentChunks;
 	}
 
 
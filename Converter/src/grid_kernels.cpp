@@ -0,0 +1,465 @@
+
+#include "grid_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "converter_utils.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+	#define GRID_KERNELS_X86 1
+	#include <immintrin.h>
+#endif
+
+#if defined(GRID_KERNELS_X86) && defined(_MSC_VER)
+	#include <intrin.h>
+	#define TARGET_AVX2
+	#define TARGET_AVX512
+#elif defined(GRID_KERNELS_X86)
+	#define TARGET_AVX2 __attribute__((target("avx2")))
+	#define TARGET_AVX512 __attribute__((target("avx2,avx512f")))
+#endif
+
+namespace grid_kernels {
+
+	inline int32_t readInt32(uint8_t* source) {
+		int32_t value;
+		memcpy(&value, source, 4);
+
+		return value;
+	}
+
+	// SCALAR
+
+	void quantizeScalar(uint8_t* source, int64_t stride, int64_t numPoints, Vector3 scale, Vector3 offset, Vector3 targetScale, Vector3 targetOffset, int32_t* target) {
+		for (int64_t i = 0; i < numPoints; i++) {
+			uint8_t* xyz = source + i * stride;
+
+			double x = scale.x * double(readInt32(xyz + 0)) + offset.x;
+			double y = scale.y * double(readInt32(xyz + 4)) + offset.y;
+			double z = scale.z * double(readInt32(xyz + 8)) + offset.z;
+
+			target[3 * i + 0] = int32_t((x - targetOffset.x) / targetScale.x);
+			target[3 * i + 1] = int32_t((y - targetOffset.y) / targetScale.y);
+			target[3 * i + 2] = int32_t((z - targetOffset.z) / targetScale.z);
+		}
+	}
+
+	void computeCellIndicesScalar(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+
+		auto [scale, offset, min, size, gridSize] = grid;
+		double dGridSize = double(gridSize);
+
+		for (int64_t i = 0; i < numPoints; i++) {
+			uint8_t* point = xyz + i * stride;
+
+			double ux = (double(readInt32(point + 0)) * scale.x + offset.x - min.x) / size.x;
+			double uy = (double(readInt32(point + 4)) * scale.y + offset.y - min.y) / size.y;
+			double uz = (double(readInt32(point + 8)) * scale.z + offset.z - min.z) / size.z;
+
+			bool inBox = ux >= 0.0 && uy >= 0.0 && uz >= 0.0;
+			inBox = inBox && ux <= 1.0 && uy <= 1.0 && uz <= 1.0;
+
+			if (!inBox) {
+				indices[i] = -1;
+				continue;
+			}
+
+			int64_t ix = int64_t(std::min(dGridSize * ux, dGridSize - 1.0));
+			int64_t iy = int64_t(std::min(dGridSize * uy, dGridSize - 1.0));
+			int64_t iz = int64_t(std::min(dGridSize * uz, dGridSize - 1.0));
+
+			indices[i] = mortonEncode_magicbits(iz, iy, ix);
+		}
+	}
+
+	void computeMortonIndicesScalar(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+
+		auto [scale, offset, min, size, gridSize] = grid;
+
+		for (int64_t i = 0; i < numPoints; i++) {
+			uint8_t* point = xyz + i * stride;
+
+			double x = (readInt32(point + 0) * scale.x) + offset.x;
+			double y = (readInt32(point + 4) * scale.y) + offset.y;
+			double z = (readInt32(point + 8) * scale.z) + offset.z;
+
+			int64_t ix = double(gridSize) * (x - min.x) / size.x;
+			int64_t iy = double(gridSize) * (y - min.y) / size.y;
+			int64_t iz = double(gridSize) * (z - min.z) / size.z;
+
+			ix = std::max(int64_t(0), std::min(ix, gridSize - 1));
+			iy = std::max(int64_t(0), std::min(iy, gridSize - 1));
+			iz = std::max(int64_t(0), std::min(iz, gridSize - 1));
+
+			indices[i] = mortonEncode_magicbits(iz, iy, ix);
+		}
+	}
+
+#if defined(GRID_KERNELS_X86)
+
+	// Notes on matching the scalar versions:
+	// - std::min(a, b) returns a unless b < a. _mm_min_pd(b, a) does the same, including NaNs.
+	// - truncating to int32 instead of int64 is equivalent for cell coordinates. Where the scalar version 
+	//   clamps after the conversion, values are clamped to [-1, gridSize] first. Results only differ 
+	//   for values outside the int64 range, where the scalar conversion is undefined.
+	// - gathers use 32 bit offsets, i.e. records may not be larger than 256MB.
+
+	// AVX2
+
+	TARGET_AVX2 inline __m256i splitBy3(__m256i x) {
+		x = _mm256_and_si256(x, _mm256_set1_epi64x(0x1fffff));
+		x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 32)), _mm256_set1_epi64x(0x1f00000000ffff));
+		x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 16)), _mm256_set1_epi64x(0x1f0000ff0000ff));
+		x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 8)), _mm256_set1_epi64x(0x100f00f00f00f00f));
+		x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 4)), _mm256_set1_epi64x(0x10c30c30c30c30c3));
+		x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 2)), _mm256_set1_epi64x(0x1249249249249249));
+
+		return x;
+	}
+
+	TARGET_AVX2 void quantizeAVX2(uint8_t* source, int64_t stride, int64_t numPoints, Vector3 scale, Vector3 offset, Vector3 targetScale, Vector3 targetOffset, int32_t* target) {
+
+		__m128i vOffsets = _mm_setr_epi32(0, stride, 2 * stride, 3 * stride);
+
+		double* pScale = &scale.x;
+		double* pOffset = &offset.x;
+		double* pTargetScale = &targetScale.x;
+		double* pTargetOffset = &targetOffset.x;
+
+		int64_t i = 0;
+		for (; i + 4 <= numPoints; i += 4) {
+			uint8_t* base = source + i * stride;
+
+			alignas(16) int32_t result[3][4];
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m128i X = _mm_i32gather_epi32(reinterpret_cast<int*>(base + 4 * axis), vOffsets, 1);
+
+				__m256d x = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(pScale[axis]), _mm256_cvtepi32_pd(X)), _mm256_set1_pd(pOffset[axis]));
+				__m256d t = _mm256_div_pd(_mm256_sub_pd(x, _mm256_set1_pd(pTargetOffset[axis])), _mm256_set1_pd(pTargetScale[axis]));
+
+				_mm_store_si128(reinterpret_cast<__m128i*>(result[axis]), _mm256_cvttpd_epi32(t));
+			}
+
+			for (int j = 0; j < 4; j++) {
+				target[3 * (i + j) + 0] = result[0][j];
+				target[3 * (i + j) + 1] = result[1][j];
+				target[3 * (i + j) + 2] = result[2][j];
+			}
+		}
+
+		quantizeScalar(source + i * stride, stride, numPoints - i, scale, offset, targetScale, targetOffset, target + 3 * i);
+	}
+
+	TARGET_AVX2 void computeCellIndicesAVX2(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+
+		double* pScale = &grid.scale.x;
+		double* pOffset = &grid.offset.x;
+		double* pMin = &grid.min.x;
+		double* pSize = &grid.size.x;
+		double dGridSize = double(grid.gridSize);
+
+		__m128i vOffsets = _mm_setr_epi32(0, stride, 2 * stride, 3 * stride);
+		__m256d vGridSize = _mm256_set1_pd(dGridSize);
+		__m256d vLimit = _mm256_set1_pd(dGridSize - 1.0);
+		__m256d vZero = _mm256_set1_pd(0.0);
+		__m256d vOne = _mm256_set1_pd(1.0);
+
+		int64_t i = 0;
+		for (; i + 4 <= numPoints; i += 4) {
+			uint8_t* base = xyz + i * stride;
+
+			__m256d inBox = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+			__m256i index = _mm256_setzero_si256();
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m128i X = _mm_i32gather_epi32(reinterpret_cast<int*>(base + 4 * axis), vOffsets, 1);
+
+				__m256d x = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(X), _mm256_set1_pd(pScale[axis])), _mm256_set1_pd(pOffset[axis]));
+				__m256d u = _mm256_div_pd(_mm256_sub_pd(x, _mm256_set1_pd(pMin[axis])), _mm256_set1_pd(pSize[axis]));
+
+				inBox = _mm256_and_pd(inBox, _mm256_cmp_pd(u, vZero, _CMP_GE_OQ));
+				inBox = _mm256_and_pd(inBox, _mm256_cmp_pd(u, vOne, _CMP_LE_OQ));
+
+				__m256d cell = _mm256_min_pd(vLimit, _mm256_mul_pd(vGridSize, u));
+				__m256i bits = splitBy3(_mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(cell)));
+
+				index = _mm256_or_si256(index, _mm256_slli_epi64(bits, 2 - axis));
+			}
+
+			index = _mm256_blendv_epi8(_mm256_set1_epi64x(-1), index, _mm256_castpd_si256(inBox));
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(indices + i), index);
+		}
+
+		computeCellIndicesScalar(xyz + i * stride, stride, numPoints - i, grid, indices + i);
+	}
+
+	TARGET_AVX2 void computeMortonIndicesAVX2(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+
+		double* pScale = &grid.scale.x;
+		double* pOffset = &grid.offset.x;
+		double* pMin = &grid.min.x;
+		double* pSize = &grid.size.x;
+		double dGridSize = double(grid.gridSize);
+
+		__m128i vOffsets = _mm_setr_epi32(0, stride, 2 * stride, 3 * stride);
+		__m256d vGridSize = _mm256_set1_pd(dGridSize);
+		__m256d vMinusOne = _mm256_set1_pd(-1.0);
+		__m128i vZero = _mm_setzero_si128();
+		__m128i vMaxCell = _mm_set1_epi32(grid.gridSize - 1);
+
+		int64_t i = 0;
+		for (; i + 4 <= numPoints; i += 4) {
+			uint8_t* base = xyz + i * stride;
+
+			__m256i morton = _mm256_setzero_si256();
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m128i X = _mm_i32gather_epi32(reinterpret_cast<int*>(base + 4 * axis), vOffsets, 1);
+
+				__m256d x = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(X), _mm256_set1_pd(pScale[axis])), _mm256_set1_pd(pOffset[axis]));
+				__m256d t = _mm256_div_pd(_mm256_mul_pd(vGridSize, _mm256_sub_pd(x, _mm256_set1_pd(pMin[axis]))), _mm256_set1_pd(pSize[axis]));
+
+				t = _mm256_min_pd(vGridSize, t);
+				t = _mm256_max_pd(vMinusOne, t);
+
+				__m128i cell = _mm256_cvttpd_epi32(t);
+				cell = _mm_min_epi32(_mm_max_epi32(cell, vZero), vMaxCell);
+
+				// same bit order as mortonEncode_magicbits(iz, iy, ix): z is the least significant axis, x the most significant
+				__m256i bits = splitBy3(_mm256_cvtepi32_epi64(cell));
+				morton = _mm256_or_si256(morton, _mm256_slli_epi64(bits, 2 - axis));
+			}
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(indices + i), morton);
+		}
+
+		computeMortonIndicesScalar(xyz + i * stride, stride, numPoints - i, grid, indices + i);
+	}
+
+	// AVX-512
+	//
+	// GCC 12 reports the deliberately undefined pass-through operand of unmasked intrinsics in avx512fintrin.h 
+	// as maybe uninitialized.
+
+	#if defined(__GNUC__) && !defined(__clang__)
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+	#endif
+
+	TARGET_AVX512 inline __m512i splitBy3(__m512i x) {
+		x = _mm512_and_si512(x, _mm512_set1_epi64(0x1fffff));
+		x = _mm512_and_si512(_mm512_or_si512(x, _mm512_slli_epi64(x, 32)), _mm512_set1_epi64(0x1f00000000ffff));
+		x = _mm512_and_si512(_mm512_or_si512(x, _mm512_slli_epi64(x, 16)), _mm512_set1_epi64(0x1f0000ff0000ff));
+		x = _mm512_and_si512(_mm512_or_si512(x, _mm512_slli_epi64(x, 8)), _mm512_set1_epi64(0x100f00f00f00f00f));
+		x = _mm512_and_si512(_mm512_or_si512(x, _mm512_slli_epi64(x, 4)), _mm512_set1_epi64(0x10c30c30c30c30c3));
+		x = _mm512_and_si512(_mm512_or_si512(x, _mm512_slli_epi64(x, 2)), _mm512_set1_epi64(0x1249249249249249));
+
+		return x;
+	}
+
+	TARGET_AVX512 void quantizeAVX512(uint8_t* source, int64_t stride, int64_t numPoints, Vector3 scale, Vector3 offset, Vector3 targetScale, Vector3 targetOffset, int32_t* target) {
+
+		__m256i vOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+
+		double* pScale = &scale.x;
+		double* pOffset = &offset.x;
+		double* pTargetScale = &targetScale.x;
+		double* pTargetOffset = &targetOffset.x;
+
+		int64_t i = 0;
+		for (; i + 8 <= numPoints; i += 8) {
+			uint8_t* base = source + i * stride;
+
+			alignas(32) int32_t result[3][8];
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m256i X = _mm256_i32gather_epi32(reinterpret_cast<int*>(base + 4 * axis), vOffsets, 1);
+
+				__m512d x = _mm512_add_pd(_mm512_mul_pd(_mm512_set1_pd(pScale[axis]), _mm512_cvtepi32_pd(X)), _mm512_set1_pd(pOffset[axis]));
+				__m512d t = _mm512_div_pd(_mm512_sub_pd(x, _mm512_set1_pd(pTargetOffset[axis])), _mm512_set1_pd(pTargetScale[axis]));
+
+				_mm256_store_si256(reinterpret_cast<__m256i*>(result[axis]), _mm512_cvttpd_epi32(t));
+			}
+
+			for (int j = 0; j < 8; j++) {
+				target[3 * (i + j) + 0] = result[0][j];
+				target[3 * (i + j) + 1] = result[1][j];
+				target[3 * (i + j) + 2] = result[2][j];
+			}
+		}
+
+		quantizeScalar(source + i * stride, stride, numPoints - i, scale, offset, targetScale, targetOffset, target + 3 * i);
+	}
+
+	TARGET_AVX512 void computeCellIndicesAVX512(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+
+		double* pScale = &grid.scale.x;
+		double* pOffset = &grid.offset.x;
+		double* pMin = &grid.min.x;
+		double* pSize = &grid.size.x;
+		double dGridSize = double(grid.gridSize);
+
+		__m256i vOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+		__m512d vGridSize = _mm512_set1_pd(dGridSize);
+		__m512d vLimit = _mm512_set1_pd(dGridSize - 1.0);
+		__m512d vZero = _mm512_set1_pd(0.0);
+		__m512d vOne = _mm512_set1_pd(1.0);
+
+		int64_t i = 0;
+		for (; i + 8 <= numPoints; i += 8) {
+			uint8_t* base = xyz + i * stride;
+
+			__mmask8 inBox = 0xFF;
+			__m512i index = _mm512_setzero_si512();
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m256i X = _mm256_i32gather_epi32(reinterpret_cast<int*>(base + 4 * axis), vOffsets, 1);
+
+				__m512d x = _mm512_add_pd(_mm512_mul_pd(_mm512_cvtepi32_pd(X), _mm512_set1_pd(pScale[axis])), _mm512_set1_pd(pOffset[axis]));
+				__m512d u = _mm512_div_pd(_mm512_sub_pd(x, _mm512_set1_pd(pMin[axis])), _mm512_set1_pd(pSize[axis]));
+
+				inBox = inBox & _mm512_cmp_pd_mask(u, vZero, _CMP_GE_OQ);
+				inBox = inBox & _mm512_cmp_pd_mask(u, vOne, _CMP_LE_OQ);
+
+				__m512d cell = _mm512_min_pd(vLimit, _mm512_mul_pd(vGridSize, u));
+				__m512i bits = splitBy3(_mm512_cvtepi32_epi64(_mm512_cvttpd_epi32(cell)));
+
+				index = _mm512_or_si512(index, _mm512_slli_epi64(bits, 2 - axis));
+			}
+
+			index = _mm512_mask_mov_epi64(_mm512_set1_epi64(-1), inBox, index);
+
+			_mm512_storeu_si512(indices + i, index);
+		}
+
+		computeCellIndicesScalar(xyz + i * stride, stride, numPoints - i, grid, indices + i);
+	}
+
+	TARGET_AVX512 void computeMortonIndicesAVX512(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+
+		double* pScale = &grid.scale.x;
+		double* pOffset = &grid.offset.x;
+		double* pMin = &grid.min.x;
+		double* pSize = &grid.size.x;
+		double dGridSize = double(grid.gridSize);
+
+		__m256i vOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+		__m512d vGridSize = _mm512_set1_pd(dGridSize);
+		__m512d vMinusOne = _mm512_set1_pd(-1.0);
+		__m256i vZero = _mm256_setzero_si256();
+		__m256i vMaxCell = _mm256_set1_epi32(grid.gridSize - 1);
+
+		int64_t i = 0;
+		for (; i + 8 <= numPoints; i += 8) {
+			uint8_t* base = xyz + i * stride;
+
+			__m512i morton = _mm512_setzero_si512();
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m256i X = _mm256_i32gather_epi32(reinterpret_cast<int*>(base + 4 * axis), vOffsets, 1);
+
+				__m512d x = _mm512_add_pd(_mm512_mul_pd(_mm512_cvtepi32_pd(X), _mm512_set1_pd(pScale[axis])), _mm512_set1_pd(pOffset[axis]));
+				__m512d t = _mm512_div_pd(_mm512_mul_pd(vGridSize, _mm512_sub_pd(x, _mm512_set1_pd(pMin[axis]))), _mm512_set1_pd(pSize[axis]));
+
+				t = _mm512_min_pd(vGridSize, t);
+				t = _mm512_max_pd(vMinusOne, t);
+
+				__m256i cell = _mm512_cvttpd_epi32(t);
+				cell = _mm256_min_epi32(_mm256_max_epi32(cell, vZero), vMaxCell);
+
+				__m512i bits = splitBy3(_mm512_cvtepi32_epi64(cell));
+				morton = _mm512_or_si512(morton, _mm512_slli_epi64(bits, 2 - axis));
+			}
+
+			_mm512_storeu_si512(indices + i, morton);
+		}
+
+		computeMortonIndicesScalar(xyz + i * stride, stride, numPoints - i, grid, indices + i);
+	}
+
+	#if defined(__GNUC__) && !defined(__clang__)
+		#pragma GCC diagnostic pop
+	#endif
+
+	bool supportsAVX2() {
+	#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+
+		__cpuidex(info, 1, 0);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx || (_xgetbv(0) & 0b110) != 0b110) {
+			return false;
+		}
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	#else
+		return __builtin_cpu_supports("avx2");
+	#endif
+	}
+
+	bool supportsAVX512() {
+	#if defined(_MSC_VER)
+		if (!supportsAVX2() || (_xgetbv(0) & 0b11100110) != 0b11100110) {
+			return false;
+		}
+
+		int info[4];
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 16)) != 0;
+	#else
+		return __builtin_cpu_supports("avx512f");
+	#endif
+	}
+
+#endif
+
+	vector<Kernels> getSupportedKernels() {
+		vector<Kernels> supported;
+
+		supported.push_back({ "scalar", quantizeScalar, computeCellIndicesScalar, computeMortonIndicesScalar });
+
+	#if defined(GRID_KERNELS_X86)
+		if (supportsAVX2()) {
+			supported.push_back({ "AVX2", quantizeAVX2, computeCellIndicesAVX2, computeMortonIndicesAVX2 });
+		}
+
+		if (supportsAVX512()) {
+			supported.push_back({ "AVX-512", quantizeAVX512, computeCellIndicesAVX512, computeMortonIndicesAVX512 });
+		}
+	#endif
+
+		return supported;
+	}
+
+	Kernels& getKernels() {
+		static Kernels kernels = getSupportedKernels().back();
+
+		return kernels;
+	}
+
+	void quantize(uint8_t* source, int64_t stride, int64_t numPoints, Vector3 scale, Vector3 offset, Vector3 targetScale, Vector3 targetOffset, int32_t* target) {
+		getKernels().quantize(source, stride, numPoints, scale, offset, targetScale, targetOffset, target);
+	}
+
+	void computeCellIndices(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+		getKernels().computeCellIndices(xyz, stride, numPoints, grid, indices);
+	}
+
+	void computeMortonIndices(uint8_t* xyz, int64_t stride, int64_t numPoints, CellGrid& grid, int64_t* indices) {
+		getKernels().computeMortonIndices(xyz, stride, numPoints, grid, indices);
+	}
+
+	string getKernelName() {
+		return getKernels().name;
+	}
+
+}
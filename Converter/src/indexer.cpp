@@ -2,6 +2,7 @@
 #include <cerrno>
 #include <execution>
 #include <algorithm>
+#include <numeric>
 
 #include "indexer.h"
 
@@ -11,6 +12,10 @@
 #include "DbgWriter.h"
 #include "brotli/encode.h"
 #include "HierarchyBuilder.h"
+#include "grid_kernels.h"
+#include "chunk_codec.h"
+#include "MemoryGovernor.h"
+#include "point_dedup.h"
 
 using std::unique_lock;
 
@@ -27,33 +32,20 @@ namespace indexer{
 	};
 
 	void sortBreadthFirst(vector<Node*>& nodes) {
+		// keys of deeper nodes are larger, and keys of the same level sort like their names
 		sort(nodes.begin(), nodes.end(), [](Node* a, Node* b) {
-			if (a->name.size() != b->name.size()) {
-				return a->name.size() < b->name.size();
-			} else {
-				return a->name < b->name;
-			}
+			return a->key < b->key;
 		});
 	}
 
 	uint8_t childMaskOf(Node* node) {
-		uint8_t mask = 0;
-
-		for (int64_t i = 0; i < 8; i++) {
-			auto child = node->children[i];
-
-			if (child != nullptr) {
-				mask = mask | (1 << i);
-			}
-		}
-
-		return mask;
+		return node->childMask;
 	}
 
-	shared_ptr<Chunks> getChunks(string pathIn) {
+	shared_ptr<Chunks> getChunks(string pathIn, shared_ptr<ResidentChunks> residentChunks) {
 		string chunkDirectory = pathIn + "/chunks";
 
-		string metadataText = readTextFile(chunkDirectory + "/metadata.json");
+		string metadataText = residentChunks ? residentChunks->manifest : readTextFile(chunkDirectory + "/metadata.json");
 		json js = json::parse(metadataText);
 
 		Vector3 min = {
@@ -138,47 +130,93 @@ namespace indexer{
 		attributes.posOffset = { offsetX, offsetY, offsetZ };
 		
 
-		auto toID = [](string filename) -> string {
-			string strID = stringReplace(filename, "chunk_", "");
-			strID = stringReplace(strID, ".bin", "");
+		vector<shared_ptr<Chunk>> chunksToLoad;
+		string chunkFile = "";
 
-			return strID;
-		};
+		if (js.contains("chunks")) {
+			// all chunks in one file, at the extents listed in the manifest
+			chunkFile = chunkDirectory + "/" + js["chunkFile"].get<string>();
+			string encoding = js.value("chunkEncoding", "RAW");
 
-		vector<shared_ptr<Chunk>> chunksToLoad;
-		for (const auto& entry : fs::directory_iterator(chunkDirectory)) {
-			string filename = entry.path().filename().string();
-			string chunkID = toID(filename);
+			if (encoding != "RAW" && encoding != chunk_codec::name) {
+				logger::ERROR("unsupported chunk encoding: " + encoding);
 
-			if (!iEndsWith(filename, ".bin")) {
-				continue;
+				exit(123);
 			}
 
-			shared_ptr<Chunk> chunk = make_shared<Chunk>();
-			chunk->file = entry.path().string();
-			chunk->id = chunkID;
+			for (auto& jsChunk : js["chunks"]) {
+				int64_t numPoints = jsChunk["numPoints"];
+
+				shared_ptr<Chunk> chunk = make_shared<Chunk>();
+				chunk->file = chunkFile;
+				chunk->id = jsChunk["id"];
+				chunk->size = numPoints * attributes.bytes;
+				chunk->numPoints = numPoints;
+
+				if (jsChunk.value("resident", false)) {
+					// moved, so that the points are released as soon as the chunk is indexed
+					chunk->points = std::move(residentChunks->points[chunk->id]);
+				} else if (encoding == chunk_codec::name) {
+					for (auto& jsBlock : jsChunk["blocks"]) {
+						chunk->blocks.push_back({ jsBlock["offset"], jsBlock["size"], jsBlock["numPoints"] });
+						chunk->storedBytes += chunk->blocks.back().size;
+					}
+				} else {
+					chunk->offset = jsChunk["offset"];
+					chunk->storedBytes = chunk->size;
+				}
+				chunk->min = { jsChunk["min"][0], jsChunk["min"][1], jsChunk["min"][2] };
+				chunk->max = { jsChunk["max"][0], jsChunk["max"][1], jsChunk["max"][2] };
 
-			BoundingBox box = { min, max };
+				chunksToLoad.push_back(chunk);
+			}
+		} else {
+			// one file per chunk, as written by earlier versions
+			auto toID = [](string filename) -> string {
+				string strID = stringReplace(filename, "chunk_", "");
+				strID = stringReplace(strID, ".bin", "");
 
-			for (int i = 1; i < chunkID.size(); i++) {
-				int index = chunkID[i] - '0'; // this feels so wrong...
+				return strID;
+			};
 
-				box = childBoundingBoxOf(box.min, box.max, index);
-			}
+			for (const auto& entry : fs::directory_iterator(chunkDirectory)) {
+				string filename = entry.path().filename().string();
+				string chunkID = toID(filename);
+
+				if (!iEndsWith(filename, ".bin")) {
+					continue;
+				}
+
+				shared_ptr<Chunk> chunk = make_shared<Chunk>();
+				chunk->file = entry.path().string();
+				chunk->id = chunkID;
+				chunk->size = fs::file_size(entry.path());
+				chunk->numPoints = chunk->size / attributes.bytes;
+				chunk->storedBytes = chunk->size;
+
+				BoundingBox box = { min, max };
 
-			chunk->min = box.min;
-			chunk->max = box.max;
+				for (int64_t i = 1; i < int64_t(chunkID.size()); i++) {
+					int index = chunkID[i] - '0'; // this feels so wrong...
 
-			chunksToLoad.push_back(chunk);
+					box = childBoundingBoxOf(box.min, box.max, index);
+				}
+
+				chunk->min = box.min;
+				chunk->max = box.max;
+
+				chunksToLoad.push_back(chunk);
+			}
 		}
 
 		auto chunks = make_shared<Chunks>(chunksToLoad, min, max);
 		chunks->attributes = attributes;
+		chunks->file = chunkFile;
 
 		return chunks;
 	}
 
-	void Indexer::flushChunkRoot(shared_ptr<Node> chunkRoot) {
+	void Indexer::flushChunkRoot(Node* chunkRoot) {
 
 		lock_guard<mutex> lock(mtx_chunkRoot);
 
@@ -201,28 +239,27 @@ namespace indexer{
 
 	vector<CRNode> Indexer::processChunkRoots(){
 
-		unordered_map<string, shared_ptr<CRNode>> nodesMap;
+		unordered_map<uint64_t, shared_ptr<CRNode>> nodesMap;
 		vector<shared_ptr<CRNode>> nodesList;
 
 		// create/copy nodes
 		this->root->traverse([&nodesMap, &nodesList](Node* node){
 			auto crnode = make_shared<CRNode>();
-			crnode->name = node->name;
+			crnode->key = node->key;
 			crnode->node = node;
-			crnode->children.resize(node->children.size());
 
 			nodesList.push_back(crnode);
-			nodesMap[crnode->name] = crnode;
+			nodesMap[crnode->key] = crnode;
 		});
 
 		// establish hierarchy
 		for(auto crnode : nodesList){
 
-			string parentName = crnode->name.substr(0, crnode->name.size() - 1);
+			uint64_t parentKey = crnode->key >> 3;
 
-			if(parentName != ""){
-				auto parent = nodesMap[parentName];
-				int index = crnode->name.at(crnode->name.size() - 1) - '0';
+			if(parentKey != 0){
+				auto parent = nodesMap[parentKey];
+				int index = crnode->key & 0b111;
 
 				parent->children[index] = crnode;
 			}
@@ -230,14 +267,14 @@ namespace indexer{
 
 		// mark/flag/insert flushed chunk roots
 		for(auto fcr : flushedChunkRoots){
-			auto node = nodesMap[fcr.node->name];
+			auto node = nodesMap[fcr.node->key];
 			
 			node->fcrs.push_back(fcr);
 			node->numPoints += fcr.node->numPoints;
 		}
 
 		// recursively merge leaves if sum(points) < threshold
-		auto cr_root = nodesMap["r"];
+		auto cr_root = nodesMap[1];
 		static int64_t threshold = 5'000'000;
 
 		cr_root->traversePost([](CRNode* node){
@@ -287,11 +324,11 @@ namespace indexer{
 		logger::INFO("start reloadChunkRoots");
 
 		struct LoadTask {
-			shared_ptr<Node> node;
+			Node* node;
 			int64_t offset;
 			int64_t size;
 
-			LoadTask(shared_ptr<Node> node, int64_t offset, int64_t size) {
+			LoadTask(Node* node, int64_t offset, int64_t size) {
 				this->node = node;
 				this->offset = offset;
 				this->size = size;
@@ -302,7 +339,7 @@ namespace indexer{
 		TaskPool<LoadTask> pool(16, [targetDir](shared_ptr<LoadTask> task) {
 			string octreePath = targetDir + "/tmpChunkRoots.bin";
 
-			shared_ptr<Node> node = task->node;
+			Node* node = task->node;
 			int64_t start = task->offset;
 			int64_t size = task->size;
 
@@ -322,34 +359,6 @@ namespace indexer{
 		logger::INFO("end reloadChunkRoots");
 	}
 
-	void Indexer::waitUntilWriterBacklogBelow(int maxMegabytes) {
-		using namespace std::chrono_literals;
-
-		while (true) {
-			auto backlog = writer->backlogSizeMB();
-
-			if (backlog > maxMegabytes) {
-				std::this_thread::sleep_for(10ms);
-			} else {
-				break;
-			}
-		}
-	}
-
-	void Indexer::waitUntilMemoryBelow(int maxMegabytes) {
-		using namespace std::chrono_literals;
-
-		while (true) {
-			auto memoryData = getMemoryData();
-			auto usedMemoryMB = memoryData.virtual_usedByProcess / (1024 * 1024);
-
-			if (usedMemoryMB > maxMegabytes) {
-				std::this_thread::sleep_for(10ms);
-			} else {
-				break;
-			}
-		}
-	}
 
 string Indexer::createMetadata(Options options, State& state, Hierarchy hierarchy) {
 
@@ -527,10 +536,10 @@ HierarchyChunk Indexer::gatherChunk(Node* start, int levels) {
 	// create vector containing start node and all descendants up to and including levels deeper
 	// e.g. start 0 and levels 5 -> all nodes from level 0 to inclusive 5.
 
-	int64_t startLevel = start->name.size() - 1;
+	int64_t startLevel = start->level();
 
 	HierarchyChunk chunk;
-	chunk.name = start->name;
+	chunk.name = start->name();
 
 	vector<Node*> stack = { start };
 	while (!stack.empty()) {
@@ -539,15 +548,11 @@ HierarchyChunk Indexer::gatherChunk(Node* start, int levels) {
 
 		chunk.nodes.push_back(node);
 
-		int64_t childLevel = node->name.size();
+		int64_t childLevel = node->level() + 1;
 		if (childLevel <= startLevel + levels) {
 
-			for (auto child : node->children) {
-				if (child == nullptr) {
-					continue;
-				}
-
-				stack.push_back(child.get());
+			for (int64_t i = 0; i < node->numChildren(); i++) {
+				stack.push_back(node->children[i]);
 			}
 
 		}
@@ -590,7 +595,7 @@ Hierarchy Indexer::createHierarchy(string path) {
 		return chunk.nodes.size() * bytesPerNode;
 	};
 
-	auto chunks = createHierarchyChunks(root.get(), hierarchyStepSize);
+	auto chunks = createHierarchyChunks(root, hierarchyStepSize);
 
 	// string dbgChunksPath = path + "/../dbg_chunks";
 	// fs::create_directories(dbgChunksPath);
@@ -646,7 +651,7 @@ Hierarchy Indexer::createHierarchy(string path) {
 			uint8_t type = node->isLeaf() ? TYPE::LEAF : TYPE::NORMAL;
 
 			if (isProxy) {
-				int targetChunkIndex = chunkPointers[node->name];
+				int targetChunkIndex = chunkPointers[node->name()];
 				auto targetChunk = chunks[targetChunkIndex];
 
 				type = TYPE::PROXY;
@@ -820,7 +825,12 @@ vector<NodeCandidate> createNodes(vector<vector<int64_t>>& pyramid) {
 // 2. Hierarchy from counter grid
 // 3. identify nodes that need further refinment
 // 4. Recursively repeat at 1. for identified nodes
-void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int64_t numPoints, int64_t depth = 0) {
+// 
+// Points are sorted from <points> into <scratch>, and the nodes are views of the sorted points.
+// Nodes that are refined are sorted back into the same range of <points>, which isn't used by anything else, 
+// so the whole hierarchy uses the memory of <points> and <scratch>, without copying the points of the nodes.
+// New nodes are allocated in <arena>.
+void buildHierarchy(Indexer* indexer, NodeArena& arena, Node* node, shared_ptr<Buffer> points, int64_t numPoints, int64_t depth = 0, shared_ptr<Buffer> scratch = nullptr) {
 
 	if (numPoints < maxPointsPerChunk) {
 		Node* realization = node;
@@ -848,39 +858,59 @@ void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int
 
 	//vector<int32_t> dbg(pointBuffer->data_i32, pointBuffer->data_i32 + 10);
 
-	auto gridIndexOf = [&points, bpp, scale, offset, min, size, counterGridSize](int64_t pointIndex) {
-
-		int64_t pointOffset = pointIndex * bpp;
-		int32_t* xyz = reinterpret_cast<int32_t*>(points->data_u8 + pointOffset);
-
-		double x = (xyz[0] * scale.x) + offset.x;
-		double y = (xyz[1] * scale.y) + offset.y;
-		double z = (xyz[2] * scale.z) + offset.z;
+	grid_kernels::CellGrid cellGrid;
+	cellGrid.scale = scale;
+	cellGrid.offset = offset;
+	cellGrid.min = min;
+	cellGrid.size = size;
+	cellGrid.gridSize = counterGridSize;
+
+	// the points are counted and distributed in blocks, in parallel.
+	// Within each cell, points of earlier blocks come first, so the sort is stable.
+	// Blocks have at least 256k points, so that the counters of each block are small compared to its points.
+	int64_t minPointsPerBlock = 256 * 1024;
+	int64_t numBlocks = std::clamp(numPoints / minPointsPerBlock, int64_t(1), int64_t(numSampleThreads()));
+	int64_t pointsPerBlock = (numPoints + numBlocks - 1) / numBlocks;
+	int64_t numCells = counters.size();
+
+	vector<int64_t> blocks(numBlocks);
+	std::iota(blocks.begin(), blocks.end(), 0);
+
+	auto blockRange = [numPoints, pointsPerBlock](int64_t block) {
+		int64_t first = block * pointsPerBlock;
+		int64_t last = std::min(first + pointsPerBlock, numPoints);
+
+		return std::pair<int64_t, int64_t>(first, last);
+	};
 
-		int64_t ix = double(counterGridSize) * (x - min.x) / size.x;
-		int64_t iy = double(counterGridSize) * (y - min.y) / size.y;
-		int64_t iz = double(counterGridSize) * (z - min.z) / size.z;
+	// morton-ordered cell of each point
+	vector<int64_t> indices(numPoints);
 
-		ix = std::max(int64_t(0), std::min(ix, counterGridSize - 1));
-		iy = std::max(int64_t(0), std::min(iy, counterGridSize - 1));
-		iz = std::max(int64_t(0), std::min(iz, counterGridSize - 1));
+	// COUNTING
+	vector<int64_t> blockCounters(numBlocks * numCells, 0);
+	std::for_each(std::execution::par, blocks.begin(), blocks.end(), [&](int64_t block) {
+		auto [first, last] = blockRange(block);
+		int64_t* blockCounter = blockCounters.data() + block * numCells;
 
-		int64_t index = mortonEncode_magicbits(iz, iy, ix);
+		grid_kernels::computeMortonIndices(points->data_u8 + first * bpp, bpp, last - first, cellGrid, indices.data() + first);
 
-		return index;
-	};
+		for (int64_t i = first; i < last; i++) {
+			blockCounter[indices[i]]++;
+		}
+	});
 
-	// COUNTING
-	for (int64_t i = 0; i < numPoints; i++) {
-		auto index = gridIndexOf(i);
-		counters[index]++;
+	// offset of each block within each cell
+	vector<int64_t> blockOffsets(numBlocks * numCells, 0);
+	int64_t cellOffset = 0;
+	for (int64_t cell = 0; cell < numCells; cell++) {
+		for (int64_t block = 0; block < numBlocks; block++) {
+			blockOffsets[block * numCells + cell] = cellOffset;
+			cellOffset += blockCounters[block * numCells + cell];
+			counters[cell] += blockCounters[block * numCells + cell];
+		}
 	}
 
 	{ // DISTRIBUTING
-		vector<int64_t> offsets(counters.size(), 0);
-		for (int64_t i = 1; i < counters.size(); i++) {
-			offsets[i] = offsets[i - 1] + counters[i - 1];
-		}
 
 		if(numPoints * bpp < 0){
 			stringstream ss;
@@ -888,7 +918,7 @@ void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int
 			auto size = numPoints * bpp;
 			ss << "invalid call to malloc(" << to_string(size) << ")\n";
 			ss << "in function buildHierarchy()\n";
-			ss << "node: " << node->name << "\n";
+			ss << "node: " << node->name() << "\n";
 			ss << "#points: " << node->numPoints<< "\n";
 			ss << "min: " << node->min.toString() << "\n";
 			ss << "max: " << node->max.toString() << "\n";
@@ -896,72 +926,87 @@ void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int
 			logger::ERROR(ss.str());
 		}
 
-		Buffer tmp(numPoints * bpp);
+		if (scratch == nullptr) {
+			scratch = make_shared<Buffer>(numPoints * bpp);
+		}
 
-		for (int64_t i = 0; i < numPoints; i++) {
-			auto index = gridIndexOf(i);
-			auto targetIndex = offsets[index]++;
+		std::for_each(std::execution::par, blocks.begin(), blocks.end(), [&](int64_t block) {
+			auto [first, last] = blockRange(block);
+			int64_t* offsets = blockOffsets.data() + block * numCells;
 
-			memcpy(tmp.data_u8 + targetIndex * bpp, points->data_u8 + i * bpp, bpp);
-		}
+			for (int64_t i = first; i < last; i++) {
+				auto targetIndex = offsets[indices[i]]++;
 
-		memcpy(points->data, tmp.data, numPoints * bpp);
+				memcpy(scratch->data_u8 + targetIndex * bpp, points->data_u8 + i * bpp, bpp);
+			}
+		});
 	}
 
 	auto pyramid = createSumPyramid(counters, counterGridSize);
 
 	auto nodes = createNodes(pyramid);
 
-	auto expandTo = [node](NodeCandidate& candidate) {
+	auto expandTo = [node, &arena](NodeCandidate& candidate) {
 
-		string startName = node->name;
-		string fullName = startName + candidate.name;
-
-		// e.g. startName: r, fullName: r031
-		// start iteration with char at index 1: "0"
+		// candidate names are relative to <node>
+		// e.g. node: r, candidate: 031 -> r0, r03, r031
+		// candidates below <maxNodeLevel> end up in their ancestor at that level, since keys can't encode deeper nodes
 
 		Node* currentNode = node;
-		for (int64_t i = startName.size(); i < fullName.size(); i++) {
-			int64_t index = fullName.at(i) - '0';
+		for (int64_t i = 0; i < int64_t(candidate.name.size()); i++) {
+			if (currentNode->level() >= maxNodeLevel) {
+				break;
+			}
 
-			if (currentNode->children[index] == nullptr) {
+			int64_t index = candidate.name.at(i) - '0';
+
+			Node* child = currentNode->child(index);
+
+			if (child == nullptr) {
 				auto childBox = childBoundingBoxOf(currentNode->min, currentNode->max, index);
-				string childName = currentNode->name + to_string(index);
 
-				shared_ptr<Node> child = make_shared<Node>();
-				child->min = childBox.min;
-				child->max = childBox.max;
-				child->name = childName;
-				child->children.resize(8);
+				child = arena.create(childKeyOf(currentNode->key, index), childBox.min, childBox.max);
 
-				currentNode->children[index] = child;
-				currentNode = child.get();
-			} else {
-				currentNode = currentNode->children[index].get();
+				currentNode->addChild(arena, index, child);
 			}
 
-			
+			currentNode = child;
 		}
 
 		return currentNode;
 	};
 
+	vector<Node*> realizations;
+	for (NodeCandidate& candidate : nodes) {
+
+		Node* realization = expandTo(candidate);
+
+		bool isMerged = realization->level() >= maxNodeLevel && realization->numPoints > 0;
+		if (isMerged) {
+			// the ranges of all candidates below a node are adjacent in <scratch>
+			realization->indexStart = std::min(realization->indexStart, candidate.indexStart);
+			realization->numPoints += candidate.numPoints;
+		} else {
+			realization->indexStart = candidate.indexStart;
+			realization->numPoints = candidate.numPoints;
+
+			realizations.push_back(realization);
+		}
+	}
+
 	vector<Node*> needRefinement;
 
 	int64_t octreeDepth = 0;
-	for (NodeCandidate& candidate : nodes) {
+	for (Node* realization : realizations) {
 
-		Node* realization = expandTo(candidate);
-		realization->indexStart = candidate.indexStart;
-		realization->numPoints = candidate.numPoints;
-		int64_t bytes = candidate.numPoints * bpp;
+		int64_t bytes = realization->numPoints * bpp;
 
 		if (bytes < 0) {
 			stringstream ss;
 
 			ss << "invalid call to malloc(" << to_string(bytes) << ")\n";
 			ss << "in function buildHierarchy()\n";
-			ss << "node: " << node->name << "\n";
+			ss << "node: " << node->name() << "\n";
 			ss << "#points: " << node->numPoints << "\n";
 			ss << "min: " << node->min.toString() << "\n";
 			ss << "max: " << node->max.toString() << "\n";
@@ -969,16 +1014,17 @@ void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int
 			logger::ERROR(ss.str());
 		}
 
-		auto buffer = make_shared<Buffer>(bytes);
-		memcpy(buffer->data,
-			points->data_u8 + candidate.indexStart * bpp,
-			candidate.numPoints * bpp
-		);
-
-		realization->points = buffer;
+		realization->points = Buffer::view(scratch, realization->indexStart * bpp, bytes);
 
-		if (realization->numPoints > maxPointsPerChunk) {
+		if (realization->numPoints > maxPointsPerChunk && realization->level() < maxNodeLevel) {
 			needRefinement.push_back(realization);
+		} else if (realization->numPoints > maxPointsPerChunk) {
+			stringstream ss;
+			ss << "node " << realization->name() << " reached the maximum depth of " << maxNodeLevel << " levels. ";
+			ss << "It's kept as a leaf with " << realization->numPoints << " points. ";
+			ss << "min: " << realization->min.toString() << ", max: " << realization->max.toString();
+
+			logger::WARN(ss.str());
 		}
 
 		octreeDepth = std::max(octreeDepth, realization->level());
@@ -1002,29 +1048,11 @@ void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int
 		if (subject->numPoints == numPoints) {
 			// the subsplit has the same number of points than the input -> ERROR
 
-			unordered_map<string, int> counters;
-
 			auto bpp = attributes.bytes;
 
-			for (int64_t i = 0; i < numPoints; i++) {
-
-				int64_t sourceOffset = i * bpp;
-
-				int32_t X, Y, Z;
-				memcpy(&X, buffer->data_u8 + sourceOffset + 0, 4);
-				memcpy(&Y, buffer->data_u8 + sourceOffset + 4, 4);
-				memcpy(&Z, buffer->data_u8 + sourceOffset + 8, 4);
-
-				stringstream ss;
-				ss << X << ", " << Y << ", " << Z;
-
-				string key = ss.str();
-				counters[key]++;
-			}
-
 			int64_t numPointsInBox = subject->numPoints;
-			int64_t numUniquePoints = counters.size();
-			int64_t numDuplicates = numPointsInBox - numUniquePoints;
+			int64_t numDuplicates = point_dedup::countDuplicates(buffer->data_u8, numPoints, bpp);
+			int64_t numUniquePoints = numPointsInBox - numDuplicates;
 
 			if (numDuplicates < maxPointsPerChunk / 2) {
 				// few uniques, just unfavouribly distributed points
@@ -1041,56 +1069,23 @@ void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int
 
 				// remove the duplicates, then try again
 
-				vector<int64_t> distinct;
-				unordered_map<string, int> handled;
-
-				auto contains = [](auto const & map, auto const & key) {
-					return map.find(key) != map.end();
-				};
-
-				for (int64_t i = 0; i < numPoints; i++) {
-
-					int64_t sourceOffset = i * bpp;
-
-					int32_t X, Y, Z;
-					memcpy(&X, buffer->data_u8 + sourceOffset + 0, 4);
-					memcpy(&Y, buffer->data_u8 + sourceOffset + 4, 4);
-					memcpy(&Z, buffer->data_u8 + sourceOffset + 8, 4);
-
-					stringstream ss;
-					ss << X << ", " << Y << ", " << Z;
-
-					string key = ss.str();
-					
-					if (contains(counters, key)) {
-						if (!contains(handled, key)) {
-							distinct.push_back(i);
-							handled[key] = true;
-						}
-					} else {
-						distinct.push_back(i);
-					}
-
-				}
-
-				//cout << "#distinct: " << distinct.size() << endl;
-
 				stringstream msg;
 				msg << "Too many duplicate points were encountered. #points: " << subject->numPoints;
-				msg << ", #unique points: " << distinct.size() << endl;
+				msg << ", #unique points: " << numUniquePoints << endl;
 				msg << "Duplicates inside node will be dropped! ";
 				msg << "min: " << subject->min.toString() << ", max: " << subject->max.toString();
 
 				logger::WARN(msg.str());
 
-				shared_ptr<Buffer> distinctBuffer = make_shared<Buffer>(distinct.size() * bpp);
+				// compact the distinct points in place, so that they remain in the subject's range of <scratch>
+				subject->points = nullptr;
+				auto target = Buffer::writable(buffer);
 
-				for(int64_t i = 0; i < distinct.size(); i++){
-					distinctBuffer->write(buffer->data_u8 + i * bpp, bpp);
-				}
+				int64_t numDistinct = point_dedup::removeDuplicates(target->data_u8, numPoints, bpp);
+				indexer->numDuplicatesDropped += numPoints - numDistinct;
 
-				subject->points = distinctBuffer;
-				subject->numPoints = distinct.size();
+				subject->points = Buffer::view(target, 0, numDistinct * bpp);
+				subject->numPoints = numDistinct;
 
 				// try again
 				nodeIndex--;
@@ -1103,7 +1098,14 @@ void buildHierarchy(Indexer* indexer, Node* node, shared_ptr<Buffer> points, int
 		subject->points = nullptr;
 		subject->numPoints = 0;
 
-		buildHierarchy(indexer, subject, buffer, nextNumPoins, depth + 1);
+		// the range of the subject's points in <points> is free since they were sorted into <scratch>
+		shared_ptr<Buffer> nextScratch = nullptr;
+		if (buffer != nullptr) {
+			int64_t offset = buffer->data_u8 - scratch->data_u8;
+			nextScratch = Buffer::view(points, offset, buffer->size);
+		}
+
+		buildHierarchy(indexer, arena, subject, buffer, nextNumPoins, depth + 1, nextScratch);
 	}
 
 }
@@ -1385,14 +1387,13 @@ shared_ptr<Buffer> compress(Node* node, Attributes attributes) {
 
 		if (success == BROTLI_FALSE) {
 			stringstream ss;
-			ss << "failed to compress node " << node->name << ". aborting conversion." ;
+			ss << "failed to compress node " << node->name() << ". aborting conversion." ;
 			logger::ERROR(ss.str());
 
 			exit(123);
 		}
 
-		out = make_shared<Buffer>(encoded_size);
-		memcpy(out->data, encoded_buffer, encoded_size);
+		out = Buffer::view(outputBuffer, 0, encoded_size);
 		
 		//{ // DEBUG
 		//	lock_guard<mutex> lock(mtx_dbg_compress);
@@ -1476,7 +1477,7 @@ void Writer::writeAndUnload(Node* node) {
 
 			ss << "invalid call to malloc(" << to_string(size) << ")\n";
 			ss << "in function writeAndUnload()\n";
-			ss << "node: " << node->name << "\n";
+			ss << "node: " << node->name() << "\n";
 			ss << "#points: " << node->numPoints << "\n";
 			ss << "min: " << node->min.toString() << "\n";
 			ss << "max: " << node->max.toString() << "\n";
@@ -1487,30 +1488,42 @@ void Writer::writeAndUnload(Node* node) {
 
 	shared_ptr<Buffer> buffer = nullptr;
 	int64_t targetOffset = 0;
+	bool isBacklogAdded = false;
 	{
 		lock_guard<mutex> lock(mtx);
 
 		int64_t byteOffset = indexer->byteOffset.fetch_add(byteSize);
 		node->byteOffset = byteOffset;
 
+		// buffers are claimed from the memory governor until they're written. 
+		// Chunks wait for their reservation while the backlog is large.
 		if (activeBuffer == nullptr) {
 			errorCheck(capacity);
 			activeBuffer = make_shared<Buffer>(capacity);
+			memoryGovernor.claim(capacity);
 		} else if (activeBuffer->pos + byteSize > capacity) {
 			backlog.push_back(activeBuffer);
+			isBacklogAdded = true;
 
 			capacity = std::max(capacity, byteSize);
 			errorCheck(capacity);
 			activeBuffer = make_shared<Buffer>(capacity);
+			memoryGovernor.claim(capacity);
 		}
 
 		buffer = activeBuffer;
 		targetOffset = activeBuffer->pos;
 
 		activeBuffer->pos += byteSize;
-	}	
 
-	memcpy(buffer->data_char + targetOffset, sourceBuffer->data, byteSize);
+		// copy before releasing the lock, otherwise another thread may move the buffer
+		// to the backlog and the writer thread may write it before the copy is done.
+		memcpy(buffer->data_char + targetOffset, sourceBuffer->data, byteSize);
+	}
+
+	if (isBacklogAdded) {
+		cvBacklog.notify_one();
+	}
 
 	node->points = nullptr;
 }
@@ -1523,50 +1536,56 @@ void Writer::launchWriterThread() {
 			shared_ptr<Buffer> buffer = nullptr;
 
 			{
-				lock_guard<mutex> lock(mtx);
+				unique_lock<mutex> lock(mtx);
+
+				cvBacklog.wait(lock, [&]() {
+					return backlog.size() > 0 || closeRequested;
+				});
 
-				if (backlog.size() > 0) {
-					buffer = backlog.front();
-					backlog.pop_front();
-				} else if (backlog.size() == 0 && closeRequested) {
+				if (backlog.size() == 0) {
 					// DONE! No more work and close requested. quit thread.
+					closed = true;
 
 					cvClose.notify_one();
 
 					break;
 				}
+
+				buffer = backlog.front();
+				backlog.pop_front();
 			}
 
-			if (buffer != nullptr) {
-				int64_t numBytes = buffer->pos;
-				indexer->bytesWritten += numBytes;
-				indexer->bytesToWrite -= numBytes;
+			int64_t numBytes = buffer->pos;
+			indexer->bytesWritten += numBytes;
+			indexer->bytesToWrite -= numBytes;
 
-				fsOctree.write(buffer->data_char, numBytes);
+			fsOctree.write(buffer->data_char, numBytes);
 
-				indexer->bytesInMemory -= numBytes;
-			} else {
-				using namespace std::chrono_literals;
-				std::this_thread::sleep_for(10ms);
-			}
-			
+			indexer->bytesInMemory -= numBytes;
+			memoryGovernor.unclaim(buffer->size);
 		}
 
 	}).detach();
 }
 
 void Writer::closeAndWait() {
-	if (closed) {
+	unique_lock<mutex> lock(mtx);
+
+	if (closeRequested) {
 		return;
 	}
 
-	unique_lock<mutex> lock(mtx);
 	if (activeBuffer != nullptr) {
 		backlog.push_back(activeBuffer);
 	}
 
 	closeRequested = true;
-	cvClose.wait(lock);
+	cvBacklog.notify_one();
+
+	// the writer thread sets <closed> once the backlog is written
+	cvClose.wait(lock, [&]() {
+		return closed;
+	});
 
 	fsOctree.close();
 
@@ -1578,7 +1597,107 @@ void Writer::closeAndWait() {
 
 
 
-void doIndexing(string targetDir, State& state, Options& options, Sampler& sampler) {
+// reads the points of a chunk, and decodes them if the chunk is compressed.
+// Chunks that were kept in memory are handed over, and released by the chunk.
+shared_ptr<Buffer> loadChunk(shared_ptr<Chunk> chunk, int64_t bytesPerPoint) {
+
+	if (chunk->points) {
+		auto points = chunk->points;
+		chunk->points = nullptr;
+
+		return points;
+	}
+
+	auto pointBuffer = make_shared<Buffer>(chunk->size);
+
+	if (chunk->blocks.size() == 0) {
+		readBinaryFile(chunk->file, chunk->offset, chunk->size, pointBuffer->data);
+
+		return pointBuffer;
+	}
+
+	int64_t numPointsLoaded = 0;
+	for (auto& block : chunk->blocks) {
+		auto encoded = readBinaryFile(chunk->file, block.offset, block.size);
+		uint8_t* target = pointBuffer->data_u8 + numPointsLoaded * bytesPerPoint;
+
+		chunk_codec::decode(encoded.data(), encoded.size(), block.numPoints, bytesPerPoint, target);
+
+		numPointsLoaded += block.numPoints;
+	}
+
+	return pointBuffer;
+}
+
+// distributes the points of a chunk to its octants, which are then indexed as separate chunks.
+// Points keep their order within each octant.
+// Returns no parts if all points are in the same octant, since splitting would not make progress.
+vector<shared_ptr<Chunk>> splitChunk(shared_ptr<Chunk> chunk, shared_ptr<Buffer> points, Attributes& attributes) {
+
+	int64_t bpp = attributes.bytes;
+	int64_t numPoints = points->size / bpp;
+
+	grid_kernels::CellGrid cellGrid;
+	cellGrid.scale = attributes.posScale;
+	cellGrid.offset = attributes.posOffset;
+	cellGrid.min = chunk->min;
+	cellGrid.size = chunk->max - chunk->min;
+	cellGrid.gridSize = 2;
+
+	// with a 2x2x2 grid, morton indices are child indices
+	vector<int64_t> octants(numPoints);
+	grid_kernels::computeMortonIndices(points->data_u8, bpp, numPoints, cellGrid, octants.data());
+
+	vector<int64_t> counters(8, 0);
+	for (int64_t i = 0; i < numPoints; i++) {
+		counters[octants[i]]++;
+	}
+
+	int64_t numNonEmptyParts = std::count_if(counters.begin(), counters.end(), [](int64_t counter) { return counter > 0; });
+	if (numNonEmptyParts < 2) {
+		return {};
+	}
+
+	vector<shared_ptr<Chunk>> parts(8, nullptr);
+	for (int i = 0; i < 8; i++) {
+		if (counters[i] == 0) {
+			continue;
+		}
+
+		auto box = childBoundingBoxOf(chunk->min, chunk->max, i);
+
+		auto part = make_shared<Chunk>();
+		part->id = chunk->id + to_string(i);
+		part->min = box.min;
+		part->max = box.max;
+		part->size = counters[i] * bpp;
+		part->numPoints = counters[i];
+		part->points = make_shared<Buffer>(part->size);
+
+		parts[i] = part;
+	}
+
+	vector<int64_t> cursors(8, 0);
+	for (int64_t i = 0; i < numPoints; i++) {
+		int64_t octant = octants[i];
+		uint8_t* target = parts[octant]->points->data_u8 + cursors[octant] * bpp;
+
+		memcpy(target, points->data_u8 + i * bpp, bpp);
+
+		cursors[octant]++;
+	}
+
+	vector<shared_ptr<Chunk>> nonEmptyParts;
+	for (auto part : parts) {
+		if (part != nullptr) {
+			nonEmptyParts.push_back(part);
+		}
+	}
+
+	return nonEmptyParts;
+}
+
+void doIndexing(string targetDir, State& state, Options& options, Sampler& sampler, shared_ptr<ResidentChunks> residentChunks) {
 
 	cout << endl;
 	cout << "=======================================" << endl;
@@ -1593,13 +1712,14 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 	state.bytesProcessed = 0;
 	state.duration = 0;
 
-	auto chunks = getChunks(targetDir);
+	auto chunks = getChunks(targetDir, residentChunks);
+
 	auto attributes = chunks->attributes;
 
 	Indexer indexer(targetDir);
 	indexer.options = options;
 	indexer.attributes = attributes;
-	indexer.root = make_shared<Node>("r", chunks->min, chunks->max);
+	indexer.root = indexer.createNode(1, chunks->min, chunks->max);
 	indexer.spacing = (chunks->max - chunks->min).x / 128.0;
 
 	auto onNodeCompleted = [&indexer](Node* node) {
@@ -1620,9 +1740,8 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 	int64_t totalPoints = 0;
 	int64_t totalBytes = 0;
 	for (auto chunk : chunks->list) {
-		auto filesize = fs::file_size(chunk->file);
-		totalPoints += filesize / attributes.bytes;
-		totalBytes += filesize;
+		totalPoints += chunk->size / attributes.bytes;
+		totalBytes += chunk->size;
 	}
 
 	int64_t pointsProcessed = 0;
@@ -1634,19 +1753,28 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 
 	atomic_int64_t activeThreads = 0;
 	mutex mtx_nodes;
-	vector<shared_ptr<Node>> nodes;
+	vector<Node*> nodes;
+
+	// the tail of the phase starts when a thread finishes a chunk and no queued chunks are left
+	double tTailStart = 0.0;
+	int64_t numSplitChunks = 0;
+
 	int numThreads = numSampleThreads() + 4;
-	TaskPool<Task> pool(numThreads, [&onNodeCompleted, &onNodeDiscarded, &writeAndUnload, &state, &options, &activeThreads, tStart, &lastReport, &totalPoints, totalBytes, &pointsProcessed, chunks, &indexer, &nodes, &mtx_nodes, &sampler](auto task) {
+	TaskPool<Task> pool(numThreads, [&onNodeCompleted, &onNodeDiscarded, &writeAndUnload, &state, &options, &activeThreads, tStart, &lastReport, &totalPoints, totalBytes, &pointsProcessed, chunks, &indexer, &nodes, &mtx_nodes, &sampler, &pool, &tTailStart, &numSplitChunks](auto task) {
 		
 		auto chunk = task->chunk;
-		auto chunkRoot = make_shared<Node>(chunk->id, chunk->min, chunk->max);
 		auto attributes = chunks->attributes;
 		int64_t bpp = attributes.bytes;
 
-		indexer.waitUntilWriterBacklogBelow(1'000);
-		activeThreads++;
+		// the points, the sorted copy and morton codes of buildHierarchy, and the sampler's scratch space.
+		// Resident chunks were already claimed by the chunker.
+		int64_t filesize = chunk->size;
+		int64_t workingSet = 2 * filesize + (filesize / bpp) * (8 + sampler.scratchBytesPerPoint());
+		bool isResident = chunk->points != nullptr;
+		int64_t reservation = isResident ? workingSet - filesize : workingSet;
 
-		auto filesize = fs::file_size(chunk->file);
+		memoryGovernor.reserve(reservation);
+		activeThreads++;
 
 		stringstream msg;
 		msg << "start indexing chunk " + chunk->id << "\n";
@@ -1655,32 +1783,89 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 		msg << "max: " << chunk->max.toString();
 		logger::INFO(msg.str());
 
-		indexer.bytesInMemory += filesize;
-		auto pointBuffer = readBinaryFile(chunk->file);
+		auto pointBuffer = loadChunk(chunk, attributes.bytes);
 
 		auto tStartChunking = now();
 
-		if (!options.keepChunks) {
+		// a shared chunk file is deleted once all chunks are indexed
+		if (!options.keepChunks && chunks->file.empty() && !isResident) {
 			fs::remove(chunk->file);
 		}
 
 		int64_t numPoints = pointBuffer->size / bpp;
 
-		buildHierarchy(&indexer, chunkRoot.get(), pointBuffer, numPoints);
+		// split large chunks if the other threads would otherwise run out of chunks.
+		// The parts are kept in memory and indexed by whichever threads are free.
+		// Chunks that are already deep, or whose points are all in one octant, are indexed as they are.
+		int64_t chunkLevel = chunk->id.size() - 1;
+		bool isSplitCandidate = numPoints >= minPointsToSplitChunk
+			&& chunkLevel < maxSplitChunkLevel
+			&& pool.numTasksQueued() < numSampleThreads();
+
+		vector<shared_ptr<Chunk>> parts;
+		if (isSplitCandidate) {
+			parts = splitChunk(chunk, pointBuffer, attributes);
+		}
+
+		if (parts.size() > 1) {
+			pointBuffer = nullptr;
+
+			{
+				lock_guard<mutex> lock(mtx_nodes);
+
+				tTailStart = 0.0;
+				numSplitChunks++;
+			}
+
+			for (auto part : parts) {
+				memoryGovernor.claim(part->size);
+				pool.addTask(make_shared<Task>(part), part->cost());
+			}
+
+			logger::INFO("split chunk " + chunk->id + " into " + to_string(parts.size()) + " parts");
+
+			memoryGovernor.release(reservation);
+			if (isResident) {
+				memoryGovernor.unclaim(filesize);
+			}
+
+			activeThreads--;
+
+			return;
+		}
+
+		indexer.bytesInMemory += filesize;
+
+		// points with the same position are always in the same chunk, so this removes all duplicates
+		int64_t numDistinct = numPoints;
+		if (options.removeDuplicates) {
+			auto points = Buffer::writable(pointBuffer);
+			numDistinct = point_dedup::removeDuplicates(points->data_u8, numPoints, bpp);
+
+			if (numDistinct < numPoints) {
+				indexer.numDuplicatesDropped += numPoints - numDistinct;
+				pointBuffer = Buffer::view(points, 0, numDistinct * bpp);
+			}
+		}
+
+		// the chunk root outlives the chunk, its descendants are released with <arena> once they're written
+		Node* chunkRoot = indexer.createNode(keyOfName(chunk->id), chunk->min, chunk->max);
+		chunkRoot->isChunkRoot = true;
+		NodeArena arena;
+
+		buildHierarchy(&indexer, arena, chunkRoot, pointBuffer, numDistinct);
 
-		sampler.sample(chunkRoot.get(), attributes, indexer.spacing, onNodeCompleted, onNodeDiscarded);
+		// nodes keep the ranges of the chunk's buffers alive that they refer to
+		pointBuffer = nullptr;
+
+		sampler.sample(chunkRoot, attributes, indexer.spacing, onNodeCompleted, onNodeDiscarded);
 
 		// detach anything below the chunk root. Will be reloaded from
 		// temporarily flushed hierarchy during creation of the hierarchy file
-		chunkRoot->children.clear();
+		chunkRoot->clearChildren();
 
 		indexer.flushChunkRoot(chunkRoot);
 
-		// add chunk root, provided it isn't the root.
-		if (chunkRoot->name.size() > 1) {
-			indexer.root->addDescendant(chunkRoot);
-		}
-
 		lock_guard<mutex> lock(mtx_nodes);
 
 		pointsProcessed = pointsProcessed + numPoints;
@@ -1696,19 +1881,49 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 
 		nodes.push_back(chunkRoot);
 
+		if (tTailStart == 0.0 && pool.numTasksQueued() == 0) {
+			tTailStart = now();
+		}
+
 		logger::INFO("finished indexing chunk " + chunk->id);
 
+		memoryGovernor.release(reservation);
+		if (isResident) {
+			memoryGovernor.unclaim(filesize);
+		}
+
 		activeThreads--;
 	});
 
-	for (auto chunk : chunks->list) {
+	// largest chunks first, so that the phase doesn't end with a few threads indexing large chunks.
+	// The pool distributes them over its workers in turn and each worker takes the largest of its own queue,
+	// so the order only holds per worker. Since the chunks are dealt out in sorted order, 
+	// the workers' queues are balanced and the largest chunks are still started early.
+	auto sortedChunks = chunks->list;
+	std::stable_sort(sortedChunks.begin(), sortedChunks.end(), [](auto& a, auto& b) {
+		return a->cost() > b->cost();
+	});
+
+	for (auto chunk : sortedChunks) {
 		auto task = make_shared<Task>(chunk);
-		pool.addTask(task);
+		pool.addTask(task, chunk->cost());
 	}
 
 	pool.waitTillEmpty();
 	pool.close();
 
+	// add chunk roots, provided they aren't the root. 
+	// Chunks are done, so the nodes above them are created without locking.
+	for (Node* chunkRoot : nodes) {
+		if (chunkRoot->key != indexer.root->key) {
+			indexer.root->addDescendant(indexer.arena, chunkRoot);
+		}
+	}
+
+	double tailDuration = tTailStart == 0.0 ? 0.0 : now() - tTailStart;
+	state.values["duration(indexing tail)"] = formatNumber(tailDuration, 3);
+	state.values["split chunks"] = formatNumber(numSplitChunks);
+
 	indexer.fChunkRoots.close();
 
 	{ // process chunk roots in batches
@@ -1718,6 +1933,14 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 
 		for(auto& task : tasks){
 
+			int64_t taskBytes = 0;
+			for(auto& fcr : task.fcrs){
+				taskBytes += fcr.size;
+			}
+
+			int64_t workingSet = taskBytes + (taskBytes / attributes.bytes) * sampler.scratchBytesPerPoint();
+			memoryGovernor.reserve(workingSet);
+
 			for(auto& fcr : task.fcrs){
 				auto buffer = make_shared<Buffer>(fcr.size);
 				readBinaryFile(tmpChunkRootsPath, fcr.offset, fcr.size, buffer->data);
@@ -1727,22 +1950,24 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 
 			sampler.sample(task.node, attributes, indexer.spacing, onNodeCompleted, onNodeDiscarded);
 
-			task.node->children.clear();
+			task.node->clearChildren();
+
+			memoryGovernor.release(workingSet);
 		}
 	}
 
 
 	// sample up to root node
-	if (chunks->list.size() == 1) {
+	if (chunks->list.size() == 1 && nodes.size() == 1) {
 		auto node = nodes[0];
 
 		indexer.root = node;
 	} else if (!indexer.root->sampled){
-		sampler.sample(indexer.root.get(), attributes, indexer.spacing, onNodeCompleted, onNodeDiscarded);
+		sampler.sample(indexer.root, attributes, indexer.spacing, onNodeCompleted, onNodeDiscarded);
 	}
 
 	// root is automatically finished after subsampling all descendants
-	onNodeCompleted(indexer.root.get());
+	onNodeCompleted(indexer.root);
 
 	printElapsedTime("sampling", tStart);
 
@@ -1766,6 +1991,15 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 		.firstChunkSize = builder.batch_root->byteSize,
 	};
 
+	// the metadata lists the points that are in the octree
+	int64_t numDuplicatesDropped = indexer.numDuplicatesDropped;
+	state.pointsTotal -= numDuplicatesDropped;
+	state.values["duplicates dropped"] = formatNumber(numDuplicatesDropped);
+
+	if (numDuplicatesDropped > 0) {
+		logger::INFO("dropped " + formatNumber(numDuplicatesDropped) + " duplicate points");
+	}
+
 	string metadataPath = targetDir + "/metadata.json";
 	string metadata = indexer.createMetadata(options, state, hierarchy);
 	writeFile(metadataPath, metadata);
@@ -1779,6 +2013,10 @@ void doIndexing(string targetDir, State& state, Options& options, Sampler& sampl
 		if (!options.keepChunks) {
 			string chunksMetadataPath = targetDir + "/chunks/metadata.json";
 
+			if (!chunks->file.empty()) {
+				fs::remove(chunks->file);
+			}
+
 			fs::remove(chunksMetadataPath);
 			fs::remove(targetDir + "/chunks");
 		}
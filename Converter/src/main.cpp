@@ -13,6 +13,8 @@
 #include "PotreeConverter.h"
 #include "logger.h"
 #include "Monitor.h"
+#include "SourceCatalog.h"
+#include "MemoryGovernor.h"
 
 #include "arguments/Arguments.hpp"
 
@@ -27,13 +29,17 @@ Options parseArguments(int argc, char** argv) {
 	args.addArgument("encoding", "Encoding type \"BROTLI\", \"UNCOMPRESSED\" (default)");
 	args.addArgument("method,m", "Point sampling method \"poisson\", \"poisson_average\", \"random\"");
 	args.addArgument("chunkMethod", "Chunking method");
+	args.addArgument("max-memory", "Memory budget in MB. Defaults to 3/4 of the physical memory, or of the container's memory limit");
+	args.addArgument("chunk-compression", "Compression of temporary chunks \"ON\", \"OFF\", \"AUTO\" (default, if scratch space is short)");
 	args.addArgument("keep-chunks", "Skip deleting temporary chunks during conversion");
 	args.addArgument("no-chunking", "Disable chunking phase");
 	args.addArgument("no-indexing", "Disable indexing phase");
+	args.addArgument("remove-duplicates", "Drop points with the same coordinates as a previous point");
 	args.addArgument("attributes", "Attributes in output file");
 	args.addArgument("projection", "Add the projection of the pointcloud to the metadata");
 	args.addArgument("generate-page,p", "Generate a ready to use web page with the given name");
 	args.addArgument("title", "Page title used when generating a web page");
+	args.addArgument("catalog", "Sidecar file that caches the headers of the input files between conversions");
 
 	if (args.has("help")) {
 		cout << "PotreeConverter <source> -o <outdir>" << endl;
@@ -60,6 +66,8 @@ Options parseArguments(int argc, char** argv) {
 	string encoding = args.get("encoding").as<string>("DEFAULT");
 	string method = args.get("method").as<string>("poisson");
 	string chunkMethod = args.get("chunkMethod").as<string>("LASZIP");
+	string chunkCompression = args.get("chunk-compression").as<string>("AUTO");
+	double maxMemory = args.get("max-memory").as<double>(0.0);
 
 	string outdir = "";
 	if (args.has("outdir")) {
@@ -117,6 +125,8 @@ Options parseArguments(int argc, char** argv) {
 	bool keepChunks = args.has("keep-chunks");
 	bool noChunking = args.has("no-chunking");
 	bool noIndexing = args.has("no-indexing");
+	bool removeDuplicates = args.has("remove-duplicates");
+	string catalog = args.get("catalog").as<string>();
 
 	Options options;
 	options.source = source;
@@ -124,6 +134,8 @@ Options parseArguments(int argc, char** argv) {
 	options.method = method;
 	options.encoding = encoding;
 	options.chunkMethod = chunkMethod;
+	options.chunkCompression = chunkCompression;
+	options.maxMemory = maxMemory;
 	//options.flags = flags;
 	options.attributes = attributes;
 	options.generatePage = generatePage;
@@ -134,6 +146,8 @@ Options parseArguments(int argc, char** argv) {
 	options.keepChunks = keepChunks;
 	options.noChunking = noChunking;
 	options.noIndexing = noIndexing;
+	options.removeDuplicates = removeDuplicates;
+	options.catalog = catalog;
 
 	//cout << "flags: ";
 	//for (string flag : options.flags) {
@@ -148,7 +162,7 @@ struct Curated{
 	string name;
 	vector<Source> files;
 };
-Curated curateSources(vector<string> paths) {
+Curated curateSources(vector<string> paths, string catalogPath) {
 
 	string name = "";
 
@@ -176,29 +190,27 @@ Curated curateSources(vector<string> paths) {
 
 	cout << "#paths: " << paths.size() << endl;
 
-	vector<Source> sources;
-	sources.reserve(paths.size());
+	SourceCatalog catalog;
+	if (catalogPath.size() > 0) {
+		catalog = SourceCatalog::load(catalogPath);
+	}
 
-	mutex mtx;
-	auto parallel = std::execution::par;
-	for_each(parallel, paths.begin(), paths.end(), [&mtx, &sources](string path) {
+	catalog.update(paths);
 
-		auto header = loadLasHeader(path);
-		auto filesize = fs::file_size(path);
+	if (catalogPath.size() > 0) {
+		cout << "#headers parsed: " << catalog.numParsed << ", taken from catalog: " << (paths.size() - catalog.numParsed) << endl;
 
-		Vector3 min = { header.min.x, header.min.y, header.min.z };
-		Vector3 max = { header.max.x, header.max.y, header.max.z };
+		if (catalog.numParsed > 0) {
+			catalog.save(catalogPath);
+		}
+	}
 
-		Source source;
-		source.path = path;
-		source.min = min;
-		source.max = max;
-		source.numPoints = header.numPoints;
-		source.filesize = filesize;
+	vector<Source> sources;
+	sources.reserve(paths.size());
 
-		lock_guard<mutex> lock(mtx);
-		sources.push_back(source);
-	});
+	for (auto& path : paths) {
+		sources.push_back(catalog.createSource(path));
+	}
 
 	return {name, sources};
 }
@@ -342,15 +354,15 @@ Stats computeStats(vector<Source> sources){
 // }
 
 
-void chunking(Options& options, vector<Source>& sources, string targetDir, Stats& stats, State& state, Attributes outputAttributes, Monitor* monitor) {
+shared_ptr<ResidentChunks> chunking(Options& options, vector<Source>& sources, string targetDir, Stats& stats, State& state, Attributes outputAttributes, Monitor* monitor) {
 
 	if (options.noChunking) {
-		return;
+		return nullptr;
 	}
 
 	if (options.chunkMethod == "LASZIP") {
 
-		chunker_countsort_laszip::doChunking(sources, targetDir, stats.min, stats.max, state, outputAttributes, monitor);
+		return chunker_countsort_laszip::doChunking(sources, targetDir, stats.min, stats.max, state, outputAttributes, options, monitor);
 
 	} else if (options.chunkMethod == "LAS_CUSTOM") {
 
@@ -366,9 +378,11 @@ void chunking(Options& options, vector<Source>& sources, string targetDir, Stats
 		exit(123);
 
 	}
+
+	return nullptr;
 }
 
-void indexing(Options& options, string targetDir, State& state) {
+void indexing(Options& options, string targetDir, State& state, shared_ptr<ResidentChunks> residentChunks) {
 
 	if (options.noIndexing) {
 		return;
@@ -377,17 +391,17 @@ void indexing(Options& options, string targetDir, State& state) {
 	if (options.method == "random") {
 
 		SamplerRandom sampler;
-		indexer::doIndexing(targetDir, state, options, sampler);
+		indexer::doIndexing(targetDir, state, options, sampler, residentChunks);
 
 	} else if (options.method == "poisson") {
 
 		SamplerPoisson sampler;
-		indexer::doIndexing(targetDir, state, options, sampler);
+		indexer::doIndexing(targetDir, state, options, sampler, residentChunks);
 
 	} else if (options.method == "poisson_average") {
 
 		SamplerPoissonAverage sampler;
-		indexer::doIndexing(targetDir, state, options, sampler);
+		indexer::doIndexing(targetDir, state, options, sampler, residentChunks);
 
 	}
 }
@@ -514,14 +528,19 @@ int main(int argc, char** argv) {
 
 	auto exePath = fs::canonical(fs::absolute(argv[0])).parent_path().string();
 
-	launchMemoryChecker(2 * 1024, 0.1);
 	auto cpuData = getCpuData();
 
 	cout << "#threads: " << cpuData.numProcessors << endl;
 
 	auto options = parseArguments(argc, argv);
 
-	auto [name, sources] = curateSources(options.source);
+	int64_t memoryBudget = options.maxMemory > 0.0 
+		? int64_t(options.maxMemory * 1024.0 * 1024.0) 
+		: MemoryGovernor::getDefaultBudget();
+	memoryGovernor.setBudget(memoryBudget);
+	cout << "memory budget: " << formatNumber(double(memoryBudget) / (1024.0 * 1024.0)) << "MB" << endl;
+
+	auto [name, sources] = curateSources(options.source, options.catalog);
 	if (options.name.size() == 0) {
 		options.name = name;
 	}
@@ -546,6 +565,7 @@ int main(int argc, char** argv) {
 	State state;
 	state.pointsTotal = stats.totalPoints;
 	state.bytesProcessed = stats.totalBytes;
+	state.values["memory budget"] = formatNumber(double(memoryBudget) / (1024.0 * 1024.0)) + "MB";
 
 	// auto monitor = startMonitoring(state);
 	auto monitor = make_shared<Monitor>(&state);
@@ -554,14 +574,16 @@ int main(int argc, char** argv) {
 
 	{ // this is the real important stuff
 
-		chunking(options, sources, targetDir, stats, state, outputAttributes, monitor.get());
+		auto residentChunks = chunking(options, sources, targetDir, stats, state, outputAttributes, monitor.get());
 
-		indexing(options, targetDir, state);
+		indexing(options, targetDir, state, residentChunks);
 
 	}
 
 	monitor->stop();
 
+	state.values["memory reserved (peak)"] = formatNumber(double(memoryGovernor.peak) / (1024.0 * 1024.0)) + "MB";
+
 	createReport(options, sources, targetDir, stats, state, tStart);
 
 
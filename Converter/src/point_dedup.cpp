@@ -0,0 +1,98 @@
+
+#include "point_dedup.h"
+
+#include <cstring>
+#include <vector>
+#include <bit>
+
+using std::vector;
+
+namespace point_dedup {
+
+	inline uint64_t hashPosition(const uint8_t* point) {
+		uint32_t xyz[3];
+		memcpy(xyz, point, 12);
+
+		uint64_t hash = (uint64_t(xyz[0]) << 32) ^ (uint64_t(xyz[1]) << 16) ^ uint64_t(xyz[2]);
+		hash = hash * 0x9E37'79B9'7F4A'7C15ull;
+		hash = hash ^ (uint64_t(xyz[1]) * 0xC2B2'AE3D'27D4'EB4Full);
+		hash = hash ^ (hash >> 29);
+		hash = hash * 0xBF58'476D'1CE4'E5B9ull;
+		hash = hash ^ (hash >> 32);
+
+		return hash;
+	}
+
+	// calls onPoint(index, isDuplicate) for each point, in order.
+	// onPoint returns the index at which a point that isn't a duplicate can be found from then on.
+	template<typename Callback>
+	void visit(uint8_t* points, int64_t numPoints, int64_t bytesPerPoint, Callback onPoint) {
+
+		// slots hold the index + 1 of the first point of a position, 0 if empty.
+		// Chunks have far fewer than 2^32 points.
+		uint64_t numSlots = std::bit_ceil(uint64_t(2 * numPoints + 2));
+		uint64_t mask = numSlots - 1;
+		vector<uint32_t> slots(numSlots, 0);
+
+		for (int64_t i = 0; i < numPoints; i++) {
+			uint8_t* point = points + i * bytesPerPoint;
+			uint64_t slot = hashPosition(point) & mask;
+
+			bool isDuplicate = false;
+			while (slots[slot] != 0) {
+				uint8_t* other = points + int64_t(slots[slot] - 1) * bytesPerPoint;
+
+				if (memcmp(point, other, 12) == 0) {
+					isDuplicate = true;
+					break;
+				}
+
+				slot = (slot + 1) & mask;
+			}
+
+			int64_t location = onPoint(i, isDuplicate);
+
+			if (!isDuplicate) {
+				slots[slot] = uint32_t(location + 1);
+			}
+		}
+	}
+
+	int64_t countDuplicates(uint8_t* points, int64_t numPoints, int64_t bytesPerPoint) {
+		int64_t numDuplicates = 0;
+
+		visit(points, numPoints, bytesPerPoint, [&](int64_t i, bool isDuplicate) {
+			if (isDuplicate) {
+				numDuplicates++;
+			}
+
+			return i;
+		});
+
+		return numDuplicates;
+	}
+
+	int64_t removeDuplicates(uint8_t* points, int64_t numPoints, int64_t bytesPerPoint) {
+		int64_t numRemaining = 0;
+
+		// remaining points are moved right away, and the table refers to their new location
+		visit(points, numPoints, bytesPerPoint, [&](int64_t i, bool isDuplicate) -> int64_t {
+			if (isDuplicate) {
+				return -1;
+			}
+
+			int64_t target = numRemaining;
+
+			if (target != i) {
+				memcpy(points + target * bytesPerPoint, points + i * bytesPerPoint, bytesPerPoint);
+			}
+
+			numRemaining++;
+
+			return target;
+		});
+
+		return numRemaining;
+	}
+
+}
@@ -0,0 +1,262 @@
+
+// compares the two ways of counting points in the chunker's grid cells, for a range of thread counts:
+// - atomic: all threads increment a shared, dense grid of atomic counters, once per point
+// - histogram: each thread counts in its own CellHistogram, which are merged at the end, as in countPointsInCells()
+//
+// The cell indices are generated up front from a fixed seed, so runs are reproducible and only the counting is timed.
+// "scan" orders points along scan lines over a terrain, so that consecutive points are often in the same cell, as in las files.
+// "random" distributes them uniformly in random order, which is the worst case for both methods.
+//
+// usage: bench_cell_counting [--points <n>] [--grid <size>] [--distribution scan|random] [--threads <t1,t2,...>] [--repeat <n>]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cell_histogram.h"
+
+using std::atomic;
+using std::cout;
+using std::endl;
+using std::string;
+using std::thread;
+using std::vector;
+
+using chunker_countsort_laszip::CellCount;
+using chunker_countsort_laszip::CellHistogram;
+using chunker_countsort_laszip::mergeHistograms;
+
+// points per batch, as the chunker's batches
+constexpr int64_t batchSize = 1'000'000;
+
+double now() {
+	auto duration = std::chrono::steady_clock::now().time_since_epoch();
+
+	return std::chrono::duration<double>(duration).count();
+}
+
+int64_t splitBy3(int64_t a) {
+	int64_t x = a & 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffff;
+	x = (x | x << 16) & 0x1f0000ff0000ff;
+	x = (x | x << 8) & 0x100f00f00f00f00f;
+	x = (x | x << 4) & 0x10c30c30c30c30c3;
+	x = (x | x << 2) & 0x1249249249249249;
+
+	return x;
+}
+
+// same bit order as the chunker's cell indices
+int64_t mortonOf(int64_t ix, int64_t iy, int64_t iz) {
+	return splitBy3(iz) | splitBy3(iy) << 1 | splitBy3(ix) << 2;
+}
+
+vector<int64_t> generateCells(int64_t numPoints, int64_t gridSize, string distribution) {
+	vector<int64_t> cells(numPoints);
+
+	std::mt19937_64 rng(123);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+	auto toCell = [gridSize](double u) {
+		return std::clamp(int64_t(u * double(gridSize)), int64_t(0), gridSize - 1);
+	};
+
+	if (distribution == "random") {
+		for (int64_t i = 0; i < numPoints; i++) {
+			cells[i] = mortonOf(toCell(unit(rng)), toCell(unit(rng)), toCell(unit(rng)));
+		}
+	} else {
+		// scan lines along x, about one point per 1/8 of a cell, over a smooth terrain in the lower part of the box
+		int64_t pointsPerLine = 8 * gridSize;
+		int64_t numLines = (numPoints + pointsPerLine - 1) / pointsPerLine;
+
+		for (int64_t i = 0; i < numPoints; i++) {
+			int64_t line = i / pointsPerLine;
+			double x = double(i % pointsPerLine) / double(pointsPerLine);
+			double y = (double(line) + 0.5 * unit(rng)) / double(numLines);
+			double z = 0.25 + 0.1 * sin(12.0 * x) * cos(9.0 * y) + 0.01 * unit(rng);
+
+			cells[i] = mortonOf(toCell(x), toCell(y), toCell(z));
+		}
+	}
+
+	return cells;
+}
+
+// runs <count> on batches of <cells>, which the threads take in turn
+template<class Count>
+void processBatches(vector<int64_t>& cells, int64_t numThreads, Count count) {
+	atomic<int64_t> nextBatch = 0;
+	int64_t numBatches = (int64_t(cells.size()) + batchSize - 1) / batchSize;
+
+	vector<thread> threads;
+	for (int64_t t = 0; t < numThreads; t++) {
+		threads.emplace_back([&, t]() {
+			while (true) {
+				int64_t batch = nextBatch.fetch_add(1);
+
+				if (batch >= numBatches) {
+					break;
+				}
+
+				int64_t first = batch * batchSize;
+				int64_t last = std::min(first + batchSize, int64_t(cells.size()));
+
+				count(t, cells.data() + first, last - first);
+			}
+		});
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+vector<CellCount> countAtomic(vector<int64_t>& cells, int64_t gridSize, int64_t numThreads) {
+	vector<atomic<int32_t>> grid(gridSize * gridSize * gridSize);
+
+	processBatches(cells, numThreads, [&grid](int64_t threadIndex, int64_t* batch, int64_t numCells) {
+		for (int64_t i = 0; i < numCells; i++) {
+			grid[batch[i]].fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+
+	vector<CellCount> counts;
+	for (int64_t cell = 0; cell < int64_t(grid.size()); cell++) {
+		if (grid[cell] > 0) {
+			counts.push_back({ cell, grid[cell] });
+		}
+	}
+
+	return counts;
+}
+
+vector<CellCount> countHistograms(vector<int64_t>& cells, int64_t numThreads) {
+	vector<CellHistogram> histograms(numThreads);
+
+	processBatches(cells, numThreads, [&histograms](int64_t threadIndex, int64_t* batch, int64_t numCells) {
+		CellHistogram& histogram = histograms[threadIndex];
+
+		for (int64_t i = 0; i < numCells; i++) {
+			histogram.add(batch[i]);
+		}
+	});
+
+	vector<CellHistogram*> pointers;
+	for (auto& histogram : histograms) {
+		pointers.push_back(&histogram);
+	}
+
+	return mergeHistograms(pointers);
+}
+
+vector<int64_t> parseList(string text) {
+	vector<int64_t> values;
+	std::stringstream ss(text);
+	string value;
+
+	while (std::getline(ss, value, ',')) {
+		values.push_back(std::stoll(value));
+	}
+
+	return values;
+}
+
+int main(int argc, char** argv) {
+
+	int64_t numPoints = 50'000'000;
+	int64_t gridSize = 256;
+	int64_t numRepetitions = 3;
+	string distribution = "scan";
+	vector<int64_t> threadCounts;
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		string arg = argv[i];
+		string value = argv[i + 1];
+
+		if (arg == "--points") {
+			numPoints = std::stoll(value);
+		} else if (arg == "--grid") {
+			gridSize = std::stoll(value);
+		} else if (arg == "--distribution") {
+			distribution = value;
+		} else if (arg == "--threads") {
+			threadCounts = parseList(value);
+		} else if (arg == "--repeat") {
+			numRepetitions = std::stoll(value);
+		} else {
+			cout << "unknown argument " << arg << endl;
+
+			return 1;
+		}
+	}
+
+	if (threadCounts.empty()) {
+		int64_t numProcessors = std::max(1u, thread::hardware_concurrency());
+
+		for (int64_t numThreads : { 1, 2, 4, 8, 16, 24, 32, 48, 64, 96, 128 }) {
+			if (numThreads <= numProcessors) {
+				threadCounts.push_back(numThreads);
+			}
+		}
+
+		if (threadCounts.back() != numProcessors) {
+			threadCounts.push_back(numProcessors);
+		}
+	}
+
+	cout << "points: " << numPoints << ", grid: " << gridSize << "^3, distribution: " << distribution
+		<< ", hardware threads: " << thread::hardware_concurrency() << endl;
+
+	auto cells = generateCells(numPoints, gridSize, distribution);
+
+	cout << endl;
+	cout << std::setw(8) << "threads" << std::setw(14) << "atomic [s]" << std::setw(16) << "histogram [s]" << std::setw(10) << "speedup" << endl;
+
+	for (int64_t numThreads : threadCounts) {
+		double atomicDuration = 1e100;
+		double histogramDuration = 1e100;
+
+		vector<CellCount> atomicCounts;
+		vector<CellCount> histogramCounts;
+
+		// best of <numRepetitions>, including the merge and the conversion of the atomic grid to a list of cells
+		for (int64_t repetition = 0; repetition < numRepetitions; repetition++) {
+			double tStart = now();
+			atomicCounts = countAtomic(cells, gridSize, numThreads);
+			atomicDuration = std::min(atomicDuration, now() - tStart);
+
+			tStart = now();
+			histogramCounts = countHistograms(cells, numThreads);
+			histogramDuration = std::min(histogramDuration, now() - tStart);
+		}
+
+		bool isEqual = atomicCounts.size() == histogramCounts.size() && std::equal(atomicCounts.begin(), atomicCounts.end(), histogramCounts.begin(),
+			[](const CellCount& a, const CellCount& b) {
+				return a.cell == b.cell && a.count == b.count;
+			});
+
+		if (!isEqual) {
+			cout << "counts differ with " << numThreads << " threads" << endl;
+
+			return 1;
+		}
+
+		cout << std::fixed << std::setprecision(3);
+		cout << std::setw(8) << numThreads << std::setw(14) << atomicDuration << std::setw(16) << histogramDuration
+			<< std::setw(9) << std::setprecision(2) << (atomicDuration / histogramDuration) << "x" << endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,225 @@
+
+// converts a dense cluster of points inside a huge bounding box, which needs more octree levels than node keys
+// can encode. The converter must keep the nodes at the deepest level as oversized leaves instead of aborting,
+// and all points must end up in the octree.
+//
+// usage: test_deep_octree <path to PotreeConverter> <directory for temporary files>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+int numFailures = 0;
+
+#pragma pack(push, 1)
+struct PointFormat0 {
+	int32_t X;
+	int32_t Y;
+	int32_t Z;
+	uint16_t intensity;
+	uint8_t returnBits;
+	uint8_t classification;
+	int8_t scanAngle;
+	uint8_t userData;
+	uint16_t pointSourceID;
+};
+#pragma pack(pop)
+
+template<class T>
+void put(vector<uint8_t>& header, int64_t offset, T value) {
+	memcpy(header.data() + offset, &value, sizeof(T));
+}
+
+void writeLas(string path, vector<PointFormat0>& points, double scale) {
+
+	int32_t min[3] = { points[0].X, points[0].Y, points[0].Z };
+	int32_t max[3] = { points[0].X, points[0].Y, points[0].Z };
+
+	for (auto& point : points) {
+		int32_t xyz[3] = { point.X, point.Y, point.Z };
+
+		for (int64_t axis = 0; axis < 3; axis++) {
+			min[axis] = std::min(min[axis], xyz[axis]);
+			max[axis] = std::max(max[axis], xyz[axis]);
+		}
+	}
+
+	// LAS 1.2 header
+	vector<uint8_t> header(227, 0);
+	memcpy(header.data(), "LASF", 4);
+	put<uint8_t>(header, 24, 1);
+	put<uint8_t>(header, 25, 2);
+	put<uint16_t>(header, 94, 227);
+	put<uint32_t>(header, 96, 227);
+	put<uint32_t>(header, 100, 0);
+	put<uint8_t>(header, 104, 0);
+	put<uint16_t>(header, 105, sizeof(PointFormat0));
+	put<uint32_t>(header, 107, uint32_t(points.size()));
+
+	for (int64_t axis = 0; axis < 3; axis++) {
+		put<double>(header, 131 + 8 * axis, scale);
+		put<double>(header, 155 + 8 * axis, 0.0);
+		put<double>(header, 179 + 16 * axis, double(max[axis]) * scale);
+		put<double>(header, 187 + 16 * axis, double(min[axis]) * scale);
+	}
+
+	std::ofstream file(path, std::ios::binary);
+	file.write(reinterpret_cast<char*>(header.data()), header.size());
+	file.write(reinterpret_cast<char*>(points.data()), points.size() * sizeof(PointFormat0));
+}
+
+// sum of the points of all nodes in hierarchy.bin, following proxy nodes into the next chunks
+int64_t countPointsInHierarchy(vector<uint8_t>& hierarchy, int64_t offset, int64_t size) {
+	int64_t numPoints = 0;
+
+	for (int64_t i = offset; i < offset + size; i += 22) {
+		uint8_t type = hierarchy[i];
+		uint32_t nodePoints;
+		int64_t chunkOffset;
+		int64_t chunkSize;
+
+		memcpy(&nodePoints, hierarchy.data() + i + 2, 4);
+		memcpy(&chunkOffset, hierarchy.data() + i + 6, 8);
+		memcpy(&chunkSize, hierarchy.data() + i + 14, 8);
+
+		if (type == 2) {
+			numPoints += countPointsInHierarchy(hierarchy, chunkOffset, chunkSize);
+		} else {
+			numPoints += nodePoints;
+		}
+	}
+
+	return numPoints;
+}
+
+int64_t readJsonInteger(string json, string key) {
+	auto position = json.find("\"" + key + "\"");
+
+	if (position == string::npos) {
+		return -1;
+	}
+
+	position = json.find(':', position);
+
+	return std::stoll(json.substr(position + 1));
+}
+
+string readFile(string path) {
+	std::ifstream file(path, std::ios::binary);
+	std::stringstream ss;
+	ss << file.rdbuf();
+
+	return ss.str();
+}
+
+void testConversion(string converter, string workDir, string las, int64_t numPoints, string method) {
+
+	string outDir = workDir + "/" + method;
+	fs::remove_all(outDir);
+
+	string command = "\"" + converter + "\" \"" + las + "\" -o \"" + outDir + "\" -m " + method + " > \"" + outDir + ".log\" 2>&1";
+	int result = std::system(command.c_str());
+
+	if (result != 0) {
+		cout << "FAILED " << method << ": converter returned " << result << ", see " << outDir << ".log" << endl;
+		numFailures++;
+
+		return;
+	}
+
+	string metadata = readFile(outDir + "/metadata.json");
+	string hierarchyData = readFile(outDir + "/hierarchy.bin");
+	vector<uint8_t> hierarchy(hierarchyData.begin(), hierarchyData.end());
+
+	int64_t depth = readJsonInteger(metadata, "depth");
+	int64_t firstChunkSize = readJsonInteger(metadata, "firstChunkSize");
+	int64_t numPointsInHierarchy = countPointsInHierarchy(hierarchy, 0, firstChunkSize);
+
+	// poisson_average keeps all points in the children and adds averaged copies to the parents
+	bool isComplete = method == "poisson_average" ? numPointsInHierarchy >= numPoints : numPointsInHierarchy == numPoints;
+
+	if (!isComplete) {
+		cout << "FAILED " << method << ": hierarchy contains " << numPointsInHierarchy << " points, expected " << numPoints << endl;
+		numFailures++;
+	}
+
+	if (depth < 21) {
+		cout << "FAILED " << method << ": octree depth is " << depth << ", the test data doesn't reach the maximum depth" << endl;
+		numFailures++;
+	}
+
+	cout << method << ": " << numPointsInHierarchy << " points, depth " << depth << endl;
+}
+
+int main(int argc, char** argv) {
+
+	if (argc < 3) {
+		cout << "usage: test_deep_octree <path to PotreeConverter> <directory for temporary files>" << endl;
+
+		return 1;
+	}
+
+	string converter = argv[1];
+	string workDir = argv[2];
+	fs::create_directories(workDir);
+
+	// two points far apart, and a cluster of 64'000 distinct points in a box of 40 units. Nodes of the cluster
+	// still hold more than maxPointsPerChunk points at level 21. The scale is a power of two, so that the
+	// converter's requantization keeps the points distinct.
+	vector<PointFormat0> points;
+
+	PointFormat0 point = {};
+	point.X = -250'000'000;
+	point.Y = -250'000'000;
+	point.Z = -250'000'000;
+	points.push_back(point);
+
+	point.X = 250'000'000;
+	point.Y = 250'000'000;
+	point.Z = 250'000'000;
+	points.push_back(point);
+
+	for (int32_t x = 0; x < 40; x++) {
+		for (int32_t y = 0; y < 40; y++) {
+			for (int32_t z = 0; z < 40; z++) {
+				point.X = 1'000 + x;
+				point.Y = 1'000 + y;
+				point.Z = 1'000 + z;
+				point.intensity = uint16_t(x * 1'600 + y * 40 + z);
+				points.push_back(point);
+			}
+		}
+	}
+
+	string las = workDir + "/cluster.las";
+	writeLas(las, points, 0.25);
+
+	for (string method : { "poisson", "poisson_average", "random" }) {
+		testConversion(converter, workDir, las, points.size(), method);
+	}
+
+	if (numFailures > 0) {
+		cout << numFailures << " tests failed" << endl;
+
+		return 1;
+	}
+
+	cout << "all tests passed" << endl;
+
+	return 0;
+}
@@ -0,0 +1,324 @@
+
+// compares the SIMD versions of the grid kernels with the scalar version, and the scalar version with 
+// the formulas in grid_kernels.h, evaluated here without FMAs. Results must be identical, bit by bit, for random 
+// records as well as for points on and around the faces of the grid, for batches with tails and for odd strides.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "grid_kernels.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using grid_kernels::CellGrid;
+using grid_kernels::Kernels;
+
+struct Records {
+	int64_t stride = 0;
+	int64_t numPoints = 0;
+	vector<uint8_t> data;
+
+	Records(int64_t stride, int64_t numPoints) {
+		this->stride = stride;
+		this->numPoints = numPoints;
+
+		// the gathers read 4 bytes, so the last record must not end closer than that to the buffer's end
+		data.resize(stride * numPoints + 16, 0xCD);
+	}
+
+	void set(int64_t index, int32_t X, int32_t Y, int32_t Z) {
+		uint8_t* record = data.data() + index * stride;
+
+		memcpy(record + 0, &X, 4);
+		memcpy(record + 4, &Y, 4);
+		memcpy(record + 8, &Z, 4);
+	}
+};
+
+int numFailures = 0;
+
+// the formulas of grid_kernels.h, one multiplication or addition at a time so that they can't be contracted to FMAs
+
+int32_t readInt32(uint8_t* source) {
+	int32_t value;
+	memcpy(&value, source, 4);
+
+	return value;
+}
+
+double toWorld(int32_t X, double scale, double offset) {
+	volatile double scaled = double(X) * scale;
+
+	return scaled + offset;
+}
+
+// morton code with z as the least significant axis, as mortonEncode_magicbits(iz, iy, ix)
+int64_t mortonOf(int64_t ix, int64_t iy, int64_t iz) {
+	int64_t morton = 0;
+
+	for (int64_t bit = 0; bit < 21; bit++) {
+		morton |= ((iz >> bit) & 1) << (3 * bit + 0);
+		morton |= ((iy >> bit) & 1) << (3 * bit + 1);
+		morton |= ((ix >> bit) & 1) << (3 * bit + 2);
+	}
+
+	return morton;
+}
+
+void quantizeReference(Records& records, int64_t numPoints, CellGrid& grid, Vector3 targetScale, Vector3 targetOffset, vector<int32_t>& target) {
+	double* scale = &grid.scale.x;
+	double* offset = &grid.offset.x;
+	double* pTargetScale = &targetScale.x;
+	double* pTargetOffset = &targetOffset.x;
+
+	for (int64_t i = 0; i < numPoints; i++) {
+		for (int64_t axis = 0; axis < 3; axis++) {
+			double x = toWorld(readInt32(records.data.data() + i * records.stride + 4 * axis), scale[axis], offset[axis]);
+
+			target[3 * i + axis] = int32_t((x - pTargetOffset[axis]) / pTargetScale[axis]);
+		}
+	}
+}
+
+void computeCellIndicesReference(Records& records, int64_t numPoints, CellGrid& grid, vector<int64_t>& indices) {
+	double* scale = &grid.scale.x;
+	double* offset = &grid.offset.x;
+	double* min = &grid.min.x;
+	double* size = &grid.size.x;
+	double dGridSize = double(grid.gridSize);
+
+	for (int64_t i = 0; i < numPoints; i++) {
+		int64_t cell[3];
+		bool inBox = true;
+
+		for (int64_t axis = 0; axis < 3; axis++) {
+			double x = toWorld(readInt32(records.data.data() + i * records.stride + 4 * axis), scale[axis], offset[axis]);
+			double u = (x - min[axis]) / size[axis];
+
+			inBox = inBox && u >= 0.0 && u <= 1.0;
+
+			if (inBox) {
+				cell[axis] = int64_t(std::min(dGridSize * u, dGridSize - 1.0));
+			}
+		}
+
+		indices[i] = inBox ? mortonOf(cell[0], cell[1], cell[2]) : -1;
+	}
+}
+
+void computeMortonIndicesReference(Records& records, int64_t numPoints, CellGrid& grid, vector<int64_t>& indices) {
+	double* scale = &grid.scale.x;
+	double* offset = &grid.offset.x;
+	double* min = &grid.min.x;
+	double* size = &grid.size.x;
+
+	for (int64_t i = 0; i < numPoints; i++) {
+		int64_t cell[3];
+
+		for (int64_t axis = 0; axis < 3; axis++) {
+			double x = toWorld(readInt32(records.data.data() + i * records.stride + 4 * axis), scale[axis], offset[axis]);
+			int64_t c = double(grid.gridSize) * (x - min[axis]) / size[axis];
+
+			cell[axis] = std::max(int64_t(0), std::min(c, grid.gridSize - 1));
+		}
+
+		indices[i] = mortonOf(cell[0], cell[1], cell[2]);
+	}
+}
+
+template<class T>
+void compare(string test, string kernel, vector<T>& expected, vector<T>& actual) {
+	for (int64_t i = 0; i < int64_t(expected.size()); i++) {
+		if (expected[i] != actual[i]) {
+			cout << "FAILED " << test << " (" << kernel << "): value " << i << " is " << actual[i] << ", expected " << expected[i] << endl;
+			numFailures++;
+
+			return;
+		}
+	}
+}
+
+// runs all kernels on all prefixes of <records> up to 17 points, which covers every tail length, and on all records
+void testKernels(string test, vector<Kernels>& kernels, Records& records, CellGrid& grid, Vector3 targetScale, Vector3 targetOffset) {
+
+	vector<int64_t> counts;
+	for (int64_t numPoints = 0; numPoints <= std::min(records.numPoints, int64_t(17)); numPoints++) {
+		counts.push_back(numPoints);
+	}
+	counts.push_back(records.numPoints);
+
+	for (int64_t numPoints : counts) {
+		Kernels& scalar = kernels[0];
+
+		vector<int32_t> expectedQuantized(3 * numPoints);
+		vector<int64_t> expectedCells(numPoints);
+		vector<int64_t> expectedMorton(numPoints);
+
+		scalar.quantize(records.data.data(), records.stride, numPoints, grid.scale, grid.offset, targetScale, targetOffset, expectedQuantized.data());
+		scalar.computeCellIndices(records.data.data(), records.stride, numPoints, grid, expectedCells.data());
+		scalar.computeMortonIndices(records.data.data(), records.stride, numPoints, grid, expectedMorton.data());
+
+		{
+			string name = test + ", " + std::to_string(numPoints) + " points";
+
+			vector<int32_t> quantized(3 * numPoints);
+			vector<int64_t> cells(numPoints);
+			vector<int64_t> morton(numPoints);
+
+			quantizeReference(records, numPoints, grid, targetScale, targetOffset, quantized);
+			computeCellIndicesReference(records, numPoints, grid, cells);
+			computeMortonIndicesReference(records, numPoints, grid, morton);
+
+			compare(name + ", quantize", "scalar", quantized, expectedQuantized);
+			compare(name + ", computeCellIndices", "scalar", cells, expectedCells);
+			compare(name + ", computeMortonIndices", "scalar", morton, expectedMorton);
+		}
+
+		for (int64_t i = 1; i < int64_t(kernels.size()); i++) {
+			Kernels& simd = kernels[i];
+			string name = test + ", " + std::to_string(numPoints) + " points";
+
+			vector<int32_t> quantized(3 * numPoints);
+			vector<int64_t> cells(numPoints);
+			vector<int64_t> morton(numPoints);
+
+			simd.quantize(records.data.data(), records.stride, numPoints, grid.scale, grid.offset, targetScale, targetOffset, quantized.data());
+			simd.computeCellIndices(records.data.data(), records.stride, numPoints, grid, cells.data());
+			simd.computeMortonIndices(records.data.data(), records.stride, numPoints, grid, morton.data());
+
+			compare(name + ", quantize", simd.name, expectedQuantized, quantized);
+			compare(name + ", computeCellIndices", simd.name, expectedCells, cells);
+			compare(name + ", computeMortonIndices", simd.name, expectedMorton, morton);
+		}
+	}
+}
+
+// random coordinates in and slightly around the grid, with a scale and offset as in LAS files
+void testRandom(vector<Kernels>& kernels, int64_t stride, int64_t gridSize, int64_t seed) {
+	std::mt19937_64 rng(seed);
+	std::uniform_int_distribution<int32_t> coordinate(-1'100, 101'100);
+
+	CellGrid grid;
+	grid.scale = { 0.001, 0.001, 0.001 };
+	grid.offset = { 637'123.456, 851'234.567, 123.789 };
+	grid.min = { 637'123.456, 851'234.567, 123.789 };
+	grid.size = { 100.0, 100.0, 100.0 };
+	grid.gridSize = gridSize;
+
+	Records records(stride, 1'000);
+	for (int64_t i = 0; i < records.numPoints; i++) {
+		records.set(i, coordinate(rng), coordinate(rng), coordinate(rng));
+	}
+
+	Vector3 targetScale = { 0.01, 0.01, 0.01 };
+	Vector3 targetOffset = { 637'000.0, 851'000.0, 100.0 };
+
+	string test = "random, stride " + std::to_string(stride) + ", grid " + std::to_string(gridSize);
+	testKernels(test, kernels, records, grid, targetScale, targetOffset);
+}
+
+// points on the min and max faces, just outside of them, and at u == 1.0
+void testEdges(vector<Kernels>& kernels, int64_t stride, int64_t gridSize) {
+
+	CellGrid grid;
+	grid.scale = { 1.0, 0.5, 0.25 };
+	grid.offset = { 0.0, 0.0, 0.0 };
+	grid.min = { 0.0, 0.0, 0.0 };
+	grid.size = { 1'000.0, 500.0, 250.0 };
+	grid.gridSize = gridSize;
+
+	// coordinates of min, max and their neighbours, and of points far outside
+	vector<int32_t> values = {
+		0, 1, -1, 999, 1'000, 1'001, 500,
+		-1'000'000, 1'000'000,
+		std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max()
+	};
+
+	int64_t numValues = values.size();
+	Records records(stride, numValues * numValues * numValues);
+	for (int64_t i = 0; i < records.numPoints; i++) {
+		int32_t X = values[i % numValues];
+		int32_t Y = values[(i / numValues) % numValues];
+		int32_t Z = values[i / (numValues * numValues)];
+
+		records.set(i, X, Y, Z);
+	}
+
+	// quantization is undefined outside of the int32 range, so it stays within it
+	Vector3 targetScale = { 1.0, 1.0, 1.0 };
+	Vector3 targetOffset = { 0.0, 0.0, 0.0 };
+
+	string test = "edges, stride " + std::to_string(stride) + ", grid " + std::to_string(gridSize);
+	testKernels(test, kernels, records, grid, targetScale, targetOffset);
+}
+
+// quantization of values that are close to integers, and of negative values, which truncate towards zero
+void testQuantizeRounding(vector<Kernels>& kernels) {
+
+	CellGrid grid;
+	grid.scale = { 0.001, 0.01, 0.1 };
+	grid.offset = { -0.0005, 0.3, -2'000'000.5 };
+	grid.min = { 0.0, 0.0, 0.0 };
+	grid.size = { 1.0, 1.0, 1.0 };
+	grid.gridSize = 2;
+
+	Records records(67, 2'000);
+	for (int64_t i = 0; i < records.numPoints; i++) {
+		int32_t value = int32_t(i) - 1'000;
+		records.set(i, value, value * 3, value * 7);
+	}
+
+	Vector3 targetScale = { 0.003, 0.1, 0.7 };
+	Vector3 targetOffset = { 0.0, -0.2, -2'000'000.0 };
+
+	testKernels("quantize rounding", kernels, records, grid, targetScale, targetOffset);
+}
+
+int main(int argc, char** argv) {
+
+	auto kernels = grid_kernels::getSupportedKernels();
+
+	cout << "kernels:";
+	for (auto& kernel : kernels) {
+		cout << " " << kernel.name;
+	}
+	cout << endl;
+
+	if (kernels.size() == 1) {
+		cout << "no SIMD kernels are supported by this CPU, nothing to compare" << endl;
+	}
+
+	// 12: only coordinates, 26: LAS format 2, 67: odd stride
+	vector<int64_t> strides = { 12, 26, 67 };
+
+	// 4096 is the largest grid of the chunker, 2^21 the largest that morton indices can encode
+	vector<int64_t> gridSizes = { 1, 2, 128, 4'096, 1 << 21 };
+
+	for (int64_t stride : strides) {
+		for (int64_t gridSize : gridSizes) {
+			testRandom(kernels, stride, gridSize, stride * gridSize);
+			testEdges(kernels, stride, gridSize);
+		}
+	}
+
+	testQuantizeRounding(kernels);
+
+	if (numFailures > 0) {
+		cout << numFailures << " tests failed" << endl;
+
+		return 1;
+	}
+
+	cout << "all tests passed" << endl;
+
+	return 0;
+}
@@ -1,6 +1,7 @@
 
 import {promises as fsp} from "fs";
 import { parse } from "path";
+import { brotliDecompressSync } from "zlib";
 
 let chunkDir = "D:/temp/converted_bad/chunks";
 
@@ -51,10 +52,70 @@ async function getChunkFiles(){
 	return files;
 }
 
-async function transformChunk(chunkpath, metadata, attributes){
+// inverse of chunk_codec::encode(): one brotli compressed stream per byte of the point layout, positions as zigzag deltas
+function decodeBlock(encoded, numPoints, bytesPerPoint){
+	let transposed = brotliDecompressSync(encoded);
+	let data = Buffer.alloc(numPoints * bytesPerPoint);
 
+	let previous = [0, 0, 0];
+	for(let i = 0; i < numPoints; i++){
+		for(let c = 0; c < 3; c++){
+			let delta = 0;
+			for(let b = 0; b < 4; b++){
+				delta = (delta | (transposed[(4 * c + b) * numPoints + i] << (8 * b))) >>> 0;
+			}
+
+			let value = (previous[c] + ((delta >>> 1) ^ -(delta & 1))) | 0;
+			previous[c] = value;
+
+			data.writeInt32LE(value, i * bytesPerPoint + 4 * c);
+		}
+
+		for(let b = 12; b < bytesPerPoint; b++){
+			data[i * bytesPerPoint + b] = transposed[b * numPoints + i];
+		}
+	}
 
-	let data = await fsp.readFile(chunkpath);
+	return data;
+}
+
+// chunks are either stored in one file and listed in metadata.chunks, or one file per chunk
+async function readChunk(chunkpath, chunk, attributes){
+
+	if(!chunk){
+		return fsp.readFile(chunkpath);
+	}
+
+	if(chunk.blocks){
+		let handle = await fsp.open(chunkpath, "r");
+		let decoded = [];
+
+		for(let block of chunk.blocks){
+			let encoded = Buffer.alloc(block.size);
+			await handle.read(encoded, 0, block.size, block.offset);
+
+			decoded.push(decodeBlock(encoded, block.numPoints, attributes.bytes));
+		}
+
+		await handle.close();
+
+		return Buffer.concat(decoded);
+	}
+
+	let size = chunk.numPoints * attributes.bytes;
+	let data = Buffer.alloc(size);
+
+	let handle = await fsp.open(chunkpath, "r");
+	await handle.read(data, 0, size, chunk.offset);
+	await handle.close();
+
+	return data;
+}
+
+async function transformChunk(chunkpath, metadata, attributes, chunk){
+
+
+	let data = await readChunk(chunkpath, chunk, attributes);
 	let numPoints = data.byteLength / attributes.bytes;
 
 	let buff_header = Buffer.alloc(375);
@@ -106,7 +167,7 @@ async function transformChunk(chunkpath, metadata, attributes){
 
 	}
 
-	let chunkPathLas = `${chunkpath}.las`
+	let chunkPathLas = chunk ? `${chunkDir}/${chunk.id}.las` : `${chunkpath}.las`
 	await fsp.writeFile(chunkPathLas, buff_header);
 	await fsp.writeFile(chunkPathLas, buff_points, {flag: "a"});
 
@@ -121,6 +182,17 @@ async function run(){
 	let metadata = JSON.parse(data);
 	let attributes = parseAttributes(metadata);
 
+	if(metadata.chunks){
+		let chunkIDs = ["r060", "r062", "r063", "r064", "r066"];
+		let chunks = metadata.chunks.filter(chunk => chunkIDs.includes(chunk.id));
+
+		for(let chunk of chunks){
+			transformChunk(`${chunkDir}/${metadata.chunkFile}`, metadata, attributes, chunk);
+		}
+
+		return;
+	}
+
 	let chunkFiles = await getChunkFiles(chunkDir);
 
 	chunkFiles = ["r060.bin", "r062.bin", "r063.bin", "r064.bin", "r066.bin"];